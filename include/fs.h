@@ -5,52 +5,441 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include "fs_bitmap.h"
+#include "fs_log.h"
 
 #define DISK_NAME "disk.sim"
-#define DISK_SIZE (1024 * 1024)
-#define METADATA_SIZE 4096
-#define MAX_FILES 48
+#define FS_MAGIC "SIMPLEFS"
+#define FS_VERSION 9
+// Longest name of one path component plus its terminator
 #define FILENAME_MAX_LEN 32
-#define BLOCK_SIZE 512
+// Most fragments a file's blocks may be spread over
+#define FS_MAX_EXTENTS 8
 
+// Geometry used by fs_format() when none is given
+#define DEFAULT_DISK_SIZE (1024 * 1024)
+#define DEFAULT_MAX_FILES 48
+#define DEFAULT_BLOCK_SIZE 512
+
+// First bytes of the image. Every region after it starts on a block
+// boundary: file entries, extents, block bitmap, reference counts,
+// checksums, journal, data. Data block N lives at data_offset + N * block_size.
+struct Superblock {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t volume_size;
+    uint64_t max_files;
+    uint64_t file_count;
+    uint64_t entry_offset;
+    uint64_t bitmap_offset;
+    uint64_t bitmap_bytes;
+    uint64_t data_offset;
+    uint64_t data_blocks;
+    uint64_t journal_offset;
+    uint64_t journal_bytes;
+    uint64_t refcount_offset;
+    uint64_t refcount_bytes;
+    uint64_t checksum_offset;
+    uint64_t checksum_bytes;
+    // File the defragmenter is moving (entry slot + 1, 0 if none), the
+    // extent it goes to and how many bytes are copied there so far.
+    uint64_t defrag_slot;
+    uint64_t defrag_to;
+    uint64_t defrag_count;
+    uint64_t defrag_done;
+    // Snapshot taken by the last backup, 0 before the first one
+    uint64_t backup_id;
+    uint64_t extent_offset;
+    uint64_t extent_bytes;
+    // Which of the file's extents the defragmenter is moving
+    uint64_t defrag_extent;
+    char reserved[512 - 8 - 2 * sizeof(uint32_t) - 22 * sizeof(uint64_t)];
+};
+
+// Run of data blocks, or with start FS_HOLE a run of a file's blocks that
+// have none behind them and read as zeros
+struct FileExtent {
+    uint64_t start;
+    uint64_t count;
+};
+
+#define FS_HOLE UINT64_MAX
+
+// How a file's contents are kept
+enum FsCodec : uint8_t {
+    FS_CODEC_NONE = 0,
+    // in independently compressed chunks of FS_COMPRESS_CHUNK bytes (at
+    // least a block), so a read only expands the chunks it touches
+    FS_CODEC_LZ = 1,
+};
+
+#define FS_COMPRESS_CHUNK (64 * 1024)
+
+enum FsEntryType : uint8_t {
+    FS_TYPE_FILE = 0,
+    FS_TYPE_DIR = 1,
+    // holds the tables of a snapshot; kept out of every directory
+    FS_TYPE_SNAPSHOT = 2,
+};
+
+// FileEntry::parent of the entries in the root directory, which has no slot
+#define FS_ROOT_DIR 0xFFFFFFFFu
+// FileEntry::parent of snapshot entries
+#define FS_SNAPSHOT_DIR 0xFFFFFFFEu
+
+// A file's blocks are the first extent_count extents of its row in the
+// extent table, in file order, together exactly blocks_for(size) blocks,
+// holes included.
+// size counts the bytes the blocks hold; for a compressed file that is the
+// compressed form and raw_size is the length of the contents.
+// Directories are entries too, without blocks; an entry's filename is its
+// name inside the directory in slot `parent`.
 struct FileEntry {
     char filename[FILENAME_MAX_LEN];
-    int size;
-    int start_block;
+    uint64_t size;
+    uint64_t raw_size;
     uint32_t created;
+    uint32_t extent_count;
     bool used;
-    char padding[3];
+    uint8_t codec;
+    uint8_t type;
+    char padding;
+    uint32_t parent;
 };
 
+static_assert(sizeof(Superblock) == 512, "Superblock must stay 512 bytes");
+static_assert(sizeof(FileEntry) == 64, "FileEntry must stay 64 bytes");
+
+// In-memory copy of the metadata regions, sized from the superblock.
 struct Metadata {
-    int file_count;
-    FileEntry entries[MAX_FILES];
-    char reserved[METADATA_SIZE - sizeof(int) - sizeof(FileEntry) * MAX_FILES];
+    Superblock superblock;
+    std::vector<FileEntry> entries;
+    // FS_MAX_EXTENTS per entry slot
+    std::vector<FileExtent> extents;
+    BlockBitmap bitmap;
+    // Per data block: how many files share it besides the first one
+    std::vector<uint16_t> refs;
+    // Per data block: CRC32C of the file bytes it holds, up to the end of
+    // the file for its last block
+    std::vector<uint32_t> sums;
+};
+
+struct FsGeometry {
+    uint64_t volume_size = DEFAULT_DISK_SIZE;
+    uint32_t block_size = DEFAULT_BLOCK_SIZE;
+    uint64_t max_files = DEFAULT_MAX_FILES;
+    // 0 sizes the journal from the volume: 1/64 of it, 64 KiB to 64 MiB
+    uint64_t journal_bytes = 0;
 };
 
+// Largest piece the streaming functions hand out or ask for at once
+#define FS_CHUNK_SIZE (256 * 1024)
+
+// Receives the next piece of a file; returning false stops the stream.
+typedef std::function<bool(const char *data, int64_t size)> FsChunkFn;
+// Fills the next size bytes of a file being written; false aborts the write.
+typedef std::function<bool(char *data, int64_t size)> FsFillFn;
+
+// Where two files differ: the offset of the first differing byte (-1 when
+// they are equal) and the runs of differing blocks as (first block, count).
+// Bytes past the end of the shorter file count as different.
+struct FsDiffReport {
+    int64_t first_difference = -1;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+};
+
+// One entry of a directory listing
+struct FsDirEntry {
+    std::string name;
+    bool directory;
+    uint64_t size;      // bytes of contents, 0 for a directory
+    uint64_t stored;    // bytes its blocks hold, fewer when compressed
+    uint32_t created;
+};
+
+// A snapshot as fs_snapshot_list shows it
+struct FsSnapshotInfo {
+    std::string name;
+    uint32_t created;
+    uint64_t files;     // files and directories it holds
+};
+
+enum FsChangeKind {
+    FS_CHANGE_ADDED,
+    FS_CHANGE_REMOVED,
+    FS_CHANGE_MODIFIED,
+};
+
+// A path whose file or directory differs between two states of the volume
+struct FsSnapshotChange {
+    std::string path;
+    FsChangeKind kind;
+};
+
+struct FsMountOptions {
+    // Map the whole image and move data with memcpy instead of pread/pwrite.
+    bool use_mmap = false;
+    // Changes go to the journal in transactions. With sync_each_op every
+    // change is durable when its call returns; calls that finish together
+    // share one commit. Otherwise a commit is made every commit_ops changes
+    // or commit_ms milliseconds, and by fs_flush, fs_sync and unmount.
+    bool sync_each_op = false;
+    int commit_ops = 64;
+    int commit_ms = 1000;
+    // fs_write looks for a file written earlier with the same contents and
+    // shares its blocks instead of storing them again.
+    bool dedup = false;
+    // Reads check the blocks they touch against their checksums first and
+    // fail on a mismatch. Costs a second pass over the data.
+    bool verify_reads = false;
+    // Bytes of image pages cached inside the process, with write-back,
+    // CLOCK eviction and read-ahead; 0 leaves caching to the kernel. At
+    // least 4 MiB; ignored with use_mmap.
+    uint64_t cache_bytes = 0;
+    // With a cache: open the image with O_DIRECT so pages are not held a
+    // second time in the kernel's page cache.
+    bool direct_io = false;
+    // Send the I/O of each call to the kernel as one io_uring submission.
+    // Falls back to preadv/pwritev where the kernel has no io_uring;
+    // ignored with use_mmap or a cache.
+    bool io_uring = false;
+};
+
+// A mounted disk image: the open image and the Metadata kept in memory.
+// Only the parts of the Metadata an operation changed are written back.
+// Operations on a handle may be called from several threads at once;
+// mount, unmount and format may not overlap with anything else on it.
+struct FsHandle;
+
+FsHandle *fs_mount(const std::string &path = DISK_NAME, const FsMountOptions &options = FsMountOptions());
+void fs_unmount(FsHandle *fs);
+// Commits the open journal transaction.
+bool fs_flush(FsHandle *fs);
+// fs_flush plus a barrier (msync or fdatasync) making all writes durable.
+bool fs_sync(FsHandle *fs);
+// Whether fs moves data through an io_uring.
+bool fs_uses_uring(FsHandle *fs);
+
+// Handle used by the functions without an FsHandle argument, mounted on
+// DISK_NAME the first time it is needed.
+FsHandle *fs_default();
+
 // File system interface
-bool fs_format();
+bool fs_format(const FsGeometry &geometry = FsGeometry());
+bool fs_format(const std::string &path, const FsGeometry &geometry = FsGeometry());
 bool fs_load_metadata(Metadata &metadata);
 bool fs_save_metadata(const Metadata &metadata);
 bool fs_create(const std::string &filename);
 bool fs_delete(const std::string &filename);
-bool fs_write(const std::string &filename, const char *data, int size);
-bool fs_read(const std::string &filename, int offset, int size, char *buffer);
+bool fs_write(const std::string &filename, const char *data, int64_t size);
+bool fs_read(const std::string &filename, int64_t offset, int64_t size, char *buffer);
+bool fs_write_at(const std::string &filename, int64_t offset, const char *data, int64_t size);
+int64_t fs_read_at(const std::string &filename, int64_t offset, char *buffer, int64_t size);
+bool fs_write_chunks(const std::string &filename, int64_t size, const FsFillFn &fill);
+bool fs_read_chunks(const std::string &filename, int64_t offset, int64_t size, const FsChunkFn &fn);
 void fs_ls();
+void fs_ls(const std::string &path);
+bool fs_mkdir(const std::string &path);
+bool fs_rmdir(const std::string &path);
 bool fs_rename(const std::string &old_name, const std::string &new_name);
 bool fs_exists(const std::string &filename);
-int fs_size(const std::string &filename);
-bool fs_append(const std::string &filename, const char *data, int size);
-bool fs_truncate(const std::string &filename, int new_size);
+int64_t fs_size(const std::string &filename);
+bool fs_append(const std::string &filename, const char *data, int64_t size);
+bool fs_truncate(const std::string &filename, int64_t new_size);
+bool fs_punch_hole(const std::string &filename, int64_t offset, int64_t length);
+bool fs_set_codec(const std::string &filename, FsCodec codec);
 bool fs_copy(const std::string &src_filename, const std::string &dest_filename);
 bool fs_mv(const std::string &old_name, const std::string &new_name);
 void fs_defragment();
-void fs_check_integrity();
+bool fs_defragment_step(int max_ms);
+bool fs_check_integrity();
 bool fs_backup(const std::string &backup_filename);
+bool fs_backup_incremental(const std::string &backup_filename);
 bool fs_restore(const std::string &backup_filename);
+bool fs_restore_chain(const std::vector<std::string> &backup_filenames);
 void fs_cat(const std::string &filename);
 bool fs_diff(const std::string &file1, const std::string &file2);
-void fs_log(const std::string &message);
+bool fs_diff_report(const std::string &file1, const std::string &file2, FsDiffReport &report);
+bool fs_snapshot_create(const std::string &name);
+bool fs_snapshot_delete(const std::string &name);
+bool fs_snapshot_list(std::vector<FsSnapshotInfo> &snapshots);
+int64_t fs_snapshot_size(const std::string &snapshot, const std::string &filename);
+int64_t fs_snapshot_read(const std::string &snapshot, const std::string &filename, int64_t offset, char *buffer,
+                         int64_t size);
+bool fs_snapshot_diff(const std::string &from, const std::string &to, std::vector<FsSnapshotChange> &changes);
+bool fs_snapshot_rollback(const std::string &name);
+bool fs_backup_snapshot(const std::string &snapshot, const std::string &backup_filename);
+bool fs_import_tree(const std::string &host_dir, const std::string &path);
+bool fs_export_tree(const std::string &path, const std::string &host_dir);
+
+// Same operations on an explicitly mounted handle. Names are paths:
+// components separated by '/', each shorter than FILENAME_MAX_LEN, from the
+// root whether or not they start with '/'.
+bool fs_load_metadata(FsHandle *fs, Metadata &metadata);
+bool fs_save_metadata(FsHandle *fs, const Metadata &metadata);
+bool fs_create(FsHandle *fs, const std::string &filename);
+bool fs_delete(FsHandle *fs, const std::string &filename);
+bool fs_write(FsHandle *fs, const std::string &filename, const char *data, int64_t size);
+bool fs_read(FsHandle *fs, const std::string &filename, int64_t offset, int64_t size, char *buffer);
+// Writes size bytes at offset and keeps the rest of the file. Writing past
+// the end extends it, with zeros in any gap; whole blocks of it become a
+// hole. Only the blocks written to are
+// replaced: they go to fresh blocks, so the old bytes stay intact until the
+// change is committed, and bytes past the old end are written in place.
+bool fs_write_at(FsHandle *fs, const std::string &filename, int64_t offset, const char *data, int64_t size);
+// Reads up to size bytes from offset like pread: returns how many were read,
+// fewer at the end of the file, or -1.
+int64_t fs_read_at(FsHandle *fs, const std::string &filename, int64_t offset, char *buffer, int64_t size);
+// Streaming versions of fs_write and fs_read: memory use is bounded by
+// FS_CHUNK_SIZE whatever the file size. An aborted write leaves the file
+// with the bytes filled so far.
+bool fs_write_chunks(FsHandle *fs, const std::string &filename, int64_t size, const FsFillFn &fill);
+bool fs_read_chunks(FsHandle *fs, const std::string &filename, int64_t offset, int64_t size, const FsChunkFn &fn);
+// Like fs_read, but returns the bytes in place. With use_mmap, when the bytes
+// lie in one run of blocks, the view points into the mapping and lives until
+// unmount; otherwise it is a per-thread copy that the next fs_read_view call
+// on the same thread replaces.
+bool fs_read_view(FsHandle *fs, const std::string &filename, int64_t offset, int64_t size, std::string_view &view);
+// Prints the root directory, or the one at path, a page at a time.
+void fs_ls(FsHandle *fs);
+void fs_ls(FsHandle *fs, const std::string &path);
+// Up to count entries of the directory at path in name order, starting
+// after the name `after` ("" for the first page). False if path is not a
+// directory.
+bool fs_list(FsHandle *fs, const std::string &path, const std::string &after, size_t count,
+             std::vector<FsDirEntry> &page);
+// Creates a directory inside an existing one.
+bool fs_mkdir(FsHandle *fs, const std::string &path);
+// Removes an empty directory.
+bool fs_rmdir(FsHandle *fs, const std::string &path);
+// Renames a file or directory, to another directory too. Only the entry
+// changes, whatever the size of the file or the tree under it; a directory
+// cannot move into itself.
+bool fs_rename(FsHandle *fs, const std::string &old_name, const std::string &new_name);
+// True for directories as well as files.
+bool fs_exists(FsHandle *fs, const std::string &filename);
+int64_t fs_size(FsHandle *fs, const std::string &filename);
+bool fs_append(FsHandle *fs, const std::string &filename, const char *data, int64_t size);
+// Cuts a file short or extends it with zeros. Either way only the extents
+// change: blocks past the new end are given back, and added ones are a hole.
+// Growing returns false, changing nothing, when the extent row has no room
+// for the hole.
+bool fs_truncate(FsHandle *fs, const std::string &filename, int64_t new_size);
+// Makes [offset, offset + length) of a file read as zeros, giving back the
+// blocks wholly inside it; the size stays. False, changing nothing, when the
+// extent row has no room for the hole. A compressed file gets zeros written
+// instead, which take next to no room in it.
+bool fs_punch_hole(FsHandle *fs, const std::string &filename, int64_t offset, int64_t length);
+// Keeps a file's contents in the given form from now on, converting what
+// it holds. Every call works the same on a compressed file: a change
+// inside it rewrites just the chunks it touches, anything else re-encodes
+// the file from the first chunk touched to the end.
+bool fs_set_codec(FsHandle *fs, const std::string &filename, FsCodec codec);
+// The copy shares the blocks of the source; whichever file is changed
+// first gets blocks of its own.
+bool fs_copy(FsHandle *fs, const std::string &src_filename, const std::string &dest_filename);
+bool fs_mv(FsHandle *fs, const std::string &old_name, const std::string &new_name);
+// Packs the used blocks into one run from block 0, moving as little as it
+// can: files past the end of that run go into holes before it, largest
+// first. Runs as a series of fs_defragment_step calls.
+void fs_defragment(FsHandle *fs);
+// Does at most about max_ms of defragmenting and returns true once nothing
+// is left to move. Only the file being moved is locked, and the move in
+// progress is kept in the superblock, so steps may be spread out while the
+// volume is in use and a move continues after a remount.
+bool fs_defragment_step(FsHandle *fs, int max_ms);
+// Full scrub: reports overlapping extents, bitmap and reference count
+// mismatches, and blocks whose contents no longer match their checksums;
+// true when there are none. The data is read by `threads` threads at once
+// (0: one per core) while writers wait.
+bool fs_check_integrity(FsHandle *fs, int threads = 0);
+// Full copy of the image. Each backup is a new snapshot, and the handle
+// tracks which blocks change after it. Backups and restores move the image
+// in block ranges on `threads` threads at once (0: one per core).
+bool fs_backup(FsHandle *fs, const std::string &backup_filename, int threads = 0);
+// Only the blocks changed since the last backup, with a manifest of their
+// checksums. Needs a full backup first.
+bool fs_backup_incremental(FsHandle *fs, const std::string &backup_filename, int threads = 0);
+bool fs_restore(FsHandle *fs, const std::string &backup_filename, int threads = 0);
+// Restores a full backup followed by increments, each taken after the
+// previous one. The image is replaced only once all of them applied. If the
+// new image then cannot be reopened, false, and every call on the handle but
+// another restore or fs_unmount fails.
+bool fs_restore_chain(FsHandle *fs, const std::vector<std::string> &backup_filenames, int threads = 0);
+// Copies the directory tree host_dir outside the image into the directory
+// path ("" for the root), creating the directories on the way and
+// replacing files of the same name. Files are placed back to back in
+// batches, each given its blocks up front, then read on `threads` threads
+// (0: one per core) that write runs of consecutive blocks, spanning file
+// boundaries, in one call each. Entries other than files and directories,
+// and names too long for the image, are skipped. Other file operations
+// wait until a batch is committed.
+bool fs_import_tree(FsHandle *fs, const std::string &host_dir, const std::string &path, int threads = 0);
+// Copies the directory path of the image and everything under it to
+// host_dir, which is created if missing, on `threads` threads. Each host
+// file is sized in full before its contents are written. Files do not
+// change while the export runs.
+bool fs_export_tree(FsHandle *fs, const std::string &path, const std::string &host_dir, int threads = 0);
+void fs_cat(FsHandle *fs, const std::string &filename);
+// Whether two files hold the same bytes. Blocks the files share, and blocks
+// whose checksums differ, are settled without reading them.
+bool fs_diff(FsHandle *fs, const std::string &file1, const std::string &file2);
+// Compares all of two files and fills report; false if either is missing
+// or cannot be read.
+bool fs_diff_report(FsHandle *fs, const std::string &file1, const std::string &file2, FsDiffReport &report);
+
+// Snapshots: named, read-only states of the whole volume. Taking one copies
+// the entry and extent tables, not the data: its blocks are shared with the
+// live files, and a change to a live file puts the changed blocks in fresh
+// ones, as for files sharing blocks through fs_copy. A block goes back to
+// the free space once neither a live file nor any snapshot holds it.
+// The snapshot is committed before fs_snapshot_create returns.
+bool fs_snapshot_create(FsHandle *fs, const std::string &name);
+// Gives back the blocks only this snapshot held.
+bool fs_snapshot_delete(FsHandle *fs, const std::string &name);
+// All snapshots in name order.
+bool fs_snapshot_list(FsHandle *fs, std::vector<FsSnapshotInfo> &snapshots);
+// Length of a file as the snapshot holds it, or -1.
+int64_t fs_snapshot_size(FsHandle *fs, const std::string &snapshot, const std::string &filename);
+// fs_read_at on a file as the snapshot holds it.
+int64_t fs_snapshot_read(FsHandle *fs, const std::string &snapshot, const std::string &filename, int64_t offset,
+                         char *buffer, int64_t size);
+// Paths added, removed or modified going from snapshot `from` to snapshot
+// `to`, "" standing for the live volume; in path order. A file counts as
+// modified when its contents differ, compared as fs_diff does: blocks both
+// still share are not read.
+bool fs_snapshot_diff(FsHandle *fs, const std::string &from, const std::string &to,
+                      std::vector<FsSnapshotChange> &changes);
+// Makes the live files and directories those of the snapshot, which stays.
+// Only tables change; blocks of the live files no snapshot holds are freed.
+bool fs_snapshot_rollback(FsHandle *fs, const std::string &name);
+// Full backup of the volume as the snapshot holds it: an image with just
+// its files, restorable with fs_restore. Only the snapshot is locked, so the
+// live files can be changed meanwhile.
+bool fs_backup_snapshot(FsHandle *fs, const std::string &snapshot, const std::string &backup_filename);
+
+// Goes through a directory in name order through fs_list, a page at a
+// time, so that a large one is never copied whole. Entries added or
+// removed meanwhile may or may not show up; none shows up twice.
+class FsDirIterator {
+public:
+    FsDirIterator(FsHandle *fs, const std::string &path, size_t page_size = 256);
+    // False at the end, or if path is not a directory.
+    bool next(FsDirEntry &entry);
+
+private:
+    FsHandle *fs;
+    std::string path;
+    size_t page_size;
+    std::vector<FsDirEntry> page;
+    size_t at = 0;
+    bool done = false;
+};
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef FS_ASYNC_H
+#define FS_ASYNC_H
+
+#include <cstdint>
+#include <future>
+#include <string>
+#include "fs.h"
+
+// Queue of fs_* calls on a mounted handle, run by a pool of queue_depth
+// worker threads, so that many calls are in flight at once. With
+// FsMountOptions::io_uring each call hands its block I/O to the kernel in
+// one submission; without it the workers wait in preadv/pwritev.
+//
+// Queued calls may run in any order: wait for one before queuing another
+// that depends on it. Buffers must stay valid until the future is ready.
+struct FsAsync;
+
+FsAsync *fs_async_start(FsHandle *fs, int queue_depth = 32);
+// Runs what is still queued, then stops the workers.
+void fs_async_stop(FsAsync *async);
+
+// fs_read_at: bytes read, or -1.
+std::future<int64_t> fs_read_async(FsAsync *async, const std::string &filename, int64_t offset, char *buffer,
+                                   int64_t size);
+// fs_write_at
+std::future<bool> fs_write_async(FsAsync *async, const std::string &filename, int64_t offset, const char *data,
+                                 int64_t size);
+std::future<bool> fs_append_async(FsAsync *async, const std::string &filename, const char *data, int64_t size);
+std::future<bool> fs_copy_async(FsAsync *async, const std::string &src_filename, const std::string &dest_filename);
+
+#endif
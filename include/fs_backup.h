@@ -0,0 +1,63 @@
+#ifndef FS_BACKUP_H
+#define FS_BACKUP_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "fs_device.h"
+#include "fs_bitmap.h"
+
+#define INCREMENT_MAGIC "FSINCR01"
+#define CHANGES_MAGIC "FSCHANGE"
+
+// Start of an incremental backup: the image blocks that changed between
+// the snapshot `base` and the snapshot `id` (Superblock::backup_id). A
+// manifest of `blocks` entries follows, then the blocks in manifest order.
+struct IncrementHeader {
+    char magic[8];
+    uint64_t base;
+    uint64_t id;
+    uint64_t volume_size;
+    uint64_t blocks;
+    uint32_t block_size;
+    uint32_t manifest_crc;
+    uint32_t crc;
+    uint32_t unused;
+};
+
+// Image block number and the CRC32C of its contents
+struct ManifestEntry {
+    uint64_t block;
+    uint32_t crc;
+    uint32_t unused;
+};
+
+// Calls fn(k) for every k in [0, count) on `threads` threads (0: one per
+// core), the calling one among them, each taking the next k when it is done
+// with one. No new k is handed out after fn fails.
+bool backup_parallel(size_t count, int threads, const std::function<bool(size_t)> &fn);
+
+// The functions below move image blocks in ranges, one range per thread at
+// a time, each with its own positioned reads and writes.
+// Copies the first bytes of fd_src to fd_dst, in the kernel with
+// copy_file_range when the file systems allow it.
+bool backup_copy(int fd_src, int fd_dst, uint64_t bytes, int threads = 0);
+// Writes an increment holding the given image blocks (ascending) of dev.
+bool backup_write_increment(Device *dev, int fd, IncrementHeader header, const std::vector<uint64_t> &blocks,
+                            int threads = 0);
+// Reads and checks the header of an increment.
+bool backup_read_header(int fd, IncrementHeader &header);
+// Writes the blocks of an increment into the image open as fd_image. Fails
+// on the first block that does not match its checksum.
+bool backup_apply_increment(int fd, const IncrementHeader &header, int fd_image, int threads = 0);
+// Makes fd, open on temp, durable and renames it to path.
+bool backup_install(int fd, const std::string &temp, const std::string &path);
+
+// Change tracking kept next to an image between mounts: which of its
+// blocks changed since the snapshot `id`. Loading fails when the file is
+// missing or belongs to another snapshot or geometry.
+bool backup_load_changes(const std::string &path, uint64_t id, BlockBitmap &changed);
+bool backup_save_changes(const std::string &path, uint64_t id, const BlockBitmap &changed);
+
+#endif
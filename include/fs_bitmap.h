@@ -0,0 +1,34 @@
+#ifndef FS_BITMAP_H
+#define FS_BITMAP_H
+
+#include <cstdint>
+#include <vector>
+
+// Free-block bitmap of the data area. A set bit marks a used block; the
+// bits past the last block stay set so they are never handed out.
+struct BlockBitmap {
+    std::vector<uint64_t> words;
+    int64_t nblocks = 0;
+
+    // Words [dirty_lo, dirty_hi) changed since the last clean().
+    int64_t dirty_lo = 0;
+    int64_t dirty_hi = 0;
+
+    void reset(int64_t blocks);
+    void load(const unsigned char *bytes, int64_t blocks);
+    void mark_all_dirty();
+    void clean();
+
+    bool test(int64_t block) const;
+    bool range_free(int64_t start, int64_t count) const;
+    void set_range(int64_t start, int64_t count);
+    void clear_range(int64_t start, int64_t count);
+
+    // First run of `count` free blocks at or after `hint`, -1 if none.
+    int64_t find_run(int64_t count, int64_t hint = 0) const;
+    // Free blocks from start on, up to the next used one.
+    int64_t run_length(int64_t start) const;
+    int64_t free_count() const;
+};
+
+#endif
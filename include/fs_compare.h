@@ -0,0 +1,11 @@
+#ifndef FS_COMPARE_H
+#define FS_COMPARE_H
+
+#include <cstddef>
+
+// Index of the first byte where a and b differ, or length when they are
+// equal. Compares 64 bytes per step with AVX2 when the CPU has it, SSE2
+// otherwise.
+size_t first_mismatch(const void *a, const void *b, size_t length);
+
+#endif
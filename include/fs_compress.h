@@ -0,0 +1,39 @@
+#ifndef FS_COMPRESS_H
+#define FS_COMPRESS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define COMPRESS_MAGIC "FSLZ"
+// Set in CompressedChunk::bytes when a chunk did not shrink and is stored as is
+#define CHUNK_STORED_RAW 0x80000000u
+
+// A compressed file's blocks hold its chunks in order, each compressed on
+// its own and starting on a block boundary, then a table with one of these
+// per chunk, then a CompressTrailer that ends the file.
+struct CompressedChunk {
+    uint32_t block;     // block of the file the chunk starts at
+    uint32_t bytes;     // stored length, with CHUNK_STORED_RAW; compressed ones are zero-padded to a block
+};
+
+struct CompressTrailer {
+    char magic[4];
+    uint32_t chunks;
+    uint64_t chunk_size;    // bytes of contents per chunk, the last one may hold fewer
+};
+
+static_assert(sizeof(CompressedChunk) == 8, "CompressedChunk must stay 8 bytes");
+static_assert(sizeof(CompressTrailer) == 16, "CompressTrailer must stay 16 bytes");
+
+// LZ4-style codec: sequences of literals and a match of at least 4 bytes
+// up to 64 KiB back, found through a hash of the next 4 bytes.
+// Largest output lz_compress may need for length bytes.
+size_t lz_bound(size_t length);
+// Compresses into at most capacity bytes and returns how many were used,
+// or 0 if it does not fit.
+size_t lz_compress(const void *data, size_t length, void *out, size_t capacity);
+// Expands exactly out_length bytes; false if data is not a valid
+// compressed form of that many, followed by nothing but zeros.
+bool lz_decompress(const void *data, size_t length, void *out, size_t out_length);
+
+#endif
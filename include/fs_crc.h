@@ -0,0 +1,16 @@
+#ifndef FS_CRC_H
+#define FS_CRC_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli). Pass the previous result as crc to continue a
+// checksum over several pieces; start with 0. Runs on the SSE4.2 crc32
+// instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+// Table-driven version used without SSE4.2; gives the same results.
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t length);
+// Whether crc32c runs on the CPU instruction.
+bool crc32c_hw_available();
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef FS_DEVICE_H
+#define FS_DEVICE_H
+
+#include <cstdint>
+#include <string>
+#include <sys/uio.h>
+
+// One piece of a batch: the iovcnt buffers of iov, filled from or written
+// to the image one after another from offset.
+struct IoSegment {
+    uint64_t offset;
+    const iovec *iov;
+    int iovcnt;
+    bool write;
+};
+
+// Byte-addressed access to the disk image. All fs_* data and metadata I/O
+// goes through one of these.
+struct Device {
+    int fd = -1;
+    uint64_t size = 0;   // bytes in the image
+
+    virtual ~Device() {}
+    virtual bool read_at(uint64_t offset, void *buffer, uint64_t length) = 0;
+    virtual bool write_at(uint64_t offset, const void *data, uint64_t length) = 0;
+    // Writes the count buffers of iov one after another from offset.
+    virtual bool writev_at(uint64_t offset, const iovec *iov, int count);
+    // Carries out count segments. With an io_uring they go to the kernel in
+    // one submission.
+    virtual bool submit(const IoSegment *segments, int count);
+    // Makes every completed write durable.
+    virtual bool sync() = 0;
+    // Hands writes still held in the process to the image file, so that
+    // other readers of fd see them; not a barrier.
+    virtual bool flush() { return true; }
+    // Bytes at offset inside a memory mapping of the image, or nullptr when
+    // the device is not mapped. Stays valid until the device is closed.
+    virtual const char *view(uint64_t, uint64_t) { return nullptr; }
+};
+
+// pread/pwrite on the image, or a shared mapping of it when use_mmap is set.
+// Without use_mmap, a cache_bytes block cache sits in front of the image,
+// read and written through an O_DIRECT descriptor if direct_io is set and
+// the file system allows it. fd stays an ordinary descriptor either way.
+// With uring and neither of those, batches go through an io_uring when the
+// kernel has one.
+Device *device_open(const std::string &path, bool use_mmap, uint64_t cache_bytes = 0, bool direct_io = false,
+                    bool uring = false);
+// Whether dev sends its batches through an io_uring.
+bool device_uring(const Device *dev);
+// A device on which every read, write and sync fails, for a handle whose
+// image could not be reopened.
+Device *device_closed();
+
+// For crash testing: the process exits on the spot (status 86) in place of
+// the n-th write or sync on any device from now on. 0 disarms it.
+void device_crash_after(int64_t operations);
+
+#endif
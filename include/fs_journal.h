@@ -0,0 +1,75 @@
+#ifndef FS_JOURNAL_H
+#define FS_JOURNAL_H
+
+#include <cstdint>
+#include <vector>
+#include "fs_device.h"
+
+#define JOURNAL_MAGIC "FSJOURNL"
+#define TXN_MAGIC "FSTXNHDR"
+#define COMMIT_MAGIC "FSCOMMIT"
+
+// First block of the journal region. Transactions follow it back to back,
+// each starting on a block boundary; replay starts with the one numbered
+// `sequence` and stops at the first that is missing or incomplete.
+struct JournalHeader {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t crc;
+    uint32_t unused;
+};
+
+// Starts a transaction. The payload follows directly: records of
+// (uint64 offset, uint64 length, bytes) to write into the image.
+struct TxnHeader {
+    char magic[8];
+    uint64_t sequence;
+    uint64_t payload_bytes;
+    uint32_t records;
+    uint32_t payload_crc;
+    uint32_t crc;
+    uint32_t unused;
+};
+
+// Written alone in the block after the payload, once the header, payload
+// and all data the transaction points to are durable.
+struct TxnCommit {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t payload_crc;
+    uint32_t crc;
+};
+
+// Writes to the metadata regions gathered for one transaction.
+struct JournalTxn {
+    std::vector<char> payload;
+    uint32_t records = 0;
+
+    void add(uint64_t offset, const void *data, uint64_t length);
+    bool empty() const { return records == 0; }
+    void clear();
+};
+
+// Journal region of a mounted image and where the next transaction goes.
+struct Journal {
+    uint64_t offset = 0;
+    uint64_t bytes = 0;
+    uint32_t block_size = 0;
+    uint64_t limit = 0;       // records may only write below this offset
+    uint64_t sequence = 1;    // number of the next transaction
+    uint64_t head = 0;        // its position inside the region
+};
+
+// Empties the journal of a freshly formatted image.
+bool journal_format(Device *dev, Journal &journal);
+// Replays committed transactions left by a crash, then empties the journal.
+// Fails when the region holds no journal.
+bool journal_open(Device *dev, Journal &journal, int *replayed = nullptr);
+// Makes txn durable (two barriers: one for header, payload and the data it
+// refers to, one for the commit block), then applies it in place. A
+// transaction larger than the whole journal is written in place instead.
+bool journal_commit(Device *dev, Journal &journal, const JournalTxn &txn);
+// Makes the in-place copies durable and empties the journal.
+bool journal_checkpoint(Device *dev, Journal &journal);
+
+#endif
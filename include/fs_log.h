@@ -0,0 +1,25 @@
+#ifndef FS_LOG_H
+#define FS_LOG_H
+
+#include <string>
+
+#define FS_LOG_FILE "fs.log"
+
+// Messages below the current level are dropped before they are queued.
+// Read-only operations log at FS_LOG_DEBUG, changes at FS_LOG_INFO.
+enum FsLogLevel {
+    FS_LOG_DEBUG,
+    FS_LOG_INFO,
+    FS_LOG_OFF
+};
+
+// Queues a line for FS_LOG_FILE. A background thread writes queued lines in
+// batches; each carries the seconds since the log was opened, and the first
+// line of a session gives the wall-clock time it started.
+void fs_log(const std::string &message, FsLogLevel level = FS_LOG_INFO);
+void fs_log_set_level(FsLogLevel level);
+bool fs_log_enabled(FsLogLevel level);
+// Writes out everything queued so far. Also done on unmount and at exit.
+bool fs_log_flush();
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef FS_STATS_H
+#define FS_STATS_H
+
+#include <cstdint>
+#include <string>
+#include <chrono>
+
+// Operations timed by fs_stats
+enum FsOp {
+    FS_OP_CREATE,
+    FS_OP_DELETE,
+    FS_OP_WRITE,
+    FS_OP_READ,
+    FS_OP_APPEND,
+    FS_OP_TRUNCATE,
+    FS_OP_RENAME,
+    FS_OP_COPY,
+    FS_OP_DIFF,
+    FS_OP_CAT,
+    FS_OP_LS,
+    FS_OP_LOOKUP,       // fs_exists and fs_size
+    FS_OP_DEFRAG,       // one fs_defragment_step
+    FS_OP_CHECK,
+    FS_OP_BACKUP,
+    FS_OP_RESTORE,
+    FS_OP_COMMIT,       // one journal transaction
+    FS_OP_MOUNT,
+    FS_OP_SNAPSHOT,     // taking, deleting or rolling back to a snapshot
+    FS_OP_IMPORT,       // fs_import_tree
+    FS_OP_EXPORT,       // fs_export_tree
+    FS_OP_COUNT
+};
+
+// Latencies go to power-of-two buckets: bucket b holds [2^b, 2^(b+1)) ns,
+// bucket 0 also 0 ns, the last everything longer.
+#define FS_STATS_BUCKETS 40
+
+struct FsOpStats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t bytes;             // file bytes the calls asked to read or write
+    uint64_t buckets[FS_STATS_BUCKETS];
+};
+
+struct FsStats {
+    FsOpStats ops[FS_OP_COUNT];
+    // Image I/O: system calls made on it, and bytes moved whether through
+    // those calls or the mapping
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t sync_calls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t metadata_loads;    // Metadata read from the image or copied out by fs_load_metadata
+    uint64_t metadata_saves;    // changed Metadata staged for the journal
+    // Block cache, in pages: found in the cache, read in on a miss, read in
+    // ahead of a sequential reader, dropped for others, written back
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_readahead;
+    uint64_t cache_evictions;
+    uint64_t cache_writebacks;
+};
+
+// Counters since the start or the last reset, summed over all threads.
+// Each thread counts into its own slots, so recording takes no lock.
+FsStats fs_stats();
+// Zeroes the counters; meant for moments when nothing else runs.
+void fs_stats_reset();
+// Upper bound of the bucket holding the q-quantile (0..1) of the latencies.
+uint64_t fs_stats_percentile_ns(const FsOpStats &op, double q);
+const char *fs_op_name(FsOp op);
+// Table of the counters on stdout.
+void fs_stats_print(const FsStats &stats);
+
+// Tracing: while on, every timed operation taking at least min_us is kept
+// as a Chrome trace event. fs_trace_stop writes them to path as JSON for
+// chrome://tracing or Perfetto. Off, it costs one flag test per operation.
+void fs_trace_start(uint64_t min_us = 0);
+bool fs_trace_stop(const std::string &path);
+
+// Recording, for the fs_* implementation
+void stats_count_io(uint64_t read_calls, uint64_t write_calls, uint64_t sync_calls,
+                    uint64_t bytes_read, uint64_t bytes_written);
+void stats_count_metadata(uint64_t loads, uint64_t saves);
+void stats_count_cache(uint64_t hits, uint64_t misses, uint64_t readahead, uint64_t evictions,
+                       uint64_t writebacks);
+
+// Times one call from construction to destruction.
+class FsOpTimer {
+public:
+    FsOpTimer(FsOp op, const std::string *name = nullptr, uint64_t bytes = 0)
+        : op(op), name(name), bytes(bytes), start(std::chrono::steady_clock::now()) {}
+    ~FsOpTimer();
+
+private:
+    FsOp op;
+    const std::string *name;    // file the call is about, for traces
+    uint64_t bytes;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
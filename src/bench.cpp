@@ -0,0 +1,1914 @@
+#include "../include/fs.h"
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <cmath>
+#include <algorithm>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "../include/fs_device.h"
+#include "../include/fs_crc.h"
+#include "../include/fs_compare.h"
+#include "../include/fs_stats.h"
+#include "../include/fs_async.h"
+
+using namespace std;
+
+#define BENCH_DISK "bench.sim"
+
+static double now_ns() {
+    return chrono::duration<double, nano>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Lookup cost versus file count: the hashed index against the linear scan
+// over the entry table that every call used to do.
+static void bench_lookup() {
+    const int lookups = 200000;
+    cout << "lookup: files  hash_ns  scan_ns\n";
+
+    for (int files : {1, 8, 64, 512, 4096, 32768}) {
+        FsGeometry geometry;
+        geometry.volume_size = 64ull << 20;
+        geometry.block_size = 4096;
+        geometry.max_files = files;
+        fs_format(BENCH_DISK, geometry);
+        FsHandle *fs = fs_mount(BENCH_DISK);
+        if (!fs) {
+            cerr << "bench diski acilamadi\n";
+            return;
+        }
+
+        vector<string> names;
+        for (int i = 0; i < files; ++i) {
+            names.push_back("file" + to_string(i));
+            fs_create(fs, names.back());
+        }
+
+        mt19937 rng(42);
+        vector<int> order(lookups);
+        for (int &o : order) o = rng() % files;
+
+        int hits = 0;
+        double t0 = now_ns();
+        for (int o : order) hits += fs_size(fs, names[o]) >= 0;
+        double hash_ns = (now_ns() - t0) / lookups;
+
+        // the scan gets fewer rounds on large tables to keep the run short
+        int scans = lookups / (1 + files / 64);
+        Metadata metadata;
+        fs_load_metadata(fs, metadata);
+        t0 = now_ns();
+        for (int k = 0; k < scans; ++k) {
+            int o = order[k];
+            for (size_t i = 0; i < metadata.entries.size(); ++i) {
+                if (metadata.entries[i].used && names[o] == metadata.entries[i].filename) {
+                    hits++;
+                    break;
+                }
+            }
+        }
+        double scan_ns = (now_ns() - t0) / scans;
+
+        cout << "        " << files << "  " << hash_ns << "  " << scan_ns
+             << (hits == lookups + scans ? "" : "  (eksik sonuc!)") << "\n";
+        fs_unmount(fs);
+    }
+    unlink(BENCH_DISK);
+}
+
+// 100k files with one small write each on a sparse multi-GiB image.
+static void bench_many_files() {
+    const int files = 100000;
+    FsGeometry geometry;
+    geometry.volume_size = 8ull << 30;
+    geometry.block_size = 4096;
+    geometry.max_files = 131072;
+
+    double t0 = now_ns();
+    if (!fs_format(BENCH_DISK, geometry)) {
+        cerr << "bench diski formatlanamadi\n";
+        return;
+    }
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    double format_ms = (now_ns() - t0) / 1e6;
+
+    string data(100, 'x');
+    int failed = 0;
+    t0 = now_ns();
+    for (int i = 0; i < files; ++i)
+        failed += !fs_create(fs, "f" + to_string(i));
+    double create_ns = (now_ns() - t0) / files;
+
+    t0 = now_ns();
+    for (int i = 0; i < files; ++i)
+        failed += !fs_write(fs, "f" + to_string(i), data.data(), data.size());
+    double write_ns = (now_ns() - t0) / files;
+    fs_unmount(fs);
+
+    t0 = now_ns();
+    fs = fs_mount(BENCH_DISK);
+    double mount_ms = (now_ns() - t0) / 1e6;
+    int64_t last = fs ? fs_size(fs, "f" + to_string(files - 1)) : -1;
+    fs_unmount(fs);
+
+    cout << "many_files: files=" << files << " volume=" << (geometry.volume_size >> 30) << "GiB"
+         << " format_ms=" << format_ms << " create_ns=" << create_ns
+         << " write_ns=" << write_ns << " mount_ms=" << mount_ms
+         << (failed == 0 && last == (int64_t)data.size() ? "" : "  (hata!)") << "\n";
+    unlink(BENCH_DISK);
+}
+
+// 50k files in one directory of a tree: creating them, looking them up by
+// path, listing the directory page by page, and moving a file and a
+// directory holding all of them across the tree.
+static void bench_dirs() {
+    const int files = 50000, lookups = 200000;
+    FsGeometry geometry;
+    geometry.volume_size = 1ull << 30;
+    geometry.block_size = 4096;
+    geometry.max_files = 65536;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    bool good = fs_mkdir(fs, "a") && fs_mkdir(fs, "a/b") && fs_mkdir(fs, "a/b/big") && fs_mkdir(fs, "c");
+    double t0 = now_ns();
+    for (int i = 0; i < files; ++i) good &= fs_create(fs, "a/b/big/f" + to_string(i));
+    double create_ns = (now_ns() - t0) / files;
+
+    mt19937_64 rng(11);
+    t0 = now_ns();
+    for (int k = 0; k < lookups; ++k) good &= fs_size(fs, "a/b/big/f" + to_string(rng() % files)) == 0;
+    double lookup_ns = (now_ns() - t0) / lookups;
+
+    FsDirIterator it(fs, "a/b/big");
+    FsDirEntry entry;
+    string last;
+    int listed = 0;
+    t0 = now_ns();
+    while (it.next(entry)) {
+        good &= entry.name > last;
+        last = entry.name;
+        ++listed;
+    }
+    double list_ns = (now_ns() - t0) / max(listed, 1);
+
+    t0 = now_ns();
+    good &= fs_mv(fs, "a/b/big/f7", "c/f7");
+    double mv_file_us = (now_ns() - t0) / 1e3;
+    t0 = now_ns();
+    good &= fs_mv(fs, "a/b/big", "c/big");
+    double mv_dir_us = (now_ns() - t0) / 1e3;
+    good &= fs_exists(fs, "c/f7") && fs_exists(fs, "c/big/f9") && !fs_exists(fs, "a/b/big");
+    fs_unmount(fs);
+
+    t0 = now_ns();
+    fs = fs_mount(BENCH_DISK);
+    double mount_ms = (now_ns() - t0) / 1e6;
+    good &= fs && fs_exists(fs, "c/big/f" + to_string(files - 1));
+    fs_unmount(fs);
+
+    cout << "dirs: files=" << files << " create_ns=" << create_ns << " lookup_ns=" << lookup_ns
+         << " list_ns_per_entry=" << list_ns << " mv_file_us=" << mv_file_us << " mv_dir_us=" << mv_dir_us
+         << " mount_ms=" << mount_ms << (good && listed == files ? "" : "  (hata!)") << "\n";
+    unlink(BENCH_DISK);
+}
+
+// pread/pwrite against the mmap mount for small random and large
+// sequential reads of one big file.
+static void bench_mmap() {
+    const int64_t file_size = 128ll << 20;
+    const int small_reads = 100000;
+    const int64_t chunk = 1 << 20;
+
+    FsGeometry geometry;
+    geometry.volume_size = 256ull << 20;
+    geometry.block_size = 4096;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    string data(file_size, 'd');
+    fs_create(fs, "big");
+    fs_write(fs, "big", data.data(), data.size());
+    fs_unmount(fs);
+
+    mt19937_64 rng(7);
+    vector<int64_t> offsets(small_reads);
+    for (int64_t &o : offsets) o = rng() % (file_size - 64);
+
+    cout << "mmap: mode  random64_ns  seq_MBps\n";
+    for (int mode = 0; mode < 3; ++mode) {
+        FsMountOptions options;
+        options.use_mmap = mode > 0;
+        bool views = mode == 2;
+        fs = fs_mount(BENCH_DISK, options);
+
+        char buffer[64];
+        string_view view;
+        size_t sum = 0;
+        double t0 = now_ns();
+        for (int64_t o : offsets) {
+            if (views) {
+                fs_read_view(fs, "big", o, 64, view);
+                sum += view[0];
+            } else {
+                fs_read(fs, "big", o, 64, buffer);
+                sum += buffer[0];
+            }
+        }
+        double random_ns = (now_ns() - t0) / small_reads;
+
+        vector<char> big(chunk);
+        t0 = now_ns();
+        for (int pass = 0; pass < 4; ++pass) {
+            for (int64_t o = 0; o < file_size; o += chunk) {
+                if (views) {
+                    fs_read_view(fs, "big", o, chunk, view);
+                    sum += view[chunk - 1];
+                } else {
+                    fs_read(fs, "big", o, chunk, big.data());
+                    sum += big[chunk - 1];
+                }
+            }
+        }
+        double seq_mbps = 4.0 * file_size / (1 << 20) / ((now_ns() - t0) / 1e9);
+
+        const char *names[] = {"pread", "mmap", "mmap_view"};
+        cout << "      " << names[mode] << "  " << random_ns << "  " << seq_mbps
+             << (sum == (size_t)'d' * (small_reads + 4 * file_size / chunk) ? "" : "  (hatali veri!)") << "\n";
+        fs_unmount(fs);
+    }
+    unlink(BENCH_DISK);
+}
+
+// Cost of a queued log line, and of a small read with read logging on and off.
+static void bench_log() {
+    const int calls = 200000;
+    double t0 = now_ns();
+    for (int i = 0; i < calls; ++i) fs_log("BENCH line", FS_LOG_INFO);
+    double log_ns = (now_ns() - t0) / calls;
+    t0 = now_ns();
+    fs_log_flush();
+    double flush_ms = (now_ns() - t0) / 1e6;
+
+    FsGeometry geometry;
+    geometry.volume_size = 16 << 20;
+    geometry.block_size = 4096;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    string data(1 << 20, 'r');
+    fs_create(fs, "f");
+    fs_write(fs, "f", data.data(), data.size());
+
+    double read_ns[2];
+    for (int quiet = 0; quiet < 2; ++quiet) {
+        fs_log_set_level(quiet ? FS_LOG_INFO : FS_LOG_DEBUG);
+        char buffer[64];
+        t0 = now_ns();
+        for (int i = 0; i < calls; ++i) fs_read(fs, "f", (i * 4099) % (data.size() - 64), 64, buffer);
+        read_ns[quiet] = (now_ns() - t0) / calls;
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    fs_unmount(fs);
+    unlink(BENCH_DISK);
+
+    cout << "log: fs_log_ns=" << log_ns << " flush_" << calls << "_ms=" << flush_ms
+         << " read64_logged_ns=" << read_ns[0] << " read64_unlogged_ns=" << read_ns[1] << "\n";
+}
+
+// Worker threads on one mount: 80% 4 KiB reads of any file, 20% rewrites of
+// the thread's own files. Each write fills a file with one byte value, so a
+// read that sees two values caught a write half done.
+static void bench_threads() {
+    const int files_per_thread = 16;
+    const int ops_per_thread = 40000;
+    const int64_t file_size = 4096;
+
+    cout << "threads: threads  ops_per_s  torn_reads\n";
+    fs_log_set_level(FS_LOG_INFO);
+    for (int threads : {1, 2, 4, 8, 16}) {
+        FsGeometry geometry;
+        geometry.volume_size = 64ull << 20;
+        geometry.block_size = 4096;
+        geometry.max_files = threads * files_per_thread;
+        fs_format(BENCH_DISK, geometry);
+        FsHandle *fs = fs_mount(BENCH_DISK);
+        if (!fs) {
+            cerr << "bench diski acilamadi\n";
+            return;
+        }
+
+        vector<string> names;
+        string data(file_size, 'a');
+        for (int i = 0; i < threads * files_per_thread; ++i) {
+            names.push_back("t" + to_string(i / files_per_thread) + "_" + to_string(i % files_per_thread));
+            fs_create(fs, names.back());
+            fs_write(fs, names.back(), data.data(), data.size());
+        }
+
+        atomic<int> torn(0);
+        vector<thread> workers;
+        double t0 = now_ns();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                mt19937 rng(t + 1);
+                string buffer(file_size, 0);
+                for (int op = 0; op < ops_per_thread; ++op) {
+                    if (rng() % 5 == 0) {
+                        string fill(file_size, 'a' + rng() % 26);
+                        fs_write(fs, names[t * files_per_thread + rng() % files_per_thread], fill.data(), file_size);
+                    } else {
+                        fs_read(fs, names[rng() % names.size()], 0, file_size, &buffer[0]);
+                        if (buffer.find_first_not_of(buffer[0]) != string::npos) torn++;
+                    }
+                }
+            });
+        }
+        for (thread &w : workers) w.join();
+        double seconds = (now_ns() - t0) / 1e9;
+
+        cout << "         " << threads << "  " << (uint64_t)(threads * ops_per_thread / seconds)
+             << "  " << torn.load() << "\n";
+        fs_unmount(fs);
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// Small create+write pairs with a commit per call, with group commit, and
+// with a commit per call from several threads that share commits.
+static void bench_journal() {
+    const int pairs = 2000;
+    fs_log_set_level(FS_LOG_INFO);
+    cout << "journal: mode  threads  ops_per_s\n";
+    for (int mode = 0; mode < 3; ++mode) {
+        FsGeometry geometry;
+        geometry.volume_size = 64ull << 20;
+        geometry.block_size = 4096;
+        geometry.max_files = pairs;
+        fs_format(BENCH_DISK, geometry);
+        FsMountOptions options;
+        options.sync_each_op = mode != 1;
+        int threads = mode == 2 ? 4 : 1;
+        FsHandle *fs = fs_mount(BENCH_DISK, options);
+        if (!fs) {
+            cerr << "bench diski acilamadi\n";
+            return;
+        }
+
+        string data(256, 'j');
+        vector<thread> workers;
+        double t0 = now_ns();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                for (int i = t; i < pairs; i += threads) {
+                    string name = "j" + to_string(i);
+                    fs_create(fs, name);
+                    fs_write(fs, name, data.data(), data.size());
+                }
+            });
+        }
+        for (thread &w : workers) w.join();
+        fs_flush(fs);
+        double seconds = (now_ns() - t0) / 1e9;
+
+        const char *names[] = {"sync_each_op", "group_commit", "sync_each_op"};
+        cout << "         " << names[mode] << "  " << threads << "  " << (uint64_t)(2 * pairs / seconds) << "\n";
+        fs_unmount(fs);
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// One step of the crash workload. Steps are generated against a model of
+// the file system, so each of them succeeds on a healthy image.
+struct CrashOp {
+    enum Kind { CREATE, WRITE, APPEND, TRUNCATE, DELETE, RENAME, COPY, DEFRAG, WRITE_AT, PUNCH } kind;
+    string name, name2;
+    int64_t size, offset = 0;
+    char fill;
+};
+
+typedef map<string, string> CrashModel;
+
+static void crash_apply(CrashModel &model, const CrashOp &op) {
+    switch (op.kind) {
+        case CrashOp::CREATE: model[op.name] = ""; break;
+        case CrashOp::WRITE: model[op.name] = string(op.size, op.fill); break;
+        case CrashOp::APPEND: model[op.name] += string(op.size, op.fill); break;
+        case CrashOp::TRUNCATE: model[op.name].resize(op.size, 0); break;
+        case CrashOp::DELETE: model.erase(op.name); break;
+        case CrashOp::RENAME: model[op.name2] = model[op.name]; model.erase(op.name); break;
+        case CrashOp::COPY: model[op.name2] = model[op.name]; break;
+        case CrashOp::DEFRAG: break;
+        case CrashOp::WRITE_AT: {
+            string &file = model[op.name];
+            if ((int64_t)file.size() < op.offset + op.size) file.resize(op.offset + op.size, 0);
+            file.replace(op.offset, op.size, op.size, op.fill);
+            break;
+        }
+        case CrashOp::PUNCH: {
+            string &file = model[op.name];
+            file.replace(op.offset, op.size, op.size, 0);
+            break;
+        }
+    }
+}
+
+// A punch or grow whose hole the extent row cannot take fails without a
+// change; the zeros are then written out instead.
+static bool crash_apply(FsHandle *fs, const CrashOp &op) {
+    string data(op.size, op.fill);
+    static const char zero = 0;
+    switch (op.kind) {
+        case CrashOp::CREATE: return fs_create(fs, op.name);
+        case CrashOp::WRITE: return fs_write(fs, op.name, data.data(), op.size);
+        case CrashOp::APPEND: return fs_append(fs, op.name, data.data(), op.size);
+        case CrashOp::TRUNCATE:
+            return fs_truncate(fs, op.name, op.size) ||
+                   (op.size > fs_size(fs, op.name) && fs_write_at(fs, op.name, op.size - 1, &zero, 1));
+        case CrashOp::DELETE: return fs_delete(fs, op.name);
+        case CrashOp::RENAME: return fs_rename(fs, op.name, op.name2);
+        case CrashOp::COPY: return fs_copy(fs, op.name, op.name2);
+        case CrashOp::DEFRAG: fs_defragment_step(fs, 0); return true;
+        case CrashOp::WRITE_AT: return fs_write_at(fs, op.name, op.offset, data.data(), op.size);
+        case CrashOp::PUNCH:
+            return fs_punch_hole(fs, op.name, op.offset, op.size) ||
+                   fs_write_at(fs, op.name, op.offset, string(op.size, 0).data(), op.size);
+    }
+    return false;
+}
+
+static vector<CrashOp> crash_workload(uint32_t seed, int steps) {
+    mt19937 rng(seed);
+    CrashModel model;
+    vector<CrashOp> ops;
+    while ((int)ops.size() < steps) {
+        CrashOp op;
+        op.kind = CrashOp::Kind(rng() % 10);
+        op.name = "f" + to_string(rng() % 6);
+        op.name2 = "f" + to_string(rng() % 6);
+        op.fill = 'a' + ops.size() % 26;
+        bool exists = model.count(op.name), exists2 = model.count(op.name2);
+        int64_t size = exists ? model[op.name].size() : 0;
+        switch (op.kind) {
+            case CrashOp::CREATE: if (exists) continue; op.size = 0; break;
+            case CrashOp::WRITE: if (!exists) continue; op.size = rng() % 9000; break;
+            case CrashOp::APPEND: if (!exists || size > 40000) continue; op.size = rng() % 3000; break;
+            case CrashOp::TRUNCATE:
+                if (!exists || size > 40000) continue;
+                op.size = size && rng() % 3 ? rng() % size : size + rng() % 20000;
+                break;
+            case CrashOp::DELETE: if (!exists) continue; op.size = 0; break;
+            case CrashOp::RENAME: if (!exists || exists2) continue; op.size = 0; break;
+            case CrashOp::COPY: if (!exists || exists2 || size == 0) continue; op.size = 0; break;
+            case CrashOp::DEFRAG: op.size = 0; break;
+            case CrashOp::WRITE_AT:
+                if (!exists || size > 40000) continue;
+                op.offset = rng() % (size + 10000);
+                op.size = rng() % 3000 + 1;
+                break;
+            case CrashOp::PUNCH:
+                if (!exists || size == 0) continue;
+                op.offset = rng() % size;
+                op.size = min<int64_t>(rng() % 12000, size - op.offset);
+                break;
+        }
+        crash_apply(model, op);
+        ops.push_back(op);
+    }
+    return ops;
+}
+
+// Runs the workload in a child that dies at the given device operation (or
+// is killed after kill_us microseconds), then mounts what it left behind.
+// With a commit per call the image must hold the state after the last call
+// that returned or the one after it; with group commit any earlier state
+// is allowed too. Returns false on a mismatch or a failed integrity check.
+static bool crash_round(const vector<CrashOp> &ops, const FsMountOptions &options,
+                        int64_t crash_after, int kill_us, bool &finished) {
+    FsGeometry geometry;
+    geometry.volume_size = 4 << 20;
+    geometry.max_files = 16;
+    fs_format(BENCH_DISK, geometry);
+
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        device_crash_after(crash_after);
+        FsHandle *fs = fs_mount(BENCH_DISK, options);
+        for (int k = 0; fs && k < (int)ops.size(); ++k) {
+            if (!crash_apply(fs, ops[k])) _exit(1);
+            int done = k + 1;
+            if (write(fds[1], &done, sizeof(done)) != sizeof(done)) _exit(1);
+        }
+        // no unmount: whatever was not committed yet is lost, as in a crash
+        _exit(0);
+    }
+    close(fds[1]);
+    if (kill_us) {
+        usleep(kill_us);
+        kill(pid, SIGKILL);
+    }
+    int completed = 0, done;
+    while (read(fds[0], &done, sizeof(done)) == sizeof(done)) completed = done;
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    finished = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 1) return false;
+
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) return false;
+    CrashModel found;
+    for (int i = 0; i < 6; ++i) {
+        string name = "f" + to_string(i);
+        int64_t size = fs_size(fs, name);
+        if (size < 0) continue;
+        string data(size, 0);
+        fs_read(fs, name, 0, size, &data[0]);
+        found[name] = data;
+    }
+    streambuf *out = cout.rdbuf(nullptr);
+    bool ok = fs_check_integrity(fs);
+    cout.rdbuf(out);
+    fs_unmount(fs);
+
+    CrashModel model;
+    int lowest = options.sync_each_op ? completed : 0;
+    int highest = min<int>(completed + 1, ops.size());
+    for (int k = 0; k <= highest; ++k) {
+        if (k >= lowest && found == model) return ok;
+        if (k < (int)ops.size()) crash_apply(model, ops[k]);
+    }
+    return false;
+}
+
+// Crash injection: every device write and sync of the workload in turn is
+// made the point where the process dies, then random SIGKILLs. The last
+// two modes run group commit over the block cache and through io_uring.
+static void bench_crash() {
+    fs_log_set_level(FS_LOG_OFF);
+    vector<CrashOp> ops = crash_workload(1234, 60);
+    cout << "crash: mode  rounds  failures\n";
+    for (int mode = 0; mode < 4; ++mode) {
+        FsMountOptions options;
+        options.sync_each_op = mode == 0;
+        options.commit_ops = 8;
+        if (mode == 2) options.cache_bytes = 4 << 20;
+        options.io_uring = mode == 3;
+        int rounds = 0, failures = 0;
+        bool finished = false;
+        for (int64_t point = 1; !finished; ++point, ++rounds)
+            failures += !crash_round(ops, options, point, 0, finished);
+
+        mt19937 rng(99);
+        vector<CrashOp> long_ops = crash_workload(4321, 2000);
+        for (int k = 0; k < 50; ++k, ++rounds)
+            failures += !crash_round(long_ops, options, 0, 200 + rng() % 20000, finished);
+        cout << "       " << (mode == 0 ? "sync_each_op" : mode == 1 ? "group_commit" : mode == 2 ? "cached" : "uring") << "  " << rounds << "  " << failures << "\n";
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Peak RSS while writing, copying and diffing ever larger files through the
+// streaming calls; it should not move with the file size.
+static void bench_stream() {
+    cout << "stream: file_MiB  write_ms  copy_ms  diff_ms  peak_rss_KiB\n";
+    for (int64_t mib : {16, 128, 512}) {
+        int64_t size = mib << 20;
+        FsGeometry geometry;
+        geometry.volume_size = (2 * size) + (16 << 20);
+        geometry.block_size = 4096;
+        fs_format(BENCH_DISK, geometry);
+        FsHandle *fs = fs_mount(BENCH_DISK);
+        if (!fs) {
+            cerr << "bench diski acilamadi\n";
+            return;
+        }
+
+        fs_create(fs, "src");
+        double t0 = now_ns();
+        bool ok = fs_write_chunks(fs, "src", size, [](char *data, int64_t n) {
+            memset(data, 's', n);
+            return true;
+        });
+        double write_ms = (now_ns() - t0) / 1e6;
+
+        t0 = now_ns();
+        ok &= fs_copy(fs, "src", "dst");
+        double copy_ms = (now_ns() - t0) / 1e6;
+
+        t0 = now_ns();
+        ok &= fs_diff(fs, "src", "dst");
+        double diff_ms = (now_ns() - t0) / 1e6;
+
+        cout << "        " << mib << "  " << write_ms << "  " << copy_ms << "  " << diff_ms
+             << "  " << peak_rss_kb() << (ok ? "" : "  (hata!)") << "\n";
+        fs_unmount(fs);
+    }
+    unlink(BENCH_DISK);
+}
+
+// Fills a volume with files of mixed sizes and deletes a share of them.
+static FsHandle *defrag_volume(vector<string> &names) {
+    FsGeometry geometry;
+    geometry.volume_size = 256ull << 20;
+    geometry.block_size = 4096;
+    geometry.max_files = 4096;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) return nullptr;
+
+    mt19937 rng(7);
+    string data(1 << 20, 'd');
+    vector<string> all;
+    for (int i = 0; i < 3000; ++i) {
+        string name = "f" + to_string(i);
+        int64_t size = 4096 + rng() % (120 << 10);
+        if (!fs_create(fs, name) || !fs_write(fs, name, data.data(), size)) break;
+        all.push_back(name);
+    }
+    names.clear();
+    for (const string &name : all) {
+        if (rng() % 10 < 4) fs_delete(fs, name);
+        else names.push_back(name);
+    }
+    fs_flush(fs);
+    return fs;
+}
+
+// Bytes a defragmenter sliding every extent down in disk order would move.
+static uint64_t slide_bytes(const Metadata &metadata) {
+    vector<FileExtent> extents;
+    uint64_t bs = metadata.superblock.block_size;
+    for (size_t i = 0; i < metadata.entries.size(); ++i)
+        if (metadata.entries[i].used)
+            for (uint32_t k = 0; k < metadata.entries[i].extent_count; ++k)
+                extents.push_back(metadata.extents[i * FS_MAX_EXTENTS + k]);
+    sort(extents.begin(), extents.end(), [](const FileExtent &a, const FileExtent &b) { return a.start < b.start; });
+    uint64_t at = 0, bytes = 0;
+    for (const FileExtent &e : extents) {
+        if (e.start != at) bytes += e.count * bs;
+        at += e.count;
+    }
+    return bytes;
+}
+
+static vector<uint64_t> file_blocks(const Metadata &metadata, size_t slot) {
+    vector<uint64_t> blocks;
+    for (uint32_t k = 0; k < metadata.entries[slot].extent_count; ++k) {
+        const FileExtent &e = metadata.extents[slot * FS_MAX_EXTENTS + k];
+        for (uint64_t b = 0; b < e.count; ++b) blocks.push_back(e.start + b);
+    }
+    return blocks;
+}
+
+// Bytes of blocks that ended up somewhere else, and whether the used blocks
+// now form one run from block 0.
+static uint64_t moved_bytes(const Metadata &before, const Metadata &after, bool &packed) {
+    uint64_t bytes = 0, used = 0, bs = after.superblock.block_size;
+    for (size_t i = 0; i < after.entries.size(); ++i) {
+        const FileEntry &entry = after.entries[i];
+        if (!entry.used || !entry.size) continue;
+        used += (entry.size + bs - 1) / bs;
+        // block by block, since a move may have merged extents
+        vector<uint64_t> was = file_blocks(before, i), now = file_blocks(after, i);
+        for (size_t b = 0; b < now.size(); ++b)
+            if (b >= was.size() || was[b] != now[b]) bytes += bs;
+    }
+    packed = after.bitmap.find_run(1) == (int64_t)used;
+    return bytes;
+}
+
+// Data moved by the planner against sliding every file, and the pauses seen
+// by readers when the work is split into 5 ms steps.
+static void bench_defrag() {
+    fs_log_set_level(FS_LOG_INFO);
+    cout << "defrag: mode  ms  moved_MiB  slide_MiB  max_step_ms  max_read_ms  packed\n";
+    for (int stepped = 0; stepped < 2; ++stepped) {
+        vector<string> names;
+        FsHandle *fs = defrag_volume(names);
+        if (!fs) {
+            cerr << "bench diski acilamadi\n";
+            return;
+        }
+        Metadata before, after;
+        fs_load_metadata(fs, before);
+
+        atomic<bool> stop(false);
+        atomic<uint64_t> max_read_ns(0);
+        thread reader([&] {
+            mt19937 rng(3);
+            vector<char> buffer(4096);
+            while (!stop.load()) {
+                double t0 = now_ns();
+                fs_read(fs, names[rng() % names.size()], 0, buffer.size(), buffer.data());
+                uint64_t ns = now_ns() - t0;
+                if (ns > max_read_ns.load()) max_read_ns.store(ns);
+            }
+        });
+
+        double t0 = now_ns(), max_step = 0;
+        if (stepped) {
+            for (bool done = false; !done;) {
+                double s0 = now_ns();
+                done = fs_defragment_step(fs, 5);
+                max_step = max(max_step, now_ns() - s0);
+            }
+        } else {
+            fs_defragment(fs);
+            max_step = now_ns() - t0;
+        }
+        double ms = (now_ns() - t0) / 1e6;
+        stop.store(true);
+        reader.join();
+
+        fs_load_metadata(fs, after);
+        bool packed = false;
+        uint64_t moved = moved_bytes(before, after, packed);
+        streambuf *out = cout.rdbuf(nullptr);
+        bool ok = fs_check_integrity(fs);
+        cout.rdbuf(out);
+        cout << "        " << (stepped ? "steps_5ms" : "whole") << "  " << ms << "  " << (moved >> 20)
+             << "  " << (slide_bytes(before) >> 20) << "  " << max_step / 1e6 << "  " << max_read_ns.load() / 1e6
+             << "  " << (packed ? "yes" : "no") << (ok ? "" : "  (hata!)") << "\n";
+        fs_unmount(fs);
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// Full backup against the old 1 KiB read/write loop, then an increment
+// after a few small changes and a restore of the chain.
+static void bench_backup() {
+    FsGeometry geometry;
+    geometry.volume_size = 256ull << 20;
+    geometry.block_size = 4096;
+    geometry.max_files = 256;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    fs_log_set_level(FS_LOG_INFO);
+    string data(1 << 20, 'b');
+    for (int i = 0; i < 200; ++i) {
+        fs_create(fs, "b" + to_string(i));
+        fs_write(fs, "b" + to_string(i), data.data(), data.size());
+    }
+    fs_flush(fs);
+
+    double t0 = now_ns();
+    int fd_src = open(BENCH_DISK, O_RDONLY), fd_dst = open(BENCH_DISK ".old", O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    char buffer[1024];
+    ssize_t n;
+    while ((n = read(fd_src, buffer, sizeof(buffer))) > 0) write(fd_dst, buffer, n);
+    close(fd_src);
+    close(fd_dst);
+    double loop_ms = (now_ns() - t0) / 1e6;
+
+    t0 = now_ns();
+    bool ok = fs_backup(fs, BENCH_DISK ".full");
+    double full_ms = (now_ns() - t0) / 1e6;
+
+    for (int i = 0; i < 4; ++i) fs_write(fs, "b" + to_string(i * 50), "changed", 7);
+    fs_append(fs, "b199", data.data(), 64 << 10);
+    t0 = now_ns();
+    ok &= fs_backup_incremental(fs, BENCH_DISK ".inc");
+    double inc_ms = (now_ns() - t0) / 1e6;
+    struct stat st;
+    stat(BENCH_DISK ".inc", &st);
+
+    t0 = now_ns();
+    ok &= fs_restore_chain(fs, {BENCH_DISK ".full", BENCH_DISK ".inc"});
+    double restore_ms = (now_ns() - t0) / 1e6;
+    char check[7];
+    ok &= fs_read(fs, "b50", 0, 7, check) && memcmp(check, "changed", 7) == 0 && fs_size(fs, "b199") == (1 << 20) + (64 << 10);
+
+    cout << "backup: loop_1k_ms  full_ms  incremental_ms  incremental_KiB  restore_ms\n"
+         << "        " << loop_ms << "  " << full_ms << "  " << inc_ms << "  " << st.st_size / 1024
+         << "  " << restore_ms << (ok ? "" : "  (hata!)") << "\n";
+    fs_unmount(fs);
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+    unlink(BENCH_DISK ".old");
+    unlink(BENCH_DISK ".full");
+    unlink(BENCH_DISK ".inc");
+}
+
+// A counter from /proc/self/io, e.g. "wchar:" for the bytes this process
+// handed to write(2) and friends so far.
+static uint64_t io_counter(const char *name) {
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) return 0;
+    char key[64];
+    unsigned long long value, found = 0;
+    while (fscanf(f, "%63s %llu", key, &value) == 2)
+        if (strcmp(key, name) == 0) found = value;
+    fclose(f);
+    return found;
+}
+
+static uint64_t written_bytes() {
+    return io_counter("wchar:");
+}
+
+// Many files made from a few templates: written plainly, written with
+// dedup, and made with fs_copy. Space saved is against storing every file;
+// write amplification is device bytes written per byte of file data.
+static void bench_dedup() {
+    const int templates = 20, files = 400;
+    const int64_t size = 256 << 10;
+    fs_log_set_level(FS_LOG_OFF);
+    cout << "dedup: mode  ms  logical_MiB  stored_MiB  saved_%  written_MiB  write_amp\n";
+    for (int mode = 0; mode < 3; ++mode) {
+        FsGeometry geometry;
+        geometry.volume_size = 256ull << 20;
+        geometry.block_size = 4096;
+        geometry.max_files = files;
+        fs_format(BENCH_DISK, geometry);
+        FsMountOptions options;
+        options.dedup = mode == 1;
+        FsHandle *fs = fs_mount(BENCH_DISK, options);
+        if (!fs) {
+            cerr << "bench diski acilamadi\n";
+            return;
+        }
+        vector<string> data(templates);
+        for (int t = 0; t < templates; ++t) data[t] = string(size, 'A' + t);
+
+        uint64_t w0 = written_bytes();
+        double t0 = now_ns();
+        bool ok = true;
+        for (int i = 0; i < files; ++i) {
+            string name = "f" + to_string(i);
+            if (mode == 2 && i >= templates) {
+                ok &= fs_copy(fs, "f" + to_string(i % templates), name);
+            } else {
+                ok &= fs_create(fs, name) && fs_write(fs, name, data[i % templates].data(), size);
+            }
+        }
+        fs_flush(fs);
+        double ms = (now_ns() - t0) / 1e6;
+        uint64_t written = written_bytes() - w0;
+
+        Metadata metadata;
+        fs_load_metadata(fs, metadata);
+        double logical = (double)files * size;
+        double stored = (double)(metadata.superblock.data_blocks - metadata.bitmap.free_count()) * geometry.block_size;
+        const char *names[] = {"write", "dedup", "reflink"};
+        cout << "       " << names[mode] << "  " << ms << "  " << logical / (1 << 20) << "  " << stored / (1 << 20)
+             << "  " << 100 * (1 - stored / logical) << "  " << written / double(1 << 20) << "  " << written / logical
+             << (ok ? "" : "  (hata!)") << "\n";
+        fs_unmount(fs);
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// Changing 4 KiB of a 32 MiB file by rewriting all of it against
+// fs_write_at, then two files growing side by side with fs_append: their
+// appends interleave on disk, so each file gains extents instead of being
+// moved whole.
+static void bench_write_at() {
+    const int64_t size = 32 << 20, piece = 4096;
+    fs_log_set_level(FS_LOG_OFF);
+    cout << "write_at: mode  ops  us_per_op  written_KiB_per_op  extents\n";
+    for (int mode = 0; mode < 3; ++mode) {
+        FsGeometry geometry;
+        geometry.volume_size = 256ull << 20;
+        geometry.block_size = 4096;
+        geometry.max_files = 16;
+        fs_format(BENCH_DISK, geometry);
+        FsHandle *fs = fs_mount(BENCH_DISK);
+        if (!fs) {
+            cerr << "bench diski acilamadi\n";
+            return;
+        }
+        string data(size, 'w'), patch(piece, 'p');
+        bool ok = fs_create(fs, "a") && fs_create(fs, "b");
+        if (mode < 2) ok &= fs_write(fs, "a", data.data(), size);
+        fs_flush(fs);
+
+        mt19937 rng(5);
+        int ops = mode == 0 ? 50 : 2000;
+        uint64_t w0 = written_bytes();
+        double t0 = now_ns();
+        for (int k = 0; k < ops; ++k) {
+            int64_t offset = rng() % (size - piece);
+            if (mode == 0) {
+                ok &= fs_read(fs, "a", 0, size, &data[0]);
+                memcpy(&data[offset], patch.data(), piece);
+                ok &= fs_write(fs, "a", data.data(), size);
+            } else if (mode == 1) {
+                ok &= fs_write_at(fs, "a", offset, patch.data(), piece);
+            } else {
+                ok &= fs_append(fs, k % 2 ? "b" : "a", data.data(), size / ops);
+            }
+        }
+        fs_flush(fs);
+        double us = (now_ns() - t0) / 1e3 / ops;
+        uint64_t written = written_bytes() - w0;
+
+        Metadata metadata;
+        fs_load_metadata(fs, metadata);
+        const char *names[] = {"rewrite", "write_at", "append"};
+        cout << "          " << names[mode] << "  " << ops << "  " << us << "  " << written / 1024.0 / ops << "  "
+             << metadata.entries[0].extent_count << (ok ? "" : "  (hata!)") << "\n";
+        fs_unmount(fs);
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// Scrub throughput: fs_check_integrity reading back every block and
+// checking its CRC32C, by thread count, through pread and through the
+// mapping. The image is in the page cache, so this is the checksum and copy
+// cost rather than the disk's. Then the metadata part alone on a table with
+// many files, where the old pairwise overlap test was quadratic.
+static void bench_scrub() {
+    vector<char> raw(64 << 20, 's');
+    double t0 = now_ns();
+    uint32_t c = crc32c(0, raw.data(), raw.size());
+    double hw_s = (now_ns() - t0) / 1e9;
+    t0 = now_ns();
+    c ^= crc32c_sw(0, raw.data(), raw.size());
+    double sw_s = (now_ns() - t0) / 1e9;
+    cout << "scrub: crc32c_GBps  " << (crc32c_hw_available() ? "sse4.2 " : "(yok) ") << raw.size() / hw_s / 1e9
+         << "  table " << raw.size() / sw_s / 1e9 << (c ? "  (hata!)" : "") << "\n";
+
+    FsGeometry geometry;
+    geometry.volume_size = 512ull << 20;
+    geometry.block_size = 4096;
+    geometry.max_files = 128;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    fs_log_set_level(FS_LOG_OFF);
+    const int files = 100;
+    const int64_t size = 4 << 20;
+    string data(size, 0);
+    for (int64_t i = 0; i < size; ++i) data[i] = (char)(i * 31 + i / 4096);
+    for (int i = 0; i < files; ++i) {
+        fs_create(fs, "s" + to_string(i));
+        fs_write(fs, "s" + to_string(i), data.data(), size);
+    }
+    fs_unmount(fs);
+
+    vector<unsigned> counts;
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    for (unsigned threads = 1; threads < cores; threads *= 2) counts.push_back(threads);
+    counts.push_back(cores);
+    cout << "scrub: device  threads  ms  GBps\n";
+    for (int mode = 0; mode < 2; ++mode) {
+        FsMountOptions options;
+        options.use_mmap = mode == 1;
+        fs = fs_mount(BENCH_DISK, options);
+        fs_check_integrity(fs, 1);   // warm the cache
+        for (unsigned threads : counts) {
+            t0 = now_ns();
+            bool ok = fs_check_integrity(fs, threads);
+            double s = (now_ns() - t0) / 1e9;
+            cout << "       " << (mode ? "mmap" : "pread") << "  " << threads << "  " << s * 1e3 << "  "
+                 << (double)files * size / s / 1e9 << (ok ? "" : "  (hata!)") << "\n";
+        }
+        fs_unmount(fs);
+    }
+
+    geometry.volume_size = 64ull << 20;
+    geometry.max_files = 20000;
+    fs_format(BENCH_DISK, geometry);
+    fs = fs_mount(BENCH_DISK);
+    for (int i = 0; i < (int)geometry.max_files; ++i) {
+        fs_create(fs, "m" + to_string(i));
+        fs_write(fs, "m" + to_string(i), "x", 1);
+    }
+    t0 = now_ns();
+    bool ok = fs_check_integrity(fs);
+    cout << "scrub: files  check_ms\n       " << geometry.max_files << "  " << (now_ns() - t0) / 1e6
+         << (ok ? "" : "  (hata!)") << "\n";
+    fs_unmount(fs);
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// fs_diff on 64 MiB files against the old way (both files read into heap
+// buffers and memcmp'd), with the bytes each reads. Then the comparator
+// alone against memcmp and a byte loop.
+static void bench_diff() {
+    FsGeometry geometry;
+    geometry.volume_size = 512ull << 20;
+    geometry.block_size = 4096;
+    geometry.max_files = 16;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    fs_log_set_level(FS_LOG_OFF);
+    const int64_t size = 64 << 20;
+    string data(size, 0);
+    for (int64_t i = 0; i < size; ++i) data[i] = (char)(i * 131 + i / 4093);
+    fs_create(fs, "a");
+    fs_write(fs, "a", data.data(), size);
+    fs_create(fs, "same");
+    fs_write(fs, "same", data.data(), size);
+    fs_copy(fs, "a", "copy");
+    data[size - 1] ^= 1;
+    fs_create(fs, "last");
+    fs_write(fs, "last", data.data(), size);
+    fs_flush(fs);
+
+    cout << "diff: case  old_ms  old_MiB_read  new_ms  new_MiB_read\n";
+    const char *cases[] = {"same", "last", "copy"};
+    for (const char *other : cases) {
+        uint64_t r0 = io_counter("rchar:");
+        double t0 = now_ns();
+        vector<char> buf1(size), buf2(size);
+        fs_read(fs, "a", 0, size, buf1.data());
+        fs_read(fs, other, 0, size, buf2.data());
+        bool old_same = memcmp(buf1.data(), buf2.data(), size) == 0;
+        double old_ms = (now_ns() - t0) / 1e6;
+        uint64_t old_read = io_counter("rchar:") - r0;
+
+        r0 = io_counter("rchar:");
+        t0 = now_ns();
+        bool same = fs_diff(fs, "a", other);
+        double new_ms = (now_ns() - t0) / 1e6;
+        uint64_t new_read = io_counter("rchar:") - r0;
+        cout << "      " << other << "  " << old_ms << "  " << old_read / double(1 << 20) << "  " << new_ms << "  "
+             << new_read / double(1 << 20) << (same == old_same ? "" : "  (hata!)") << "\n";
+    }
+    FsDiffReport report;
+    double t0 = now_ns();
+    bool ok = fs_diff_report(fs, "a", "last", report) && report.first_difference == size - 1;
+    cout << "diff: report_ms " << (now_ns() - t0) / 1e6 << (ok ? "" : "  (hata!)") << "\n";
+    fs_unmount(fs);
+
+    string copy = data;
+    copy[size - 1] ^= 1;
+    t0 = now_ns();
+    size_t at = first_mismatch(data.data(), copy.data(), size);
+    double simd_s = (now_ns() - t0) / 1e9;
+    t0 = now_ns();
+    int order = memcmp(data.data(), copy.data(), size);
+    double memcmp_s = (now_ns() - t0) / 1e9;
+    t0 = now_ns();
+    int64_t i = 0;
+    while (i < size && data[i] == copy[i]) ++i;
+    double loop_s = (now_ns() - t0) / 1e9;
+    cout << "diff: compare_GBps  first_mismatch " << size / simd_s / 1e9 << "  memcmp " << size / memcmp_s / 1e9
+         << "  byte_loop " << size / loop_s / 1e9 << (at == (size_t)i && order ? "" : "  (hata!)") << "\n";
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// Block cache against plain pread/pwrite: random 4 KiB reads of a hot
+// 16 MiB file, 4 KiB sequential reads of a 64 MiB one, and 200-byte appends,
+// with the image calls and cache hit rate each needed. The image is in the
+// page cache, so the cache saves system calls here, not disk reads.
+static void bench_cache() {
+    const int64_t hot_size = 16 << 20, seq_size = 64 << 20;
+    const int reads = 100000, appends = 20000;
+    FsGeometry geometry;
+    geometry.volume_size = 256ull << 20;
+    geometry.block_size = 4096;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    string data(seq_size, 0);
+    for (int64_t i = 0; i < seq_size; ++i) data[i] = (char)(i * 31 >> 8);
+    fs_create(fs, "hot");
+    fs_write(fs, "hot", data.data(), hot_size);
+    fs_create(fs, "seq");
+    fs_write(fs, "seq", data.data(), seq_size);
+    fs_unmount(fs);
+
+    mt19937_64 rng(3);
+    vector<int64_t> offsets(reads);
+    for (int64_t &o : offsets) o = rng() % (hot_size / 4096) * 4096;
+
+    cout << "cache: mode  op  ns_per_op  calls_per_op  hit_%\n";
+    for (int mode = 0; mode < 3; ++mode) {
+        FsMountOptions options;
+        options.cache_bytes = mode ? 64 << 20 : 0;
+        options.direct_io = mode == 2;
+        fs = fs_mount(BENCH_DISK, options);
+        const char *name = mode == 0 ? "pread" : mode == 1 ? "cache" : "cache_direct";
+        bool good = true;
+        char buffer[4096];
+        auto report = [&](const char *op, double ns, uint64_t ops, const FsStats &before) {
+            FsStats after = fs_stats();
+            uint64_t calls = after.read_calls + after.write_calls - before.read_calls - before.write_calls;
+            uint64_t hits = after.cache_hits - before.cache_hits;
+            uint64_t lookups = hits + after.cache_misses - before.cache_misses;
+            cout << "       " << name << "  " << op << "  " << ns / ops << "  " << (double)calls / ops << "  "
+                 << (lookups ? 100.0 * hits / lookups : 0.0) << "\n";
+        };
+
+        FsStats before = fs_stats();
+        double t0 = now_ns();
+        for (int64_t o : offsets) {
+            fs_read(fs, "hot", o, sizeof(buffer), buffer);
+            good &= memcmp(buffer, &data[o], sizeof(buffer)) == 0;
+        }
+        report("random_4k", now_ns() - t0, reads, before);
+
+        before = fs_stats();
+        t0 = now_ns();
+        for (int64_t o = 0; o < seq_size; o += sizeof(buffer)) {
+            fs_read(fs, "seq", o, sizeof(buffer), buffer);
+            good &= buffer[100] == data[o + 100];
+        }
+        report("seq_4k", now_ns() - t0, seq_size / sizeof(buffer), before);
+
+        fs_create(fs, "log");
+        before = fs_stats();
+        t0 = now_ns();
+        for (int k = 0; k < appends; ++k) fs_append(fs, "log", data.data(), 200);
+        fs_flush(fs);
+        report("append_200", now_ns() - t0, appends, before);
+        good &= fs_size(fs, "log") == 200 * appends;
+        fs_delete(fs, "log");
+        if (!good) cout << "       (hatali veri!)\n";
+        fs_unmount(fs);
+    }
+    unlink(BENCH_DISK);
+}
+
+// Random 16 KiB reads and 4 KiB writes over 64 files at queue depths 1 to
+// 64 through the async API, with io_uring and with the plain worker pool,
+// against calling fs_read_at/fs_write_at in a loop. The image is dropped
+// from the page cache before each read run, so reads reach the disk.
+static void bench_async() {
+    const int files = 64, reads = 4000, writes = 4000;
+    const int64_t file_size = 4 << 20, read_size = 16 << 10, write_size = 4096;
+    FsGeometry geometry;
+    geometry.volume_size = 512ull << 20;
+    geometry.block_size = 4096;
+    geometry.max_files = files;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    fs_log_set_level(FS_LOG_OFF);
+    string data(file_size, 'a');
+    vector<string> names;
+    for (int i = 0; i < files; ++i) {
+        names.push_back("file" + to_string(i));
+        fs_create(fs, names.back());
+        fs_write(fs, names.back(), data.data(), file_size);
+    }
+    fs_unmount(fs);
+
+    mt19937 rng(9);
+    vector<pair<int, int64_t>> read_ops(reads), write_ops(writes);
+    for (auto &op : read_ops) op = {int(rng() % files), int64_t(rng() % (file_size / read_size)) * read_size};
+    for (auto &op : write_ops) op = {int(rng() % files), int64_t(rng() % (file_size / write_size)) * write_size};
+    auto drop_cache = [] {
+        int fd = open(BENCH_DISK, O_RDONLY);
+        if (fd < 0) return;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    };
+
+    cout << "async: backend  qd  read_kops  read_MBps  write_kops\n";
+    string patch(write_size, 'p');
+    for (int mode = 0; mode < 3; ++mode) {
+        FsMountOptions options;
+        options.io_uring = mode == 2;
+        fs = fs_mount(BENCH_DISK, options);
+        if (mode == 2 && !fs_uses_uring(fs)) {
+            cout << "       uring  (cekirdek io_uring vermiyor)\n";
+            fs_unmount(fs);
+            break;
+        }
+        const char *name = mode == 0 ? "sync" : mode == 1 ? "pool" : "uring";
+        for (int qd : {1, 2, 4, 8, 16, 32, 64}) {
+            if (mode == 0 && qd > 1) break;
+            FsAsync *async = mode ? fs_async_start(fs, qd) : nullptr;
+            vector<vector<char>> buffers(qd, vector<char>(read_size));
+            bool ok = true;
+
+            drop_cache();
+            double t0 = now_ns();
+            if (!async) {
+                for (const auto &op : read_ops)
+                    ok &= fs_read_at(fs, names[op.first], op.second, buffers[0].data(), read_size) == read_size;
+            } else {
+                deque<future<int64_t>> pending;
+                for (int k = 0; k < reads; ++k) {
+                    if ((int)pending.size() == qd) {
+                        ok &= pending.front().get() == read_size;
+                        pending.pop_front();
+                    }
+                    const auto &op = read_ops[k];
+                    pending.push_back(fs_read_async(async, names[op.first], op.second, buffers[k % qd].data(), read_size));
+                }
+                for (auto &f : pending) ok &= f.get() == read_size;
+            }
+            double read_ns = now_ns() - t0;
+
+            t0 = now_ns();
+            if (!async) {
+                for (const auto &op : write_ops)
+                    ok &= fs_write_at(fs, names[op.first], op.second, patch.data(), write_size);
+            } else {
+                deque<future<bool>> pending;
+                for (const auto &op : write_ops) {
+                    if ((int)pending.size() == qd) {
+                        ok &= pending.front().get();
+                        pending.pop_front();
+                    }
+                    pending.push_back(fs_write_async(async, names[op.first], op.second, patch.data(), write_size));
+                }
+                for (auto &f : pending) ok &= f.get();
+            }
+            fs_flush(fs);
+            double write_ns = now_ns() - t0;
+            fs_async_stop(async);
+
+            cout << "       " << name << "  " << qd << "  " << reads / read_ns * 1e6 << "  "
+                 << reads * read_size / (read_ns / 1e9) / 1e6 << "  " << writes / write_ns * 1e6
+                 << (ok ? "" : "  (hata!)") << "\n";
+        }
+        fs_unmount(fs);
+    }
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+}
+
+// A 32 MiB file of log-like text and one of random bytes, stored plain
+// and compressed: the space taken, a whole write, a streaming read, random
+// 4 KiB reads (each expands one 64 KiB chunk) and 4 KiB writes in place.
+static void bench_compress() {
+    const int64_t size = 32 << 20;
+    const int reads = 20000, writes = 500;
+    FsGeometry geometry;
+    geometry.volume_size = 512ull << 20;
+    geometry.block_size = 4096;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    mt19937_64 rng(5);
+    string text, noise(size, 0);
+    const char *words[] = {"GET", "PUT", "/api/v1/items", "/static/app.js", "200", "404", "user=", "ms"};
+    while ((int64_t)text.size() < size) {
+        text += "2026-01-01T12:" + to_string(rng() % 60) + " " + words[rng() % 8] + " " + words[2 + rng() % 2] +
+                " " + words[4 + rng() % 2] + " " + words[6] + to_string(rng() % 1000) + " " + to_string(rng() % 500) +
+                words[7] + "\n";
+    }
+    text.resize(size);
+    for (char &c : noise) c = (char)rng();
+
+    cout << "compress: data  codec  stored_%  write_MBps  read_MBps  random_4k_ns  write_at_4k_ns\n";
+    for (int kind = 0; kind < 2; ++kind) {
+        const string &data = kind == 0 ? text : noise;
+        for (int codec = 0; codec < 2; ++codec) {
+            fs_create(fs, "f");
+            if (codec) fs_set_codec(fs, "f", FS_CODEC_LZ);
+            double t0 = now_ns();
+            bool good = fs_write(fs, "f", data.data(), size) && fs_flush(fs);
+            double write_ns = now_ns() - t0;
+            Metadata metadata;
+            fs_load_metadata(fs, metadata);
+            uint64_t stored = 0;
+            for (const FileEntry &entry : metadata.entries)
+                if (entry.used) stored = entry.size;
+
+            auto same = [&] {
+                int64_t at = 0;
+                return fs_read_chunks(fs, "f", 0, size, [&](const char *p, int64_t n) {
+                    bool equal = memcmp(p, data.data() + at, n) == 0;
+                    at += n;
+                    return equal;
+                });
+            };
+            t0 = now_ns();
+            good &= same();
+            double read_ns = now_ns() - t0;
+
+            char buffer[4096];
+            t0 = now_ns();
+            for (int k = 0; k < reads; ++k) {
+                int64_t o = rng() % (size - sizeof(buffer));
+                good &= fs_read(fs, "f", o, sizeof(buffer), buffer) && memcmp(buffer, data.data() + o, sizeof(buffer)) == 0;
+            }
+            double random_ns = (now_ns() - t0) / reads;
+
+            t0 = now_ns();
+            for (int k = 0; k < writes; ++k) {
+                int64_t o = rng() % (size / 4096) * 4096;
+                good &= fs_write_at(fs, "f", o, data.data() + o, 4096);
+            }
+            fs_flush(fs);
+            double write_at_ns = (now_ns() - t0) / writes;
+            good &= same() && fs_size(fs, "f") == size;
+
+            cout << "          " << (kind == 0 ? "text" : "random") << "  " << (codec ? "lz" : "none") << "  "
+                 << 100.0 * stored / size << "  " << size / write_ns * 1e3 << "  " << size / read_ns * 1e3 << "  "
+                 << random_ns << "  " << write_at_ns << (good ? "" : "  (hatali veri!)") << "\n";
+            fs_delete(fs, "f");
+        }
+    }
+    fs_unmount(fs);
+    unlink(BENCH_DISK);
+}
+
+// Blocks in use on a mounted volume, once freed ones are committed.
+static uint64_t used_blocks(FsHandle *fs) {
+    fs_flush(fs);
+    Metadata metadata;
+    fs_load_metadata(fs, metadata);
+    return metadata.superblock.data_blocks - metadata.bitmap.free_count();
+}
+
+// An 8 GiB sparse file on a 1 GiB volume: growing it with truncate, 32 MiB
+// written at either end, reading back a stretch of the hole, punching a
+// hole in the data at the front and cutting the file short, each with the
+// blocks it takes or gives back.
+static void bench_sparse() {
+    const int64_t size = 8ll << 30, data = 32 << 20, read = 256 << 20, punch = 16 << 20;
+    FsGeometry geometry;
+    geometry.volume_size = 1ull << 30;
+    geometry.block_size = 4096;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    const double MiB = (1 << 20) / 4096.0;
+    string payload(data, 0);
+    mt19937_64 rng(3);
+    for (char &c : payload) c = (char)rng();
+
+    bool good = fs_create(fs, "s");
+    uint64_t base = used_blocks(fs);
+    double t0 = now_ns();
+    good &= fs_truncate(fs, "s", size);
+    double grow_us = (now_ns() - t0) / 1e3;
+    good &= fs_size(fs, "s") == size && used_blocks(fs) == base;
+
+    good &= fs_write_at(fs, "s", 0, payload.data(), data) && fs_write_at(fs, "s", size - data, payload.data(), data);
+    double used_mib = (used_blocks(fs) - base) / MiB;
+
+    vector<char> buffer(read);
+    t0 = now_ns();
+    good &= fs_read(fs, "s", size / 2, read, buffer.data());
+    double hole_read_ns = now_ns() - t0;
+    good &= count(buffer.begin(), buffer.end(), 0) == read;
+
+    uint64_t before = used_blocks(fs);
+    t0 = now_ns();
+    good &= fs_punch_hole(fs, "s", data / 4, punch);
+    double punch_us = (now_ns() - t0) / 1e3;
+    double punch_freed = (before - used_blocks(fs)) / MiB;
+    good &= fs_read(fs, "s", 0, data, buffer.data()) &&
+            memcmp(buffer.data(), payload.data(), data / 4) == 0 &&
+            count(buffer.begin() + data / 4, buffer.begin() + data / 4 + punch, 0) == punch &&
+            memcmp(buffer.data() + data / 4 + punch, payload.data() + data / 4 + punch, data - data / 4 - punch) == 0;
+
+    before = used_blocks(fs);
+    t0 = now_ns();
+    good &= fs_truncate(fs, "s", data);
+    double shrink_us = (now_ns() - t0) / 1e3;
+    double shrink_freed = (before - used_blocks(fs)) / MiB;
+    streambuf *out = cout.rdbuf(nullptr);
+    good &= fs_check_integrity(fs);
+    cout.rdbuf(out);
+    fs_unmount(fs);
+
+    cout << "sparse: grow_us=" << grow_us << " used_MiB=" << used_mib << " hole_read_MBps=" << read / hole_read_ns * 1e3
+         << " punch_us=" << punch_us << " punch_freed_MiB=" << punch_freed << " shrink_us=" << shrink_us
+         << " shrink_freed_MiB=" << shrink_freed << (good ? "" : "  (hata!)") << "\n";
+    unlink(BENCH_DISK);
+}
+
+// Snapshots of a volume with 10000 small files and a 256 MiB one: the time
+// to take one, a backup of it written while another thread keeps
+// rewriting the large file front to back, with the blocks the snapshot
+// keeps for the rewritten parts, then
+// rolling back to it (which gives them back) and deleting it.
+static void bench_snapshot() {
+    const int files = 10000;
+    const int64_t big = 256 << 20, piece = 1 << 20;
+    FsGeometry geometry;
+    geometry.volume_size = 1ull << 30;
+    geometry.block_size = 4096;
+    geometry.max_files = 16384;
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    fs_log_set_level(FS_LOG_INFO);
+    const double MiB = (1 << 20) / 4096.0;
+    string payload(big, 0);
+    mt19937_64 rng(4);
+    for (char &c : payload) c = (char)rng();
+
+    bool good = fs_mkdir(fs, "d");
+    string small(100, 's');
+    for (int i = 0; i < files; ++i) {
+        string name = "d/f" + to_string(i);
+        good &= fs_create(fs, name) && fs_write(fs, name, small.data(), small.size());
+    }
+    good &= fs_create(fs, "big") && fs_write(fs, "big", payload.data(), big);
+    fs_flush(fs);
+
+    double t0 = now_ns();
+    good &= fs_snapshot_create(fs, "s");
+    double create_us = (now_ns() - t0) / 1e3;
+    uint64_t before = used_blocks(fs);
+
+    atomic<bool> done(false);
+    atomic<int> writes(0);
+    thread writer([&] {
+        string data(piece, 'w');
+        for (int64_t offset = 0; !done; offset = (offset + piece) % big) {
+            if (fs_write_at(fs, "big", offset, data.data(), piece)) ++writes;
+        }
+    });
+    t0 = now_ns();
+    good &= fs_backup_snapshot(fs, "s", BENCH_DISK ".snap");
+    double export_ms = (now_ns() - t0) / 1e6;
+    done = true;
+    writer.join();
+    double cow_mib = (used_blocks(fs) - before) / MiB;
+
+    // the backup holds the volume as the snapshot saw it, not the rewrites
+    vector<char> buffer(big);
+    FsHandle *copy = fs_mount(BENCH_DISK ".snap");
+    good &= copy && fs_read(copy, "big", 0, big, buffer.data()) && memcmp(buffer.data(), payload.data(), big) == 0 &&
+            fs_size(copy, "d/f" + to_string(files - 1)) == (int64_t)small.size();
+    if (copy) fs_unmount(copy);
+
+    before = used_blocks(fs);
+    t0 = now_ns();
+    good &= fs_snapshot_rollback(fs, "s");
+    double rollback_us = (now_ns() - t0) / 1e3;
+    double rollback_freed = ((double)before - used_blocks(fs)) / MiB;
+    good &= fs_read(fs, "big", 0, big, buffer.data()) && memcmp(buffer.data(), payload.data(), big) == 0;
+
+    t0 = now_ns();
+    good &= fs_snapshot_delete(fs, "s");
+    double delete_us = (now_ns() - t0) / 1e3;
+    streambuf *out = cout.rdbuf(nullptr);
+    good &= fs_check_integrity(fs);
+    cout.rdbuf(out);
+    fs_unmount(fs);
+    fs_log_set_level(FS_LOG_DEBUG);
+
+    cout << "snapshot: files=" << files + 1 << " create_us=" << create_us << " export_MBps=" << big / export_ms / 1e3
+         << " writes_during_export=" << writes << " cow_MiB=" << cow_mib << " rollback_us=" << rollback_us
+         << " rollback_freed_MiB=" << rollback_freed << " delete_us=" << delete_us << (good ? "" : "  (hata!)")
+         << "\n";
+    unlink(BENCH_DISK);
+    unlink(BENCH_DISK ".snap");
+    unlink(BENCH_DISK ".snap.changes");
+}
+
+// Loading a host tree of 5000 files (4 to 64 KiB, in 50 directories) into
+// an empty image one file at a time through fs_create and fs_write, and in
+// bulk with fs_import_tree; exporting it back with fs_export_tree; then a
+// full backup and a restore of the volume on one thread and on one per core.
+static void bench_import() {
+    const int dirs = 50, per_dir = 100;
+    const string host = BENCH_DISK ".tree", out = BENCH_DISK ".out";
+    FsGeometry geometry;
+    geometry.volume_size = 1ull << 30;
+    geometry.block_size = 4096;
+    geometry.max_files = 16384;
+    mkdir(host.c_str(), 0777);
+    mt19937_64 rng(6);
+    uint64_t bytes = 0;
+    for (int d = 0; d < dirs; ++d) {
+        mkdir((host + "/d" + to_string(d)).c_str(), 0777);
+        for (int f = 0; f < per_dir; ++f) {
+            string data(4096 + rng() % (60 << 10), 0);
+            for (char &c : data) c = (char)rng();
+            ofstream(host + "/d" + to_string(d) + "/f" + to_string(f), ios::binary) << data;
+            bytes += data.size();
+        }
+    }
+    auto each_file = [&](const function<bool(const string &name)> &fn) {
+        bool ok = true;
+        for (int d = 0; d < dirs; ++d)
+            for (int f = 0; f < per_dir; ++f) ok &= fn("d" + to_string(d) + "/f" + to_string(f));
+        return ok;
+    };
+    auto host_file = [](const string &path) {
+        ifstream in(path, ios::binary);
+        ostringstream data;
+        data << in.rdbuf();
+        return data.str();
+    };
+
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    fs_log_set_level(FS_LOG_INFO);
+    double t0 = now_ns();
+    bool good = true;
+    for (int d = 0; d < dirs; ++d) good &= fs_mkdir(fs, "d" + to_string(d));
+    good &= each_file([&](const string &name) {
+        string data = host_file(host + "/" + name);
+        return fs_create(fs, name) && fs_write(fs, name, data.data(), data.size());
+    });
+    good &= fs_flush(fs);
+    double one_by_one_ms = (now_ns() - t0) / 1e6;
+    fs_unmount(fs);
+
+    fs_format(BENCH_DISK, geometry);
+    fs = fs_mount(BENCH_DISK);
+    t0 = now_ns();
+    good &= fs && fs_import_tree(fs, host, "");
+    double import_ms = (now_ns() - t0) / 1e6;
+    streambuf *quiet = cout.rdbuf(nullptr);
+    good &= fs_check_integrity(fs);
+    cout.rdbuf(quiet);
+
+    t0 = now_ns();
+    good &= fs_export_tree(fs, "", out);
+    double export_ms = (now_ns() - t0) / 1e6;
+    good &= each_file([&](const string &name) { return host_file(out + "/" + name) == host_file(host + "/" + name); });
+
+    double backup_ms[2], restore_ms[2];
+    for (int k = 0; k < 2; ++k) {
+        t0 = now_ns();
+        good &= fs_backup(fs, BENCH_DISK ".full", k ? 0 : 1);
+        backup_ms[k] = (now_ns() - t0) / 1e6;
+        t0 = now_ns();
+        good &= fs_restore(fs, BENCH_DISK ".full", k ? 0 : 1);
+        restore_ms[k] = (now_ns() - t0) / 1e6;
+    }
+    good &= fs_size(fs, "d0/f0") == (int64_t)host_file(host + "/d0/f0").size();
+    fs_unmount(fs);
+    fs_log_set_level(FS_LOG_DEBUG);
+
+    cout << "import: files=" << dirs * per_dir << " MiB=" << bytes / 1048576.0
+         << " one_by_one_ms=" << one_by_one_ms << " import_ms=" << import_ms
+         << " import_MBps=" << bytes / import_ms / 1e3 << " export_ms=" << export_ms
+         << "\n        backup_ms(1 thread, " << max(1u, thread::hardware_concurrency()) << ")=" << backup_ms[0] << ", "
+         << backup_ms[1] << " restore_ms=" << restore_ms[0] << ", " << restore_ms[1] << (good ? "" : "  (hata!)")
+         << "\n";
+
+    each_file([&](const string &name) {
+        unlink((host + "/" + name).c_str());
+        unlink((out + "/" + name).c_str());
+        return true;
+    });
+    for (int d = 0; d < dirs; ++d) {
+        rmdir((host + "/d" + to_string(d)).c_str());
+        rmdir((out + "/d" + to_string(d)).c_str());
+    }
+    rmdir(host.c_str());
+    rmdir(out.c_str());
+    unlink(BENCH_DISK);
+    unlink(BENCH_DISK ".full");
+}
+
+// Cost of the instrumentation: a bare timer, and a cheap call (fs_size)
+// with tracing off, with tracing on but every call under the threshold, and
+// with every call kept, on one thread and on four.
+static void bench_stats() {
+    const int calls = 1000000;
+    fs_format(BENCH_DISK);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    fs_create(fs, "a");
+    string name = "a";
+
+    double t0 = now_ns();
+    for (int i = 0; i < calls; ++i) FsOpTimer timer(FS_OP_LOOKUP, &name);
+    cout << "stats: timer_ns " << (now_ns() - t0) / calls << "\n"
+         << "       mode  threads  size_ns\n";
+
+    for (int mode = 0; mode < 3; ++mode) {
+        for (int threads : {1, 4}) {
+            if (mode == 1) fs_trace_start(1000000);
+            if (mode == 2) fs_trace_start(0);
+            atomic<int64_t> sizes(0);
+            vector<thread> workers;
+            t0 = now_ns();
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&] {
+                    int64_t sum = 0;
+                    for (int i = 0; i < calls / threads; ++i) sum += fs_size(fs, name) + 1;
+                    sizes += sum;
+                });
+            }
+            for (thread &w : workers) w.join();
+            double ns = (now_ns() - t0) / (calls / threads * threads);
+            if (mode) fs_trace_stop("/dev/null");
+            cout << "       " << (mode == 0 ? "off" : mode == 1 ? "trace_idle" : "trace_all") << "  " << threads
+                 << "  " << ns << (sizes == calls / threads * threads ? "" : "  (hata!)") << "\n";
+        }
+    }
+    FsStats stats = fs_stats();
+    cout << "       lookups counted: " << stats.ops[FS_OP_LOOKUP].count << "\n";
+    fs_unmount(fs);
+    unlink(BENCH_DISK);
+}
+
+// Suite: the fs_* calls over a grid of file counts, file sizes, thread
+// counts and access patterns, one JSON object per measured phase.
+struct SuiteConfig {
+    vector<uint64_t> files = {100, 1000};
+    vector<uint64_t> sizes = {4096, 64 << 10, 1 << 20};
+    vector<int> threads = {1, 4};
+    vector<string> patterns = {"seq", "random", "zipf"};
+    uint64_t max_bytes = 256ull << 20;   // configurations holding more are skipped
+};
+
+struct PhaseResult {
+    uint64_t ops = 0;
+    uint64_t failed = 0;
+    double seconds = 0;
+    vector<double> latency_us;
+    uint64_t syscalls = 0, bytes_read = 0, bytes_written = 0;
+};
+
+// Runs fn(thread, k) for k in [0, ops), spread over threads, timing each call.
+static PhaseResult run_phase(uint64_t ops, int threads, const function<bool(int, uint64_t)> &fn) {
+    PhaseResult result;
+    result.ops = ops;
+    vector<vector<double>> latency(threads);
+    atomic<uint64_t> failed(0);
+    uint64_t calls0 = io_counter("syscr:") + io_counter("syscw:");
+    uint64_t read0 = io_counter("rchar:"), written0 = io_counter("wchar:");
+    double t0 = now_ns();
+    vector<thread> pool;
+    for (int t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            for (uint64_t k = t; k < ops; k += threads) {
+                double start = now_ns();
+                if (!fn(t, k)) failed++;
+                latency[t].push_back((now_ns() - start) / 1e3);
+            }
+        });
+    }
+    for (thread &t : pool) t.join();
+    result.seconds = (now_ns() - t0) / 1e9;
+    // /proc/self/io counts the whole process; the phase is all that runs.
+    result.syscalls = io_counter("syscr:") + io_counter("syscw:") - calls0;
+    result.bytes_read = io_counter("rchar:") - read0;
+    result.bytes_written = io_counter("wchar:") - written0;
+    result.failed = failed;
+    for (auto &l : latency) result.latency_us.insert(result.latency_us.end(), l.begin(), l.end());
+    sort(result.latency_us.begin(), result.latency_us.end());
+    return result;
+}
+
+static double percentile(const vector<double> &sorted, double q) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+}
+
+static void print_phase(ostream &out, bool &first, const string &op, uint64_t files, uint64_t size, int threads,
+                        const string &pattern, const PhaseResult &r) {
+    out << (first ? "[\n" : ",\n") << "  {\"op\": \"" << op << "\", \"files\": " << files << ", \"size\": " << size
+        << ", \"threads\": " << threads << ", \"pattern\": \"" << pattern << "\", \"ops\": " << r.ops
+        << ", \"failed\": " << r.failed << ", \"seconds\": " << r.seconds
+        << ", \"ops_per_sec\": " << (r.seconds > 0 ? r.ops / r.seconds : 0)
+        << ", \"p50_us\": " << percentile(r.latency_us, 0.5) << ", \"p99_us\": " << percentile(r.latency_us, 0.99)
+        << ", \"p999_us\": " << percentile(r.latency_us, 0.999)
+        << ", \"syscalls_per_op\": " << (r.ops ? (double)r.syscalls / r.ops : 0)
+        << ", \"bytes_read\": " << r.bytes_read << ", \"bytes_written\": " << r.bytes_written << "}";
+    first = false;
+}
+
+// Picks file indexes in [0, n): in order, uniformly, or Zipf-distributed
+// (s = 0.99) so that low indexes are hot.
+class FilePicker {
+public:
+    FilePicker(const string &pattern, uint64_t n) : pattern(pattern), n(n) {
+        if (pattern != "zipf") return;
+        cdf.resize(n);
+        double sum = 0;
+        for (uint64_t i = 0; i < n; ++i) cdf[i] = sum += 1 / pow(i + 1, 0.99);
+        for (double &c : cdf) c /= sum;
+    }
+    uint64_t pick(mt19937_64 &rng, uint64_t k) const {
+        if (pattern == "seq") return k % n;
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        if (pattern == "zipf") return min<uint64_t>(n - 1, lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        return (uint64_t)(u * n) % n;
+    }
+
+private:
+    string pattern;
+    uint64_t n;
+    vector<double> cdf;
+};
+
+static void suite_config(ostream &out, bool &first, uint64_t files, uint64_t size, int threads, const SuiteConfig &config) {
+    FsGeometry geometry;
+    geometry.block_size = 4096;
+    geometry.max_files = 2 * files + 16;
+    // room for the files, their appends and the copies made by write
+    geometry.volume_size = max<uint64_t>(64ull << 20, 4 * files * (size + 64 * 4096));
+    fs_format(BENCH_DISK, geometry);
+    FsHandle *fs = fs_mount(BENCH_DISK);
+    if (!fs) {
+        cerr << "bench diski acilamadi\n";
+        return;
+    }
+    auto name = [](uint64_t i) { return "f" + to_string(i); };
+    // Each file starts with its own number, so their first blocks differ.
+    vector<string> data(threads, string(size, 'd'));
+    auto stamp = [&](int t, uint64_t i) {
+        memcpy(&data[t][0], &i, min<uint64_t>(sizeof(i), size));
+        return data[t].data();
+    };
+    auto report = [&](const string &op, const string &pattern, const PhaseResult &r) {
+        print_phase(out, first, op, files, size, threads, pattern, r);
+    };
+
+    report("create", "seq", run_phase(files, threads, [&](int, uint64_t k) { return fs_create(fs, name(k)); }));
+    report("write", "seq", run_phase(files, threads, [&](int t, uint64_t k) {
+        return fs_write(fs, name(k), stamp(t, k), size);
+    }));
+
+    uint64_t ops = min<uint64_t>(max<uint64_t>(files, 2000), max<uint64_t>(1, (256ull << 20) / size));
+    uint64_t append_size = min<uint64_t>(size, 4096);
+    for (const string &pattern : config.patterns) {
+        FilePicker picker(pattern, files);
+        vector<mt19937_64> rngs;
+        for (int t = 0; t < threads; ++t) rngs.emplace_back(t + 1);
+        vector<string> buffers(threads, string(size, 0));
+        report("read", pattern, run_phase(ops, threads, [&](int t, uint64_t k) {
+            return fs_read(fs, name(picker.pick(rngs[t], k)), 0, size, &buffers[t][0]);
+        }));
+        report("overwrite", pattern, run_phase(ops, threads, [&](int t, uint64_t k) {
+            uint64_t i = picker.pick(rngs[t], k);
+            return fs_write(fs, name(i), stamp(t, i), size);
+        }));
+        // Appends are undone per file afterwards so every pattern starts alike.
+        report("append", pattern, run_phase(min<uint64_t>(ops, 64 * files), threads, [&](int t, uint64_t k) {
+            return fs_append(fs, name(picker.pick(rngs[t], k)), data[t].data(), append_size);
+        }));
+        for (uint64_t i = 0; i < files; ++i)
+            if (fs_size(fs, name(i)) > (int64_t)size) fs_truncate(fs, name(i), size);
+    }
+
+    uint64_t pairs = min<uint64_t>(files, 1000);
+    report("copy", "seq", run_phase(pairs, threads, [&](int, uint64_t k) {
+        return fs_copy(fs, name(k), "c" + to_string(k));
+    }));
+    report("diff_copy", "seq", run_phase(pairs, threads, [&](int, uint64_t k) {
+        return fs_diff(fs, name(k), "c" + to_string(k));
+    }));
+    report("diff_other", "seq", run_phase(pairs, threads, [&](int, uint64_t k) {
+        return !fs_diff(fs, name(k), name((k + 1) % files)) || files == 1;
+    }));
+    for (uint64_t k = 0; k < files; k += 2) fs_delete(fs, name(k));
+    for (uint64_t k = 0; k < pairs; ++k) fs_delete(fs, "c" + to_string(k));
+    fs_flush(fs);
+    report("defragment", "-", run_phase(1, 1, [&](int, uint64_t) {
+        fs_defragment(fs);
+        return true;
+    }));
+    report("backup", "-", run_phase(1, 1, [&](int, uint64_t) { return fs_backup(fs, BENCH_DISK ".bak"); }));
+    fs_unmount(fs);
+    unlink(BENCH_DISK ".bak");
+}
+
+static vector<uint64_t> parse_list(const string &text) {
+    vector<uint64_t> values;
+    stringstream in(text);
+    for (string item; getline(in, item, ',');) values.push_back(strtoull(item.c_str(), nullptr, 10));
+    return values;
+}
+
+// bench suite [--files N,..] [--sizes BYTES,..] [--threads N,..]
+//             [--patterns seq,random,zipf] [--max-bytes N] [--json FILE]
+static int bench_suite(int argc, char **argv) {
+    SuiteConfig config;
+    string json;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        string arg = argv[i], value = argv[i + 1];
+        if (arg == "--files") config.files = parse_list(value);
+        else if (arg == "--sizes") config.sizes = parse_list(value);
+        else if (arg == "--threads") {
+            config.threads.clear();
+            for (uint64_t t : parse_list(value)) config.threads.push_back(max<int>(1, t));
+        } else if (arg == "--patterns") {
+            config.patterns.clear();
+            stringstream in(value);
+            for (string p; getline(in, p, ',');) config.patterns.push_back(p);
+        } else if (arg == "--max-bytes") config.max_bytes = strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--json") json = value;
+        else {
+            cerr << "bilinmeyen secenek: " << arg << "\n";
+            return 2;
+        }
+    }
+
+    ofstream file;
+    if (!json.empty()) file.open(json);
+    ostream &out = json.empty() ? cout : file;
+    fs_log_set_level(FS_LOG_OFF);
+    bool first = true;
+    for (uint64_t files : config.files) {
+        for (uint64_t size : config.sizes) {
+            if (files * size > config.max_bytes) continue;
+            for (int threads : config.threads) {
+                cerr << "suite: files=" << files << " size=" << size << " threads=" << threads << "\n";
+                suite_config(out, first, files, size, threads, config);
+            }
+        }
+    }
+    out << (first ? "[]\n" : "\n]\n");
+    fs_log_set_level(FS_LOG_DEBUG);
+    unlink(BENCH_DISK);
+    unlink(BENCH_DISK ".changes");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    string which = argc > 1 ? argv[1] : "all";
+    if (which == "suite") return bench_suite(argc, argv);
+
+    if (which == "all" || which == "lookup") bench_lookup();
+    if (which == "all" || which == "many_files") bench_many_files();
+    if (which == "all" || which == "dirs") bench_dirs();
+    if (which == "all" || which == "mmap") bench_mmap();
+    if (which == "all" || which == "stream") bench_stream();
+    if (which == "all" || which == "log") bench_log();
+    if (which == "all" || which == "threads") bench_threads();
+    if (which == "all" || which == "journal") bench_journal();
+    if (which == "all" || which == "crash") bench_crash();
+    if (which == "all" || which == "defrag") bench_defrag();
+    if (which == "all" || which == "write_at") bench_write_at();
+    if (which == "all" || which == "backup") bench_backup();
+    if (which == "all" || which == "dedup") bench_dedup();
+    if (which == "all" || which == "scrub") bench_scrub();
+    if (which == "all" || which == "diff") bench_diff();
+    if (which == "all" || which == "cache") bench_cache();
+    if (which == "all" || which == "async") bench_async();
+    if (which == "all" || which == "compress") bench_compress();
+    if (which == "all" || which == "sparse") bench_sparse();
+    if (which == "all" || which == "snapshot") bench_snapshot();
+    if (which == "all" || which == "import") bench_import();
+    if (which == "all" || which == "stats") bench_stats();
+    unlink(BENCH_DISK ".changes");
+    return 0;
+}
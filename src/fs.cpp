@@ -1,445 +1,4036 @@
 #include "../include/fs.h"
+#include "../include/fs_device.h"
+#include "../include/fs_journal.h"
+#include "../include/fs_backup.h"
+#include "../include/fs_crc.h"
+#include "../include/fs_compare.h"
+#include "../include/fs_compress.h"
+#include "../include/fs_stats.h"
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <unordered_map>
+#include <map>
+#include <memory>
 #include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <random>
+#include <climits>
+#include <thread>
+#include <atomic>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <ctime>
 #include <cstring>
+#include <cstddef>
+#include <cerrno>
 
 using namespace std;
 
-bool fs_format() {
-    int fd = open(DISK_NAME, O_CREAT | O_RDWR | O_TRUNC, 0666);
+// Files hash onto this many reader/writer locks.
+#define FILE_LOCK_STRIPES 256
+
+struct DirKeyHash {
+    size_t operator()(const pair<uint64_t, string> &key) const {
+        return hash<string>()(key.second) ^ key.first * 0x9e3779b97f4a7c15ull;
+    }
+};
+
+// (directory slot, name) -> entry slot
+typedef unordered_map<pair<uint64_t, string>, uint64_t, DirKeyHash> NameIndex;
+
+// The entry and extent tables as they were when a snapshot was taken, with
+// the snapshot's own entries left out. Never changed afterwards, so readers
+// use it without meta_lock.
+struct Snapshot {
+    uint64_t slot;      // entry whose contents keep the tables on disk
+    uint32_t created;
+    uint64_t files;
+    vector<FileEntry> entries;
+    vector<FileExtent> extents;
+    NameIndex index;
+};
+
+// Locking: an operation first takes the lock of each file it touches (shared
+// to read, exclusive to change contents or extent; two files in stripe
+// order), then commit_lock if it commits, then meta_lock for the Metadata. Data I/O runs with only the file
+// locks held, so operations on different files overlap. Whole-volume
+// operations take every file lock.
+struct FsHandle {
+    shared_mutex meta_lock;
+    shared_mutex file_locks[FILE_LOCK_STRIPES];
+    string path;
+    FsMountOptions options;
+    Device *dev;
+    // Set when a restore could not reopen the image: the handle then has no
+    // files and every call but a restore or unmount fails.
+    atomic<bool> closed;
+    Metadata metadata;
+    bool sb_dirty;
+    vector<uint64_t> dirty_entries;     // slots changed since the last sync
+    // (directory slot, name) -> entry slot; listing holds the same in
+    // directory and name order
+    NameIndex index;
+    map<pair<uint64_t, string>, uint64_t> listing;
+    vector<uint64_t> free_slots;             // unused slots, lowest on top
+    uint64_t alloc_hint;                     // where the next extent search starts
+    uint64_t refs_lo, refs_hi;               // span of refs changed since the last sync
+    uint64_t sums_lo, sums_hi;               // same for sums
+    unordered_map<uint64_t, uint64_t> dedup_index;   // content key -> slot last written with it
+
+    // Metadata changes wait in txn until a commit makes them durable. Blocks
+    // freed meanwhile stay taken in the bitmap until then, so no new data can
+    // overwrite what the last committed state still points to.
+    Journal journal;
+    JournalTxn txn;
+    vector<pair<uint64_t, uint64_t>> pending_free;   // (start, count)
+    vector<uint64_t> shrunk_entries;    // slots truncated in the open transaction
+    uint64_t generation;            // number of the open transaction
+    uint64_t durable_generation;    // last one known durable
+    int ops_since_commit;
+    chrono::steady_clock::time_point last_commit;
+    mutex commit_lock;
+
+    // Image blocks written since the last backup. Kept in a file next to
+    // the image between mounts; a mount that finds none assumes all of them.
+    BlockBitmap changed;
+
+    // Snapshots by name, and the data blocks any of them holds: those are
+    // neither freed nor changed in place. Both change under meta_lock.
+    // snapshot_lock is taken before the file locks: shared by anything
+    // reading a snapshot's blocks, exclusively to free them.
+    map<string, shared_ptr<const Snapshot>> snapshots;
+    BlockBitmap frozen;
+    shared_mutex snapshot_lock;
+};
+
+// Whether fs can be used: it exists and its image is open.
+static bool usable(const FsHandle *fs) {
+    return fs && !fs->closed;
+}
+
+static FsHandle *default_fs = nullptr;
+static mutex default_lock;
+
+namespace {
+struct DefaultUnmount {
+    ~DefaultUnmount() {
+        if (default_fs) fs_unmount(default_fs);
+    }
+} default_unmount;
+}
+
+static uint64_t round_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// Places the regions of a volume with the given geometry.
+static bool plan_layout(const FsGeometry &geometry, Superblock &sb) {
+    uint32_t bs = geometry.block_size;
+    if (bs < 512 || bs > (1u << 20) || (bs & (bs - 1))) return false;
+    if (geometry.max_files == 0 || geometry.max_files > geometry.volume_size / sizeof(FileEntry))
+        return false;
+
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.magic, FS_MAGIC, sizeof(sb.magic));
+    sb.version = FS_VERSION;
+    sb.block_size = bs;
+    sb.volume_size = geometry.volume_size;
+    sb.max_files = geometry.max_files;
+    sb.file_count = 0;
+
+    sb.entry_offset = round_up(sizeof(Superblock), bs);
+    sb.extent_offset = sb.entry_offset + round_up(geometry.max_files * sizeof(FileEntry), bs);
+    sb.extent_bytes = round_up(geometry.max_files * FS_MAX_EXTENTS * sizeof(FileExtent), bs);
+    sb.bitmap_offset = sb.extent_offset + sb.extent_bytes;
+    // sized for every block of the volume, which is always enough for the data area
+    sb.bitmap_bytes = round_up((geometry.volume_size / bs + 63) / 64 * 8, bs);
+    sb.refcount_offset = sb.bitmap_offset + sb.bitmap_bytes;
+    sb.refcount_bytes = round_up(geometry.volume_size / bs * sizeof(uint16_t), bs);
+    sb.checksum_offset = sb.refcount_offset + sb.refcount_bytes;
+    sb.checksum_bytes = round_up(geometry.volume_size / bs * sizeof(uint32_t), bs);
+    sb.journal_offset = sb.checksum_offset + sb.checksum_bytes;
+    if (geometry.journal_bytes)
+        sb.journal_bytes = round_up(geometry.journal_bytes, bs);
+    else
+        sb.journal_bytes = round_up(min<uint64_t>(max<uint64_t>(geometry.volume_size / 64, 64 << 10), 64 << 20), bs);
+    // header block plus room for a transaction of a few blocks
+    if (sb.journal_bytes < 8ull * bs) sb.journal_bytes = 8ull * bs;
+    sb.data_offset = sb.journal_offset + sb.journal_bytes;
+    if (sb.data_offset >= geometry.volume_size) return false;
+    sb.data_blocks = (geometry.volume_size - sb.data_offset) / bs;
+    return sb.data_blocks > 0;
+}
+
+static bool valid_superblock(const Superblock &sb, uint64_t file_size) {
+    if (memcmp(sb.magic, FS_MAGIC, sizeof(sb.magic)) != 0) return false;
+    if (sb.version != FS_VERSION) return false;
+
+    FsGeometry geometry;
+    geometry.volume_size = sb.volume_size;
+    geometry.block_size = sb.block_size;
+    geometry.max_files = sb.max_files;
+    geometry.journal_bytes = sb.journal_bytes;
+    Superblock expected;
+    if (!plan_layout(geometry, expected)) return false;
+    return sb.entry_offset == expected.entry_offset &&
+           sb.extent_offset == expected.extent_offset &&
+           sb.extent_bytes == expected.extent_bytes &&
+           sb.bitmap_offset == expected.bitmap_offset &&
+           sb.bitmap_bytes == expected.bitmap_bytes &&
+           sb.refcount_offset == expected.refcount_offset &&
+           sb.refcount_bytes == expected.refcount_bytes &&
+           sb.checksum_offset == expected.checksum_offset &&
+           sb.checksum_bytes == expected.checksum_bytes &&
+           sb.journal_offset == expected.journal_offset &&
+           sb.journal_bytes == expected.journal_bytes &&
+           sb.data_offset == expected.data_offset &&
+           sb.data_blocks == expected.data_blocks &&
+           sb.file_count <= sb.max_files &&
+           file_size >= sb.volume_size;
+}
+
+static bool read_metadata(Device *dev, Metadata &metadata) {
+    Superblock &sb = metadata.superblock;
+    if (!dev->read_at(0, &sb, sizeof(sb))) return false;
+    if (!valid_superblock(sb, dev->size)) return false;
+
+    metadata.entries.resize(sb.max_files);
+    if (!dev->read_at(sb.entry_offset, metadata.entries.data(), sb.max_files * sizeof(FileEntry)))
+        return false;
+    metadata.extents.resize(sb.max_files * FS_MAX_EXTENTS);
+    if (!dev->read_at(sb.extent_offset, metadata.extents.data(), metadata.extents.size() * sizeof(FileExtent)))
+        return false;
+
+    vector<unsigned char> bits((sb.data_blocks + 63) / 64 * 8);
+    if (!dev->read_at(sb.bitmap_offset, bits.data(), bits.size()))
+        return false;
+    metadata.bitmap.load(bits.data(), sb.data_blocks);
+    stats_count_metadata(1, 0);
+
+    metadata.refs.resize(sb.data_blocks);
+    metadata.sums.resize(sb.data_blocks);
+    return dev->read_at(sb.refcount_offset, metadata.refs.data(), sb.data_blocks * sizeof(uint16_t)) &&
+           dev->read_at(sb.checksum_offset, metadata.sums.data(), sb.data_blocks * sizeof(uint32_t));
+}
+
+static string entry_name(const FileEntry &entry) {
+    return string(entry.filename, strnlen(entry.filename, FILENAME_MAX_LEN));
+}
+
+static void add_name(FsHandle *fs, uint64_t parent, const string &name, uint64_t slot) {
+    fs->index[{parent, name}] = slot;
+    fs->listing[{parent, name}] = slot;
+}
+
+static void drop_name(FsHandle *fs, uint64_t parent, const string &name) {
+    fs->index.erase({parent, name});
+    fs->listing.erase({parent, name});
+}
+
+static void build_index(FsHandle *fs) {
+    const vector<FileEntry> &entries = fs->metadata.entries;
+    fs->index.clear();
+    fs->listing.clear();
+    fs->free_slots.clear();
+    fs->index.reserve(entries.size());
+    for (uint64_t i = entries.size(); i-- > 0;) {
+        const FileEntry &entry = entries[i];
+        if (entry.used)
+            add_name(fs, entry.parent, entry_name(entry), i);
+        else
+            fs->free_slots.push_back(i);
+    }
+}
+
+static bool valid_name(const string &name) {
+    return !name.empty() && name.length() < FILENAME_MAX_LEN && name != "." && name != "..";
+}
+
+// Sets key to the directory path names an entry in and the entry's name
+// there, its key in the index. Any '/' in front, behind or repeated is
+// ignored. False if a directory on the way is missing or a name is not valid.
+static bool resolve_in(const NameIndex &index, const vector<FileEntry> &entries, const string &path,
+                       pair<uint64_t, string> &key) {
+    key.first = FS_ROOT_DIR;
+    size_t a = path.find_first_not_of('/');
+    if (a == string::npos) return false;
+    for (;;) {
+        size_t b = min(path.find('/', a), path.size());
+        key.second.assign(path, a, b - a);
+        if (!valid_name(key.second)) return false;
+        size_t next = path.find_first_not_of('/', b);
+        if (next == string::npos) return true;
+        auto it = index.find(key);
+        if (it == index.end() || entries[it->second].type != FS_TYPE_DIR) return false;
+        key.first = it->second;
+        a = next;
+    }
+}
+
+static bool resolve_parent(const FsHandle *fs, const string &path, pair<uint64_t, string> &key) {
+    return resolve_in(fs->index, fs->metadata.entries, path, key);
+}
+
+static bool is_root(const string &path) {
+    return path.find_first_not_of('/') == string::npos;
+}
+
+// Slot of the file or directory at path, or -1.
+static int64_t find_node(const FsHandle *fs, const string &path) {
+    pair<uint64_t, string> key;
+    if (!resolve_parent(fs, path, key)) return -1;
+    auto it = fs->index.find(key);
+    return it == fs->index.end() ? -1 : (int64_t)it->second;
+}
+
+// Slot of the file at filename, or -1; directories do not count.
+static int64_t find_entry(const FsHandle *fs, const string &filename) {
+    int64_t i = find_node(fs, filename);
+    return i != -1 && fs->metadata.entries[i].type == FS_TYPE_FILE ? i : -1;
+}
+
+// Path from the root of the entry in slot of an entry table; a snapshot
+// entry's is its name.
+static string path_in(const vector<FileEntry> &entries, uint64_t slot) {
+    string path = entry_name(entries[slot]);
+    for (uint64_t p = entries[slot].parent; p != FS_ROOT_DIR && p != FS_SNAPSHOT_DIR; p = entries[p].parent)
+        path = entry_name(entries[p]) + "/" + path;
+    return path;
+}
+
+// Path from the root of the entry in slot. The caller holds meta_lock.
+static string entry_path(const FsHandle *fs, uint64_t slot) {
+    return path_in(fs->metadata.entries, slot);
+}
+
+static void touch_entry(FsHandle *fs, uint64_t slot) {
+    fs->dirty_entries.push_back(slot);
+
+    // A change to the file the defragmenter is moving makes the copy made so
+    // far worthless: give its blocks back.
+    Superblock &sb = fs->metadata.superblock;
+    if (sb.defrag_slot == slot + 1) {
+        fs->pending_free.push_back({sb.defrag_to, sb.defrag_count});
+        sb.defrag_slot = 0;
+        fs->sb_dirty = true;
+    }
+}
+
+// The lock of a file is keyed on its path, hashed (FNV-1a) as if every run
+// of '/' were one and the ones in front and behind were not there, so that
+// all spellings of a path share it. Moving a directory changes the paths
+// under it, so it takes every file lock.
+static shared_mutex &file_lock(FsHandle *fs, const string &filename) {
+    uint64_t h = 14695981039346656037ull;
+    bool slash = false;
+    for (char c : filename) {
+        if (c == '/') {
+            slash = h != 14695981039346656037ull;
+            continue;
+        }
+        if (slash) h = (h ^ '/') * 1099511628211ull;
+        slash = false;
+        h = (h ^ (unsigned char)c) * 1099511628211ull;
+    }
+    return fs->file_locks[h % FILE_LOCK_STRIPES];
+}
+
+// Holds the locks of two files. Stripes are taken in array order; when both
+// names share a stripe it is taken once, exclusively if either side asks.
+class PairLock {
+public:
+    PairLock(FsHandle *fs, const string &name1, bool exclusive1, const string &name2, bool exclusive2) {
+        first = &file_lock(fs, name1);
+        second = &file_lock(fs, name2);
+        first_exclusive = exclusive1;
+        second_exclusive = exclusive2;
+        if (first == second) {
+            second = nullptr;
+            first_exclusive = exclusive1 || exclusive2;
+        } else if (second < first) {
+            swap(first, second);
+            swap(first_exclusive, second_exclusive);
+        }
+        lock(first, first_exclusive);
+        if (second) lock(second, second_exclusive);
+    }
+    ~PairLock() {
+        if (second) unlock(second, second_exclusive);
+        unlock(first, first_exclusive);
+    }
+
+private:
+    static void lock(shared_mutex *m, bool exclusive) { exclusive ? m->lock() : m->lock_shared(); }
+    static void unlock(shared_mutex *m, bool exclusive) { exclusive ? m->unlock() : m->unlock_shared(); }
+
+    shared_mutex *first;
+    shared_mutex *second;
+    bool first_exclusive;
+    bool second_exclusive;
+};
+
+// Holds every file lock, for operations that touch the whole volume.
+class AllFilesLock {
+public:
+    AllFilesLock(FsHandle *fs, bool exclusive) : fs(fs), exclusive(exclusive) {
+        for (shared_mutex &m : fs->file_locks) exclusive ? m.lock() : m.lock_shared();
+    }
+    ~AllFilesLock() {
+        for (shared_mutex &m : fs->file_locks) exclusive ? m.unlock() : m.unlock_shared();
+    }
+
+private:
+    FsHandle *fs;
+    bool exclusive;
+};
+
+// A file's entry and its extents in file order, copied out of the Metadata.
+struct FileMap {
+    FileEntry entry;
+    vector<FileExtent> extents;
+};
+
+static FileExtent *extent_row(Metadata &metadata, uint64_t slot) {
+    return &metadata.extents[slot * FS_MAX_EXTENTS];
+}
+
+// Entry slot and its extents out of an entry and an extent table.
+static void map_in(const vector<FileEntry> &entries, const vector<FileExtent> &extents, uint64_t slot,
+                   FileMap &map) {
+    map.entry = entries[slot];
+    const FileExtent *row = &extents[slot * FS_MAX_EXTENTS];
+    map.extents.assign(row, row + min<uint32_t>(map.entry.extent_count, FS_MAX_EXTENTS));
+}
+
+static void get_map(const FsHandle *fs, uint64_t slot, FileMap &map) {
+    map_in(fs->metadata.entries, fs->metadata.extents, slot, map);
+}
+
+static bool is_hole(const FileExtent &e) {
+    return e.start == FS_HOLE;
+}
+
+static bool has_holes(const vector<FileExtent> &extents) {
+    return any_of(extents.begin(), extents.end(), is_hole);
+}
+
+// Joins extents that follow each other on disk, and holes next to each other.
+static void merge_extents(vector<FileExtent> &extents) {
+    size_t n = 0;
+    for (const FileExtent &e : extents) {
+        if (!e.count) continue;
+        const FileExtent *prev = n ? &extents[n - 1] : nullptr;
+        if (prev && (is_hole(*prev) ? is_hole(e) : !is_hole(e) && prev->start + prev->count == e.start))
+            extents[n - 1].count += e.count;
+        else
+            extents[n++] = e;
+    }
+    extents.resize(n);
+}
+
+// Makes extents, merged, the extents of slot; false, changing nothing, if
+// they do not fit in its row. The caller marks the entry dirty.
+static bool set_extents(FsHandle *fs, uint64_t slot, vector<FileExtent> extents) {
+    merge_extents(extents);
+    if (extents.size() > FS_MAX_EXTENTS) return false;
+    FileExtent *row = extent_row(fs->metadata, slot);
+    copy(extents.begin(), extents.end(), row);
+    fill(row + extents.size(), row + FS_MAX_EXTENTS, FileExtent{0, 0});
+    fs->metadata.entries[slot].extent_count = extents.size();
+    return true;
+}
+
+// Extents holding blocks [first, end) of a file.
+static vector<FileExtent> slice_extents(const vector<FileExtent> &extents, uint64_t first, uint64_t end) {
+    vector<FileExtent> out;
+    uint64_t at = 0;
+    for (const FileExtent &e : extents) {
+        uint64_t lo = max(at, first), hi = min(at + e.count, end);
+        if (lo < hi) out.push_back({is_hole(e) ? FS_HOLE : e.start + lo - at, hi - lo});
+        at += e.count;
+    }
+    return out;
+}
+
+// Walks the data blocks of a file in file order, FS_HOLE for those in a hole.
+struct BlockCursor {
+    const vector<FileExtent> &extents;
+    size_t extent = 0;
+    uint64_t within = 0;
+
+    explicit BlockCursor(const vector<FileExtent> &extents) : extents(extents) {}
+
+    uint64_t next() {
+        const FileExtent &e = extents[extent];
+        uint64_t block = is_hole(e) ? FS_HOLE : e.start + within;
+        if (++within == extents[extent].count) {
+            ++extent;
+            within = 0;
+        }
+        return block;
+    }
+};
+
+// Data block holding block k of a file; FS_HOLE inside a hole.
+static uint64_t file_block(const vector<FileExtent> &extents, uint64_t k) {
+    for (const FileExtent &e : extents) {
+        if (k < e.count) return is_hole(e) ? FS_HOLE : e.start + k;
+        k -= e.count;
+    }
+    return UINT64_MAX;
+}
+
+// Copy of the entry of filename and its extents, taken under a shared
+// meta_lock. The caller holds the file lock, which keeps them from changing
+// afterwards.
+static bool lookup(FsHandle *fs, const string &filename, FileMap &map) {
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+    get_map(fs, i, map);
+    return true;
+}
+
+static uint64_t blocks_for(const FsHandle *fs, uint64_t size) {
+    uint64_t bs = fs->metadata.superblock.block_size;
+    return (size + bs - 1) / bs;
+}
+
+static off_t block_offset(const FsHandle *fs, uint64_t block) {
+    const Superblock &sb = fs->metadata.superblock;
+    return sb.data_offset + block * sb.block_size;
+}
+
+// Every file owns exactly blocks_for(size) blocks, in at most
+// FS_MAX_EXTENTS extents inside the data area.
+static bool extents_valid(const FsHandle *fs, uint64_t slot) {
+    const FileEntry &entry = fs->metadata.entries[slot];
+    if (entry.extent_count > FS_MAX_EXTENTS) return false;
+    uint64_t data_blocks = fs->metadata.superblock.data_blocks, total = 0;
+    for (uint32_t k = 0; k < entry.extent_count; ++k) {
+        const FileExtent &e = fs->metadata.extents[slot * FS_MAX_EXTENTS + k];
+        if (e.count == 0 || (!is_hole(e) && (e.start > data_blocks || e.count > data_blocks - e.start)))
+            return false;
+        total += e.count;
+    }
+    return total == blocks_for(fs, entry.size);
+}
+
+// Image ranges (offset, length) holding [offset, offset + size) of a file,
+// in file order; the parts in a hole have offset FS_HOLE.
+static vector<pair<uint64_t, uint64_t>> file_ranges(const FsHandle *fs, const vector<FileExtent> &extents,
+                                                    uint64_t offset, uint64_t size) {
+    vector<pair<uint64_t, uint64_t>> ranges;
+    uint64_t bs = fs->metadata.superblock.block_size, at = 0, end = offset + size;
+    for (const FileExtent &e : extents) {
+        uint64_t lo = max(at, offset), hi = min(at + e.count * bs, end);
+        if (lo < hi) {
+            uint64_t image = is_hole(e) ? FS_HOLE : block_offset(fs, e.start) + lo - at;
+            bool joins = !ranges.empty() && (image == FS_HOLE ? ranges.back().first == FS_HOLE
+                                                              : ranges.back().first + ranges.back().second == image);
+            if (joins)
+                ranges.back().second += hi - lo;
+            else
+                ranges.push_back({image, hi - lo});
+        }
+        at += e.count * bs;
+    }
+    return ranges;
+}
+
+// Hands [offset, offset + bytes) of the image to fn in pieces of at most
+// FS_CHUNK_SIZE, straight from the mapping when there is one. Returns false
+// on a read error or when fn asks to stop.
+static bool stream_range(FsHandle *fs, uint64_t offset, uint64_t bytes, const FsChunkFn &fn) {
+    vector<char> buffer;
+    for (uint64_t done = 0; done < bytes;) {
+        uint64_t n = min<uint64_t>(FS_CHUNK_SIZE, bytes - done);
+        const char *data = fs->dev->view(offset + done, n);
+        if (!data) {
+            buffer.resize(n);
+            if (!fs->dev->read_at(offset + done, buffer.data(), n)) return false;
+            data = buffer.data();
+        }
+        if (!fn(data, n)) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Copies bytes inside the image front to back, so the destination may
+// overlap the source as long as it starts before it.
+static bool copy_range(FsHandle *fs, uint64_t from, uint64_t to, uint64_t bytes) {
+    uint64_t done = 0;
+    return stream_range(fs, from, bytes, [&](const char *data, int64_t n) {
+        bool ok = fs->dev->write_at(to + done, data, n);
+        done += n;
+        return ok;
+    });
+}
+
+// Moves [offset, offset + size) of a file to or from buffer: one segment
+// per run of its extents, all in one batch. Holes read as zeros; nothing
+// may be written to one.
+static bool transfer_file(FsHandle *fs, const vector<FileExtent> &extents, uint64_t offset, uint64_t size,
+                          char *buffer, bool write) {
+    vector<pair<uint64_t, uint64_t>> ranges = file_ranges(fs, extents, offset, size);
+    vector<iovec> iov(ranges.size());
+    vector<IoSegment> segments;
+    for (size_t k = 0; k < ranges.size(); ++k) {
+        iov[k] = {buffer, ranges[k].second};
+        if (ranges[k].first != FS_HOLE) segments.push_back({ranges[k].first, &iov[k], 1, write});
+        else if (write) return false;
+        else memset(buffer, 0, ranges[k].second);
+        buffer += ranges[k].second;
+    }
+    return fs->dev->submit(segments.data(), segments.size());
+}
+
+static bool read_file(FsHandle *fs, const vector<FileExtent> &extents, uint64_t offset, uint64_t size, char *buffer) {
+    return transfer_file(fs, extents, offset, size, buffer, false);
+}
+
+static bool write_file(FsHandle *fs, const vector<FileExtent> &extents, uint64_t offset, const char *data, uint64_t size) {
+    return transfer_file(fs, extents, offset, size, const_cast<char *>(data), true);
+}
+
+// Hands fn bytes zeros in pieces of at most FS_CHUNK_SIZE.
+static bool stream_zeros(uint64_t bytes, const FsChunkFn &fn) {
+    static const vector<char> zeros(FS_CHUNK_SIZE);
+    for (uint64_t done = 0; done < bytes;) {
+        uint64_t n = min<uint64_t>(FS_CHUNK_SIZE, bytes - done);
+        if (!fn(zeros.data(), n)) return false;
+        done += n;
+    }
+    return true;
+}
+
+// stream_range over [offset, offset + size) of a file.
+static bool stream_file(FsHandle *fs, const vector<FileExtent> &extents, uint64_t offset, uint64_t size,
+                        const FsChunkFn &fn) {
+    for (const auto &r : file_ranges(fs, extents, offset, size)) {
+        bool ok = r.first == FS_HOLE ? stream_zeros(r.second, fn) : stream_range(fs, r.first, r.second, fn);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Copies the first size bytes of one file's blocks to another's.
+static bool copy_file(FsHandle *fs, const vector<FileExtent> &from, const vector<FileExtent> &to, uint64_t size) {
+    uint64_t done = 0;
+    return stream_file(fs, from, 0, size, [&](const char *data, int64_t n) {
+        bool ok = write_file(fs, to, done, data, n);
+        done += n;
+        return ok;
+    });
+}
+
+// Notes that [offset, offset + length) of the image is about to change, for
+// the next incremental backup. Called under meta_lock.
+static void mark_changed(FsHandle *fs, uint64_t offset, uint64_t length) {
+    if (!length) return;
+    uint64_t bs = fs->metadata.superblock.block_size;
+    uint64_t first = offset / bs;
+    fs->changed.set_range(first, (offset + length - 1) / bs - first + 1);
+}
+
+static void mark_file_changed(FsHandle *fs, const vector<FileExtent> &extents, uint64_t offset, uint64_t size) {
+    for (const auto &r : file_ranges(fs, extents, offset, size))
+        if (r.first != FS_HOLE) mark_changed(fs, r.first, r.second);
+}
+
+static string changes_path(const FsHandle *fs) {
+    return fs->path + ".changes";
+}
+
+// Gives back an extent. The blocks stay taken until the change is committed.
+static void free_blocks(FsHandle *fs, uint64_t start, uint64_t count) {
+    if (count) fs->pending_free.push_back({start, count});
+}
+
+// Widens a dirty span [lo, hi) to take in count entries from start.
+static void widen_span(uint64_t &lo, uint64_t &hi, uint64_t start, uint64_t count) {
+    if (lo == hi) {
+        lo = start;
+        hi = start + count;
+    } else {
+        lo = min(lo, start);
+        hi = max(hi, start + count);
+    }
+}
+
+static void touch_refs(FsHandle *fs, uint64_t start, uint64_t count) {
+    widen_span(fs->refs_lo, fs->refs_hi, start, count);
+}
+
+static void touch_sums(FsHandle *fs, uint64_t start, uint64_t count) {
+    if (count) widen_span(fs->sums_lo, fs->sums_hi, start, count);
+}
+
+// Whether another file or a snapshot holds data block b as well.
+static bool block_shared(const FsHandle *fs, uint64_t b) {
+    return fs->metadata.refs[b] || fs->frozen.test(b);
+}
+
+// Whether another file or a snapshot shares any block of the extent.
+static bool shared(const FsHandle *fs, uint64_t start, uint64_t count) {
+    for (uint64_t b = start; b < start + count; ++b)
+        if (block_shared(fs, b)) return true;
+    return false;
+}
+
+static bool shared_extents(const FsHandle *fs, const vector<FileExtent> &extents) {
+    for (const FileExtent &e : extents)
+        if (!is_hole(e) && shared(fs, e.start, e.count)) return true;
+    return false;
+}
+
+// Adds one more file to the users of a file's extents. Fails, changing
+// nothing, if a block already has as many as it can count.
+static bool share_extents(FsHandle *fs, const vector<FileExtent> &extents) {
+    vector<uint16_t> &refs = fs->metadata.refs;
+    for (const FileExtent &e : extents)
+        for (uint64_t b = e.start; !is_hole(e) && b < e.start + e.count; ++b)
+            if (refs[b] == UINT16_MAX) return false;
+    for (const FileExtent &e : extents) {
+        if (is_hole(e)) continue;
+        for (uint64_t b = e.start; b < e.start + e.count; ++b) refs[b]++;
+        touch_refs(fs, e.start, e.count);
+    }
+    return true;
+}
+
+// A file lets go of an extent: blocks it shared lose a reference, the
+// others are freed unless a snapshot holds them.
+static void release_blocks(FsHandle *fs, uint64_t start, uint64_t count) {
+    vector<uint16_t> &refs = fs->metadata.refs;
+    uint64_t run = start;
+    for (uint64_t b = start; b < start + count; ++b) {
+        if (!block_shared(fs, b)) continue;
+        free_blocks(fs, run, b - run);
+        if (refs[b]) {
+            refs[b]--;
+            touch_refs(fs, b, 1);
+        }
+        run = b + 1;
+    }
+    free_blocks(fs, run, start + count - run);
+}
+
+static void release_extents(FsHandle *fs, const vector<FileExtent> &extents) {
+    for (const FileExtent &e : extents)
+        if (!is_hole(e)) release_blocks(fs, e.start, e.count);
+}
+
+// Checksums of file contents fed in order from the start of a block. Feeding
+// on from a partial last block continues its checksum.
+struct BlockSummer {
+    uint64_t block_size;
+    vector<uint32_t> sums;
+    uint32_t crc = 0;
+    uint64_t fill = 0;      // bytes of the current block seen so far
+
+    explicit BlockSummer(uint64_t block_size) : block_size(block_size) {}
+
+    void add(const char *data, uint64_t n) {
+        while (n > 0) {
+            uint64_t take = min(n, block_size - fill);
+            crc = crc32c(crc, data, take);
+            data += take;
+            n -= take;
+            fill += take;
+            if (fill == block_size) {
+                sums.push_back(crc);
+                crc = 0;
+                fill = 0;
+            }
+        }
+    }
+
+    void finish() {
+        if (fill) sums.push_back(crc);
+    }
+};
+
+// Stores the checksums of a file's blocks from its block first on. Called
+// under meta_lock.
+static void store_file_sums(FsHandle *fs, const vector<FileExtent> &extents, uint64_t first, const vector<uint32_t> &sums) {
+    uint64_t k = 0;
+    for (const FileExtent &e : slice_extents(extents, first, first + sums.size())) {
+        if (!is_hole(e)) {
+            copy(sums.begin() + k, sums.begin() + k + e.count, fs->metadata.sums.begin() + e.start);
+            touch_sums(fs, e.start, e.count);
+        }
+        k += e.count;
+    }
+}
+
+// Checksum of bytes zeros
+static uint32_t zeros_sum(uint64_t bytes) {
+    static const vector<char> zeros(FS_CHUNK_SIZE);
+    uint32_t crc = 0;
+    for (uint64_t n; bytes > 0; bytes -= n) {
+        n = min<uint64_t>(bytes, zeros.size());
+        crc = crc32c(crc, zeros.data(), n);
+    }
+    return crc;
+}
+
+// Checksums of blocks [first, end) of a file of size bytes, those in a
+// hole being the checksums of zeros.
+static vector<uint32_t> file_sums(const FsHandle *fs, const vector<FileExtent> &extents, uint64_t size,
+                                  uint64_t first, uint64_t end) {
+    const vector<uint32_t> &stored = fs->metadata.sums;
+    uint64_t bs = fs->metadata.superblock.block_size, k = first;
+    vector<uint32_t> sums;
+    for (const FileExtent &e : slice_extents(extents, first, end)) {
+        if (is_hole(e)) {
+            for (uint64_t b = k; b < k + e.count; ++b) sums.push_back(zeros_sum(min(bs, size - b * bs)));
+        } else {
+            sums.insert(sums.end(), stored.begin() + e.start, stored.begin() + e.start + e.count);
+        }
+        k += e.count;
+    }
+    return sums;
+}
+
+// Gives the blocks of `to` holding the first size bytes the checksums of
+// those of `from`, whose contents they now hold.
+static void copy_sums(FsHandle *fs, const vector<FileExtent> &from, const vector<FileExtent> &to, uint64_t size) {
+    store_file_sums(fs, to, 0, file_sums(fs, from, size, 0, blocks_for(fs, size)));
+}
+
+// Checksum of the first bytes (at least one) of a data block.
+static bool block_sum(FsHandle *fs, uint64_t block, uint64_t bytes, uint32_t &sum) {
+    BlockSummer summer(fs->metadata.superblock.block_size);
+    bool ok = stream_range(fs, block_offset(fs, block), bytes, [&](const char *data, int64_t n) {
+        summer.add(data, n);
+        return true;
+    });
+    summer.finish();
+    sum = summer.sums.back();
+    return ok;
+}
+
+// Adds a write to the metadata regions to the open transaction.
+static void stage(FsHandle *fs, uint64_t offset, const void *data, uint64_t length) {
+    fs->txn.add(offset, data, length);
+    mark_changed(fs, offset, length);
+}
+
+// Adds the superblock, the changed entries and their extents (coalesced into
+// runs of adjacent slots) and the changed spans of the bitmap, reference counts and checksums
+// to the open transaction.
+static bool sync_metadata(FsHandle *fs) {
+    Metadata &metadata = fs->metadata;
+    const Superblock &sb = metadata.superblock;
+    uint32_t records = fs->txn.records;
+    bool ok = true;
+
+    if (fs->sb_dirty) {
+        stage(fs, 0, &sb, sizeof(sb));
+        fs->sb_dirty = false;
+    }
+
+    vector<uint64_t> &dirty = fs->dirty_entries;
+    if (!dirty.empty()) {
+        sort(dirty.begin(), dirty.end());
+        dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+        for (size_t a = 0; a < dirty.size();) {
+            size_t b = a + 1;
+            while (b < dirty.size() && dirty[b] == dirty[b - 1] + 1) ++b;
+            uint64_t bytes = (b - a) * sizeof(FileEntry);
+            uint64_t offset = sb.entry_offset + dirty[a] * sizeof(FileEntry);
+            stage(fs, offset, &metadata.entries[dirty[a]], bytes);
+            uint64_t row = FS_MAX_EXTENTS * sizeof(FileExtent);
+            stage(fs, sb.extent_offset + dirty[a] * row, &metadata.extents[dirty[a] * FS_MAX_EXTENTS], (b - a) * row);
+            a = b;
+        }
+        dirty.clear();
+    }
+
+    BlockBitmap &bitmap = metadata.bitmap;
+    if (bitmap.dirty_hi > bitmap.dirty_lo) {
+        uint64_t bytes = (bitmap.dirty_hi - bitmap.dirty_lo) * sizeof(uint64_t);
+        uint64_t offset = sb.bitmap_offset + bitmap.dirty_lo * sizeof(uint64_t);
+        stage(fs, offset, &bitmap.words[bitmap.dirty_lo], bytes);
+        bitmap.clean();
+    }
+
+    if (fs->refs_hi > fs->refs_lo) {
+        stage(fs, sb.refcount_offset + fs->refs_lo * sizeof(uint16_t), &metadata.refs[fs->refs_lo],
+              (fs->refs_hi - fs->refs_lo) * sizeof(uint16_t));
+        fs->refs_lo = fs->refs_hi = 0;
+    }
+
+    if (fs->sums_hi > fs->sums_lo) {
+        stage(fs, sb.checksum_offset + fs->sums_lo * sizeof(uint32_t), &metadata.sums[fs->sums_lo],
+              (fs->sums_hi - fs->sums_lo) * sizeof(uint32_t));
+        fs->sums_lo = fs->sums_hi = 0;
+    }
+    if (fs->txn.records != records) stats_count_metadata(0, 1);
+    return ok;
+}
+
+// Adds the bitmap words covering freed extents, with those extents clear,
+// to the open transaction.
+static void stage_frees(FsHandle *fs, const vector<pair<uint64_t, uint64_t>> &freed) {
+    uint64_t lo = UINT64_MAX, hi = 0;
+    for (const auto &f : freed) {
+        lo = min(lo, f.first / 64);
+        hi = max(hi, (f.first + f.second + 63) / 64);
+    }
+    if (lo >= hi) return;
+
+    const BlockBitmap &bitmap = fs->metadata.bitmap;
+    vector<uint64_t> words(bitmap.words.begin() + lo, bitmap.words.begin() + hi);
+    for (const auto &f : freed) {
+        for (uint64_t b = f.first, end = f.first + f.second; b < end;) {
+            uint64_t bit = b % 64;
+            uint64_t n = min<uint64_t>(64 - bit, end - b);
+            uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1) << bit;
+            words[b / 64 - lo] &= ~mask;
+            b += n;
+        }
+    }
+    stage(fs, fs->metadata.superblock.bitmap_offset + lo * sizeof(uint64_t),
+          words.data(), words.size() * sizeof(uint64_t));
+}
+
+// Commits the open transaction. Callers whose changes already went out
+// with another thread's commit return at once, so threads finishing
+// together share the barriers. meta_lock is held through `meta` on entry
+// and on return, but not during the journal I/O.
+static bool commit(FsHandle *fs, unique_lock<shared_mutex> &meta) {
+    uint64_t generation = fs->generation;
+    meta.unlock();
+    lock_guard<mutex> committing(fs->commit_lock);
+    meta.lock();
+    if (fs->closed) return false;
+    if (fs->durable_generation >= generation) return true;
+
+    sync_metadata(fs);
+    vector<pair<uint64_t, uint64_t>> freed;
+    freed.swap(fs->pending_free);
+    stage_frees(fs, freed);
+    fs->shrunk_entries.clear();
+    JournalTxn txn;
+    swap(txn, fs->txn);
+    uint64_t done = fs->generation++;
+    fs->ops_since_commit = 0;
+    fs->last_commit = chrono::steady_clock::now();
+    meta.unlock();
+
+    bool ok;
+    {
+        FsOpTimer timer(FS_OP_COMMIT, nullptr, txn.payload.size());
+        ok = journal_commit(fs->dev, fs->journal, txn);
+    }
+
+    meta.lock();
+    if (ok) {
+        for (const auto &f : freed) fs->metadata.bitmap.clear_range(f.first, f.second);
+        fs->durable_generation = done;
+    } else {
+        // Nothing of it is known to be durable: try all of it again next time.
+        fs->pending_free.insert(fs->pending_free.end(), freed.begin(), freed.end());
+        fs->sb_dirty = true;
+        for (uint64_t i = 0; i < fs->metadata.entries.size(); ++i) touch_entry(fs, i);
+        fs->metadata.bitmap.mark_all_dirty();
+        touch_refs(fs, 0, fs->metadata.refs.size());
+        touch_sums(fs, 0, fs->metadata.sums.size());
+    }
+    return ok;
+}
+
+// Ends a change: its metadata joins the open transaction, which is
+// committed now if the mount asks for that or enough has piled up.
+static bool end_op(FsHandle *fs, unique_lock<shared_mutex> &meta) {
+    sync_metadata(fs);
+    fs->ops_since_commit++;
+    bool due = fs->options.sync_each_op ||
+               fs->ops_since_commit >= fs->options.commit_ops ||
+               fs->txn.payload.size() * 4 > fs->journal.bytes ||
+               chrono::steady_clock::now() - fs->last_commit >= chrono::milliseconds(fs->options.commit_ms);
+    return !due || commit(fs, meta);
+}
+
+// The fewest free runs, largest first and at most max_runs of them, that
+// hold count blocks together, in disk order; false if there are none.
+static bool gather_runs(const BlockBitmap &bitmap, uint64_t count, uint64_t max_runs, vector<FileExtent> &runs) {
+    vector<FileExtent> free_runs;
+    for (int64_t b = bitmap.find_run(1); b >= 0;) {
+        int64_t n = bitmap.run_length(b);
+        free_runs.push_back({(uint64_t)b, (uint64_t)n});
+        if (b + n >= bitmap.nblocks) break;
+        b = bitmap.find_run(1, b + n);
+    }
+    stable_sort(free_runs.begin(), free_runs.end(),
+                [](const FileExtent &a, const FileExtent &b) { return a.count > b.count; });
+    runs.clear();
+    for (const FileExtent &r : free_runs) {
+        if (!count || runs.size() == max_runs) break;
+        runs.push_back({r.start, min(r.count, count)});
+        count -= runs.back().count;
+    }
+    if (count) return false;
+    sort(runs.begin(), runs.end(), [](const FileExtent &a, const FileExtent &b) { return a.start < b.start; });
+    return true;
+}
+
+// Finds and takes count free blocks: one run if there is one, searching on
+// from hint, or else at most max_runs of them. When only blocks waiting for
+// a commit would do, commits first.
+static bool allocate(FsHandle *fs, unique_lock<shared_mutex> &meta, uint64_t count, uint64_t hint,
+                     uint64_t max_runs, vector<FileExtent> &runs) {
+    BlockBitmap &bitmap = fs->metadata.bitmap;
+    runs.clear();
+    if (count == 0) return true;
+    for (int attempt = 0;; ++attempt) {
+        int64_t start = bitmap.find_run(count, hint);
+        if (start < 0) start = bitmap.find_run(count);
+        if (start >= 0) {
+            runs.assign(1, {(uint64_t)start, count});
+            break;
+        }
+        if (max_runs > 1 && gather_runs(bitmap, count, max_runs, runs)) break;
+        if (attempt || fs->pending_free.empty() || !commit(fs, meta)) return false;
+    }
+    for (const FileExtent &r : runs) bitmap.set_range(r.start, r.count);
+    fs->alloc_hint = runs.back().start + runs.back().count;
+    return true;
+}
+
+// Gives back runs taken by allocate that nothing points to yet.
+static void unallocate(FsHandle *fs, const vector<FileExtent> &runs) {
+    for (const FileExtent &r : runs) fs->metadata.bitmap.clear_range(r.start, r.count);
+}
+
+#define SNAPSHOT_MAGIC "FSSNAP01"
+
+// Contents of a snapshot entry: this header, then a record for each entry
+// the snapshot holds.
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t records;
+    uint32_t crc;       // CRC32C of the records
+    uint32_t unused;
+};
+
+struct SnapshotRecord {
+    uint64_t slot;
+    FileEntry entry;
+    FileExtent extents[FS_MAX_EXTENTS];
+};
+
+static_assert(sizeof(SnapshotRecord) == 8 + sizeof(FileEntry) + FS_MAX_EXTENTS * sizeof(FileExtent),
+              "SnapshotRecord must not have padding");
+
+// Fills in the name index and file count of a snapshot from its tables.
+static void index_snapshot(Snapshot &snap) {
+    snap.index.clear();
+    snap.files = 0;
+    for (uint64_t i = 0; i < snap.entries.size(); ++i) {
+        const FileEntry &entry = snap.entries[i];
+        if (!entry.used) continue;
+        snap.index[{entry.parent, entry_name(entry)}] = i;
+        snap.files++;
+    }
+}
+
+// Adds the data blocks of a snapshot's files to the frozen set. Called
+// under meta_lock.
+static void freeze(FsHandle *fs, const Snapshot &snap) {
+    for (uint64_t i = 0; i < snap.entries.size(); ++i) {
+        if (!snap.entries[i].used) continue;
+        for (uint32_t k = 0; k < snap.entries[i].extent_count; ++k) {
+            const FileExtent &e = snap.extents[i * FS_MAX_EXTENTS + k];
+            if (!is_hole(e)) fs->frozen.set_range(e.start, e.count);
+        }
+    }
+}
+
+// Builds the frozen set from the snapshots there are. Called under meta_lock.
+static void refreeze(FsHandle *fs) {
+    fs->frozen.reset(fs->metadata.superblock.data_blocks);
+    for (const auto &s : fs->snapshots) freeze(fs, *s.second);
+}
+
+// On-disk form of a snapshot: its used entries with their extent rows.
+static vector<char> snapshot_table(const Snapshot &snap) {
+    vector<SnapshotRecord> records;
+    records.reserve(snap.files);
+    for (uint64_t i = 0; i < snap.entries.size(); ++i) {
+        if (!snap.entries[i].used) continue;
+        SnapshotRecord r;
+        r.slot = i;
+        r.entry = snap.entries[i];
+        copy_n(snap.extents.begin() + i * FS_MAX_EXTENTS, FS_MAX_EXTENTS, r.extents);
+        records.push_back(r);
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.records = records.size();
+    header.crc = crc32c(0, records.data(), records.size() * sizeof(SnapshotRecord));
+
+    vector<char> table(sizeof(header) + records.size() * sizeof(SnapshotRecord));
+    memcpy(table.data(), &header, sizeof(header));
+    memcpy(table.data() + sizeof(header), records.data(), records.size() * sizeof(SnapshotRecord));
+    return table;
+}
+
+// Reads back the snapshot kept in entry slot; false if its contents are
+// not a snapshot of this volume.
+static bool read_snapshot(FsHandle *fs, uint64_t slot, Snapshot &snap) {
+    const Superblock &sb = fs->metadata.superblock;
+    FileMap map;
+    get_map(fs, slot, map);
+    SnapshotHeader header;
+    if (map.entry.size < sizeof(header) || !read_file(fs, map.extents, 0, sizeof(header), (char *)&header) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.records > sb.max_files ||
+        map.entry.size != sizeof(header) + header.records * sizeof(SnapshotRecord))
+        return false;
+    vector<SnapshotRecord> records(header.records);
+    uint64_t bytes = records.size() * sizeof(SnapshotRecord);
+    if (!read_file(fs, map.extents, sizeof(header), bytes, (char *)records.data()) ||
+        crc32c(0, records.data(), bytes) != header.crc)
+        return false;
+
+    snap.slot = slot;
+    snap.created = map.entry.created;
+    snap.entries.assign(sb.max_files, FileEntry());
+    snap.extents.assign(sb.max_files * FS_MAX_EXTENTS, FileExtent{0, 0});
+    for (const SnapshotRecord &r : records) {
+        if (r.slot >= sb.max_files || r.entry.extent_count > FS_MAX_EXTENTS) return false;
+        for (uint32_t k = 0; k < r.entry.extent_count; ++k) {
+            const FileExtent &e = r.extents[k];
+            if (!is_hole(e) && (e.start > sb.data_blocks || e.count > sb.data_blocks - e.start)) return false;
+        }
+        snap.entries[r.slot] = r.entry;
+        copy_n(r.extents, FS_MAX_EXTENTS, snap.extents.begin() + r.slot * FS_MAX_EXTENTS);
+    }
+    index_snapshot(snap);
+    return true;
+}
+
+// Reads every snapshot entry and builds the frozen set. A snapshot that
+// does not read back is left out, with a warning.
+static void load_snapshots(FsHandle *fs) {
+    fs->snapshots.clear();
+    const vector<FileEntry> &entries = fs->metadata.entries;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].used || entries[i].type != FS_TYPE_SNAPSHOT) continue;
+        auto snap = make_shared<Snapshot>();
+        if (read_snapshot(fs, i, *snap))
+            fs->snapshots[entry_name(entries[i])] = snap;
+        else
+            cerr << "Uyarı: '" << entry_name(entries[i]) << "' anlık görüntüsü okunamadı.\n";
+    }
+    refreeze(fs);
+}
+
+// Drops every change not yet committed, and what is kept about the tables.
+static void reset_state(FsHandle *fs) {
+    fs->sb_dirty = false;
+    fs->dirty_entries.clear();
+    fs->txn.clear();
+    fs->pending_free.clear();
+    fs->shrunk_entries.clear();
+    fs->alloc_hint = 0;
+    fs->refs_lo = fs->refs_hi = 0;
+    fs->sums_lo = fs->sums_hi = 0;
+    fs->dedup_index.clear();
+    fs->ops_since_commit = 0;
+    fs->last_commit = chrono::steady_clock::now();
+}
+
+// Resets the in-memory state after the image was (re)opened: replays the
+// journal and loads the metadata.
+static bool load_image(FsHandle *fs) {
+    Superblock sb;
+    if (!fs->dev->read_at(0, &sb, sizeof(sb)) || !valid_superblock(sb, fs->dev->size)) return false;
+    fs->journal = Journal();
+    fs->journal.offset = sb.journal_offset;
+    fs->journal.bytes = sb.journal_bytes;
+    fs->journal.block_size = sb.block_size;
+    fs->journal.limit = sb.journal_offset;
+    int replayed = 0;
+    if (!journal_open(fs->dev, fs->journal, &replayed)) return false;
+    if (replayed) fs_log("JOURNAL_REPLAY " + to_string(replayed));
+
+    reset_state(fs);
+    if (!read_metadata(fs->dev, fs->metadata)) return false;
+    build_index(fs);
+    load_snapshots(fs);
+    Superblock &msb = fs->metadata.superblock;
+
+    // Change tracking survives only a clean unmount: the file is removed
+    // while mounted, so after a crash every block counts as changed.
+    fs->changed.reset(msb.volume_size / msb.block_size);
+    if (!backup_load_changes(changes_path(fs), msb.backup_id, fs->changed))
+        fs->changed.set_range(0, fs->changed.nblocks);
+    unlink(changes_path(fs).c_str());
+
+    // A move the defragmenter left unfinished carries on with the next step,
+    // provided its record still matches the file.
+    if (msb.defrag_slot) {
+        uint64_t slot = msb.defrag_slot - 1;
+        uint64_t k = msb.defrag_extent;
+        bool valid = slot < msb.max_files && fs->metadata.entries[slot].used &&
+                     k < fs->metadata.entries[slot].extent_count && k < FS_MAX_EXTENTS &&
+                     !is_hole(extent_row(fs->metadata, slot)[k]) &&
+                     msb.defrag_count == extent_row(fs->metadata, slot)[k].count &&
+                     msb.defrag_to <= msb.data_blocks && msb.defrag_count <= msb.data_blocks - msb.defrag_to &&
+                     msb.defrag_done <= msb.defrag_count * msb.block_size;
+        if (!valid) {
+            msb.defrag_slot = 0;
+            fs->sb_dirty = true;
+        }
+    }
+    return true;
+}
+
+FsHandle *fs_mount(const string &path, const FsMountOptions &options) {
+    FsOpTimer timer(FS_OP_MOUNT, &path);
+    Device *dev = device_open(path, options.use_mmap, options.cache_bytes, options.direct_io, options.io_uring);
+    if (!dev) return nullptr;
+
+    FsHandle *fs = new FsHandle;
+    fs->path = path;
+    fs->options = options;
+    fs->dev = dev;
+    fs->closed = false;
+    fs->generation = 1;
+    fs->durable_generation = 0;
+    if (!load_image(fs)) {
+        delete dev;
+        delete fs;
+        return nullptr;
+    }
+    return fs;
+}
+
+void fs_unmount(FsHandle *fs) {
+    if (!fs) return;
+    {
+        unique_lock<shared_mutex> meta(fs->meta_lock);
+        if (commit(fs, meta) && journal_checkpoint(fs->dev, fs->journal))
+            backup_save_changes(changes_path(fs), fs->metadata.superblock.backup_id, fs->changed);
+    }
+    fs_log_flush();
+    delete fs->dev;
+    {
+        lock_guard<mutex> guard(default_lock);
+        if (fs == default_fs) default_fs = nullptr;
+    }
+    delete fs;
+}
+
+bool fs_flush(FsHandle *fs) {
+    if (!usable(fs)) return false;
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    return commit(fs, meta);
+}
+
+bool fs_sync(FsHandle *fs) {
+    if (!usable(fs)) return false;
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    bool ok = commit(fs, meta);
+    return fs->dev->sync() && ok;
+}
+
+bool fs_uses_uring(FsHandle *fs) {
+    return fs && device_uring(fs->dev);
+}
+
+FsHandle *fs_default() {
+    lock_guard<mutex> guard(default_lock);
+    if (!default_fs) default_fs = fs_mount(DISK_NAME);
+    return default_fs;
+}
+
+bool fs_format(const string &path, const FsGeometry &geometry) {
+    Superblock sb;
+    if (!plan_layout(geometry, sb)) return false;
+
+    FsHandle *mounted;
+    {
+        lock_guard<mutex> guard(default_lock);
+        mounted = default_fs && default_fs->path == path ? default_fs : nullptr;
+    }
+    if (mounted) fs_unmount(mounted);
+
+    int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0666);
     if (fd < 0) return false;
 
-    char zero = 0;
-    lseek(fd, DISK_SIZE - 1, SEEK_SET);
-    write(fd, &zero, 1);
+    // A fresh file reads back as zeros: an empty entry table and bitmap.
+    bool ok = ftruncate(fd, geometry.volume_size) == 0;
+    close(fd);
+    Device *dev = ok ? device_open(path, false) : nullptr;
+    if (!dev) return false;
+
+    Journal journal;
+    journal.offset = sb.journal_offset;
+    journal.bytes = sb.journal_bytes;
+    journal.block_size = sb.block_size;
+    ok = dev->write_at(0, &sb, sizeof(sb)) && journal_format(dev, journal) && dev->sync();
+    delete dev;
+    if (ok) fs_log("FORMAT");
+    return ok;
+}
+
+bool fs_format(const FsGeometry &geometry) {
+    return fs_format(DISK_NAME, geometry);
+}
+
+bool fs_load_metadata(FsHandle *fs, Metadata &metadata) {
+    if (!usable(fs)) return false;
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    metadata = fs->metadata;
+    stats_count_metadata(1, 0);
+    return true;
+}
+
+bool fs_save_metadata(FsHandle *fs, const Metadata &metadata) {
+    if (!usable(fs)) return false;
+    unique_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    AllFilesLock files(fs, true);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    const Superblock &sb = fs->metadata.superblock;
+    if (memcmp(&metadata.superblock, &sb, offsetof(Superblock, file_count)) != 0 ||
+        metadata.entries.size() != sb.max_files ||
+        metadata.extents.size() != sb.max_files * FS_MAX_EXTENTS ||
+        metadata.bitmap.nblocks != (int64_t)sb.data_blocks ||
+        metadata.refs.size() != sb.data_blocks ||
+        metadata.sums.size() != sb.data_blocks)
+        return false;
+
+    // Settle earlier frees first: the new bitmap may hand those blocks out.
+    if (!commit(fs, meta)) return false;
+    fs->metadata = metadata;
+    fs->sb_dirty = true;
+    for (uint64_t i = 0; i < metadata.entries.size(); ++i) touch_entry(fs, i);
+    fs->metadata.bitmap.mark_all_dirty();
+    touch_refs(fs, 0, metadata.refs.size());
+    touch_sums(fs, 0, metadata.sums.size());
+    build_index(fs);
+    load_snapshots(fs);
+    return commit(fs, meta);
+}
+
+// Takes a free slot for an entry named key.second in the directory (or
+// pseudo-directory) key.first and returns it, or -1. Called under meta_lock.
+static int64_t add_entry(FsHandle *fs, const pair<uint64_t, string> &key, FsEntryType type) {
+    Metadata &metadata = fs->metadata;
+    uint64_t parent = key.first;
+    const string &filename = key.second;
+
+    if (fs->index.count(key) || fs->free_slots.empty()) return -1;
+    uint64_t index = fs->free_slots.back();
+    fs->free_slots.pop_back();
+
+    // Blocks are reserved by the first write or append.
+    FileEntry &entry = metadata.entries[index];
+    strcpy(entry.filename, filename.c_str());
+    entry.size = 0;
+    entry.raw_size = 0;
+    entry.codec = FS_CODEC_NONE;
+    set_extents(fs, index, {});
+    entry.created = static_cast<uint32_t>(time(nullptr));
+    entry.used = true;
+    entry.type = type;
+    entry.parent = parent;
+    add_name(fs, parent, filename, index);
+    touch_entry(fs, index);
+
+    metadata.superblock.file_count++;
+    fs->sb_dirty = true;
+    return index;
+}
+
+// Takes a free slot for a file or directory at path and returns it, or -1.
+// The caller holds the file lock and meta_lock.
+static int64_t create_entry(FsHandle *fs, const string &path, FsEntryType type = FS_TYPE_FILE) {
+    pair<uint64_t, string> key;
+    if (!resolve_parent(fs, path, key)) return -1;
+    return add_entry(fs, key, type);
+}
+
+bool fs_create(FsHandle *fs, const string &filename) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_CREATE, &filename);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    if (create_entry(fs, filename) == -1) return false;
+    end_op(fs, meta);
+    fs_log("CREATE " + filename);
+    return true;
+}
+
+// Gives back the slot of a file without blocks or an empty directory. The
+// caller holds the file lock and meta_lock.
+static void remove_entry(FsHandle *fs, uint64_t i) {
+    FileEntry &entry = fs->metadata.entries[i];
+    drop_name(fs, entry.parent, entry_name(entry));
+    entry.used = false;
+    touch_entry(fs, i);
+    fs->metadata.superblock.file_count--;
+    fs->sb_dirty = true;
+    fs->free_slots.push_back(i);
+}
+
+bool fs_delete(FsHandle *fs, const string &filename) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_DELETE, &filename);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+
+    FileMap map;
+    get_map(fs, i, map);
+    release_extents(fs, map.extents);
+    set_extents(fs, i, {});
+    remove_entry(fs, i);
+    end_op(fs, meta);
+    fs_log("DELETE " + filename);
+    return true;
+}
+
+bool fs_mkdir(FsHandle *fs, const string &path) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_CREATE, &path);
+    unique_lock<shared_mutex> file(file_lock(fs, path));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    if (create_entry(fs, path, FS_TYPE_DIR) == -1) return false;
+    end_op(fs, meta);
+    fs_log("MKDIR " + path);
+    return true;
+}
+
+bool fs_rmdir(FsHandle *fs, const string &path) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_DELETE, &path);
+    unique_lock<shared_mutex> file(file_lock(fs, path));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_node(fs, path);
+    if (i == -1 || fs->metadata.entries[i].type != FS_TYPE_DIR) return false;
+    auto first = fs->listing.lower_bound({(uint64_t)i, string()});
+    if (first != fs->listing.end() && first->first.first == (uint64_t)i) return false;
+    remove_entry(fs, i);
+    end_op(fs, meta);
+    fs_log("RMDIR " + path);
+    return true;
+}
+
+// Blocks set aside for new contents of an entry. The entry keeps its old
+// blocks until install_blocks, once the data is written.
+struct Reservation {
+    vector<FileExtent> extents;     // the file's blocks afterwards
+    vector<FileExtent> runs;        // newly taken, given back if the write fails
+    vector<FileExtent> released;    // old blocks the file lets go of
+};
+
+// Sets aside room for size bytes of new contents of entry i. A file that
+// has blocks gets fresh ones, leaving the old contents intact until the
+// change is committed; only when none are free does it keep (and shrink or
+// add to) the ones it has, and never when it shares them.
+static bool reserve_blocks(FsHandle *fs, unique_lock<shared_mutex> &meta, uint64_t i, uint64_t size,
+                           Reservation &r) {
+    FileMap map;
+    get_map(fs, i, map);
+    uint64_t have = blocks_for(fs, map.entry.size);
+    uint64_t need = blocks_for(fs, size);
+
+    if (allocate(fs, meta, need, fs->alloc_hint, FS_MAX_EXTENTS, r.runs)) {
+        r.extents = r.runs;
+        r.released = map.extents;
+        return true;
+    }
+    if (have == 0 || has_holes(map.extents) || shared_extents(fs, map.extents)) return false;
+
+    if (need <= have) {
+        r.extents = slice_extents(map.extents, 0, need);
+        r.released = slice_extents(map.extents, need, have);
+        return true;
+    }
+    uint64_t last = map.extents.back().start + map.extents.back().count;
+    if (!allocate(fs, meta, need - have, last, FS_MAX_EXTENTS - map.extents.size(), r.runs)) return false;
+    r.extents = map.extents;
+    r.extents.insert(r.extents.end(), r.runs.begin(), r.runs.end());
+    merge_extents(r.extents);
+    if (r.extents.size() <= FS_MAX_EXTENTS) return true;
+    unallocate(fs, r.runs);
+    return false;
+}
+
+// Points entry i at the reserved blocks, holding size bytes written there,
+// and lets go of the old ones. Called under meta_lock.
+static void install_blocks(FsHandle *fs, uint64_t i, const Reservation &r, uint64_t size) {
+    release_extents(fs, r.released);
+    set_extents(fs, i, r.extents);
+    fs->metadata.entries[i].size = size;
+    touch_entry(fs, i);
+}
+
+// Moves entry i to fresh blocks, in as few extents as free space allows,
+// taking its contents and checksums along. Afterwards it shares nothing and
+// its holes are blocks of zeros.
+static bool relocate(FsHandle *fs, unique_lock<shared_mutex> &meta, uint64_t i) {
+    FileMap map;
+    get_map(fs, i, map);
+    uint64_t have = blocks_for(fs, map.entry.size);
+    vector<FileExtent> runs;
+    if (!allocate(fs, meta, have, fs->alloc_hint, FS_MAX_EXTENTS, runs)) return false;
+    mark_file_changed(fs, runs, 0, map.entry.size);
+    meta.unlock();
+    bool ok = copy_file(fs, map.extents, runs, map.entry.size);
+    meta.lock();
+    if (!ok) {
+        unallocate(fs, runs);
+        return false;
+    }
+    copy_sums(fs, map.extents, runs, map.entry.size);
+    release_extents(fs, map.extents);
+    set_extents(fs, i, runs);
+    touch_entry(fs, i);
+    return true;
+}
+
+// Length of a file's contents
+static uint64_t content_size(const FileEntry &entry) {
+    return entry.codec ? entry.raw_size : entry.size;
+}
+
+static uint64_t chunk_size(const FsHandle *fs) {
+    return max<uint64_t>(FS_COMPRESS_CHUNK, fs->metadata.superblock.block_size);
+}
+
+// Entries [first, first + chunks.size()) of a compressed file's chunk table
+struct ChunkTable {
+    uint64_t chunk_size = 0;
+    uint64_t count = 0;     // chunks in the file
+    uint64_t first = 0;
+    vector<CompressedChunk> chunks;
+};
+
+// Reads entries [first, end) of the chunk table of a compressed file (all
+// from first on if end is past the last) after checking its trailer. The
+// caller holds the file lock.
+static bool load_table(FsHandle *fs, const FileMap &map, uint64_t first, uint64_t end, ChunkTable &table) {
+    table = ChunkTable();
+    table.chunk_size = chunk_size(fs);
+    if (map.entry.size == 0) return map.entry.raw_size == 0;
+    CompressTrailer trailer;
+    uint64_t size = map.entry.size;
+    if (size < sizeof(trailer) || !read_file(fs, map.extents, size - sizeof(trailer), sizeof(trailer), (char *)&trailer))
+        return false;
+    uint64_t C = trailer.chunk_size;
+    if (memcmp(trailer.magic, COMPRESS_MAGIC, sizeof(trailer.magic)) != 0 || C != table.chunk_size ||
+        trailer.chunks != (map.entry.raw_size + C - 1) / C ||
+        (uint64_t)trailer.chunks * sizeof(CompressedChunk) > size - sizeof(trailer))
+        return false;
+    table.count = trailer.chunks;
+    table.first = min(first, table.count);
+    end = min(end, table.count);
+    if (end <= table.first) return true;
+    table.chunks.resize(end - table.first);
+    uint64_t at = size - sizeof(trailer) - table.count * sizeof(CompressedChunk);
+    return read_file(fs, map.extents, at + table.first * sizeof(CompressedChunk),
+                     table.chunks.size() * sizeof(CompressedChunk), (char *)table.chunks.data());
+}
+
+// Byte range [from, to) of the file the stored forms of chunks [a, b) of a
+// loaded table take up.
+static pair<uint64_t, uint64_t> chunk_span(const FsHandle *fs, const ChunkTable &table, uint64_t a, uint64_t b) {
+    uint64_t bs = fs->metadata.superblock.block_size;
+    const CompressedChunk &last = table.chunks[b - 1 - table.first];
+    return {(uint64_t)table.chunks[a - table.first].block * bs,
+            (uint64_t)last.block * bs + (last.bytes & ~CHUNK_STORED_RAW)};
+}
+
+// Hands [offset, offset + size) of a compressed file's contents to fn,
+// expanding only the chunks the range touches, each on its own. The table
+// holds at least their entries.
+static bool stream_compressed(FsHandle *fs, const FileMap &map, const ChunkTable &table, uint64_t offset,
+                              uint64_t size, const FsChunkFn &fn) {
+    uint64_t C = table.chunk_size, bs = fs->metadata.superblock.block_size;
+    vector<char> stored, plain;
+    for (uint64_t k = offset / C; size > 0; ++k) {
+        if (k < table.first || k >= table.first + table.chunks.size()) return false;
+        const CompressedChunk &c = table.chunks[k - table.first];
+        uint64_t length = min(C, map.entry.raw_size - k * C), bytes = c.bytes & ~CHUNK_STORED_RAW;
+        stored.resize(bytes);
+        if (!read_file(fs, map.extents, (uint64_t)c.block * bs, bytes, stored.data())) return false;
+        const char *data = stored.data();
+        if (c.bytes & CHUNK_STORED_RAW) {
+            if (bytes != length) return false;
+        } else {
+            plain.resize(length);
+            if (!lz_decompress(stored.data(), bytes, plain.data(), length)) return false;
+            data = plain.data();
+        }
+        uint64_t skip = offset - k * C, take = min(length - skip, size);
+        if (!fn(data + skip, take)) return false;
+        offset += take;
+        size -= take;
+    }
+    return true;
+}
+
+static bool read_compressed(FsHandle *fs, const FileMap &map, const ChunkTable &table, uint64_t offset,
+                            uint64_t size, char *buffer) {
+    return stream_compressed(fs, map, table, offset, size, [&](const char *data, int64_t n) {
+        memcpy(buffer, data, n);
+        buffer += n;
+        return true;
+    });
+}
+
+// Loads the table entries of the chunks holding [offset, offset + size) of
+// a compressed file's contents.
+static bool load_chunks(FsHandle *fs, const FileMap &map, uint64_t offset, uint64_t size, ChunkTable &table) {
+    uint64_t C = chunk_size(fs);
+    return load_table(fs, map, offset / C, size ? (offset + size - 1) / C + 1 : offset / C, table);
+}
+
+// [offset, offset + size) of a file's contents, whatever form they are
+// stored in. The caller holds the file lock.
+static bool stream_contents(FsHandle *fs, const FileMap &map, uint64_t offset, uint64_t size, const FsChunkFn &fn) {
+    if (!map.entry.codec) return stream_file(fs, map.extents, offset, size, fn);
+    ChunkTable table;
+    return size == 0 || (load_chunks(fs, map, offset, size, table) && stream_compressed(fs, map, table, offset, size, fn));
+}
+
+static bool read_contents(FsHandle *fs, const FileMap &map, uint64_t offset, uint64_t size, char *buffer) {
+    if (!map.entry.codec) return read_file(fs, map.extents, offset, size, buffer);
+    ChunkTable table;
+    return size == 0 || (load_chunks(fs, map, offset, size, table) && read_compressed(fs, map, table, offset, size, buffer));
+}
+
+// Fills the next size bytes of the contents being encoded. old is the
+// file as it was, whose blocks stay intact until the new ones replace them.
+typedef function<bool(const FileMap &old, char *data, uint64_t size)> ContentFill;
+
+// Rewrites the contents of entry i from chunk `first` on, in the form
+// codec keeps them: length bytes in all, those from first * chunk size on
+// coming from fill in order. kept holds the table entries of the chunks
+// before, which stay where they are; with FS_CODEC_NONE first must be 0.
+// The new stored bytes go to fresh blocks, swapped in at the end. When
+// fill gives up, the file is left as it was, or with keep_partial holding
+// what was filled so far. Called with the file lock and meta_lock held.
+static bool encode_file(FsHandle *fs, unique_lock<shared_mutex> &meta, uint64_t i, FsCodec codec,
+                        const vector<CompressedChunk> &kept, uint64_t length, const ContentFill &fill,
+                        bool keep_partial = false) {
+    uint64_t bs = fs->metadata.superblock.block_size, C = chunk_size(fs);
+    uint64_t first = kept.size();
+    uint64_t prefix = first ? kept.back().block + blocks_for(fs, kept.back().bytes & ~CHUNK_STORED_RAW) : 0;
+    uint64_t chunks = (length + C - 1) / C;
+    uint64_t table_bytes = chunks * sizeof(CompressedChunk) + sizeof(CompressTrailer);
+    uint64_t worst = blocks_for(fs, length);
+    if (codec) worst = chunks ? (chunks - first) * blocks_for(fs, C) + blocks_for(fs, table_bytes) : 0;
+
+    // Fresh blocks for the worst case, with the kept ones in front; the
+    // file is moved to fewer extents first if they do not fit in its row.
+    FileMap map;
+    vector<FileExtent> keep, runs;
+    for (int attempt = 0;; ++attempt) {
+        get_map(fs, i, map);
+        keep = slice_extents(map.extents, 0, prefix);
+        uint64_t hint = prefix ? file_block(map.extents, prefix - 1) + 1 : fs->alloc_hint;
+        uint64_t room = FS_MAX_EXTENTS - min<uint64_t>(keep.size(), FS_MAX_EXTENTS);
+        bool fits = worst == 0;
+        if (!fits && room) {
+            if (!allocate(fs, meta, worst, hint, room, runs)) return false;
+            vector<FileExtent> extents = keep;
+            extents.insert(extents.end(), runs.begin(), runs.end());
+            merge_extents(extents);
+            fits = extents.size() <= FS_MAX_EXTENTS;
+            if (!fits) unallocate(fs, runs);
+        }
+        if (fits) break;
+        if (attempt || !relocate(fs, meta, i)) return false;
+    }
+    mark_file_changed(fs, runs, 0, worst * bs);
+    meta.unlock();
+
+    BlockSummer summer(bs);
+    uint64_t at = 0;    // stored bytes written to runs
+    bool ok = true, filled = true;
+    auto put = [&](const char *data, uint64_t n) {
+        ok = ok && write_file(fs, runs, at, data, n);
+        summer.add(data, n);
+        at += n;
+    };
+    // Asks fill for n bytes, at most FS_CHUNK_SIZE at a time, and returns
+    // how many it gave.
+    auto take = [&](char *data, uint64_t n) {
+        uint64_t done = 0;
+        while (filled && done < n) {
+            uint64_t piece = min<uint64_t>(FS_CHUNK_SIZE, n - done);
+            filled = fill(map, data + done, piece);
+            if (filled) done += piece;
+        }
+        return done;
+    };
+
+    uint64_t pos = first * C;
+    vector<CompressedChunk> table = kept;
+    if (codec) {
+        vector<char> plain(C), packed(round_up(lz_bound(C), bs));
+        while (pos < length && filled && ok) {
+            uint64_t n = take(plain.data(), min(C, length - pos));
+            if (!n) break;
+            uint64_t bytes = lz_compress(plain.data(), n, packed.data(), n - 1);
+            bool raw = bytes == 0;
+            char *data = raw ? plain.data() : packed.data();
+            uint64_t stored = raw ? n : bytes;
+            // A compressed chunk counts its padding, which gives a later
+            // change to the chunk room to grow in place.
+            memset(data + stored, 0, round_up(stored, bs) - stored);
+            if (!raw) stored = round_up(stored, bs);
+            table.push_back({(uint32_t)(prefix + at / bs), (uint32_t)stored | (raw ? CHUNK_STORED_RAW : 0)});
+            put(data, round_up(stored, bs));
+            pos += n;
+        }
+        if (!table.empty() && pos > 0) {
+            CompressTrailer trailer;
+            memcpy(trailer.magic, COMPRESS_MAGIC, sizeof(trailer.magic));
+            trailer.chunks = table.size();
+            trailer.chunk_size = C;
+            put((const char *)table.data(), table.size() * sizeof(CompressedChunk));
+            put((const char *)&trailer, sizeof(trailer));
+        }
+    } else {
+        vector<char> buffer(min<uint64_t>(length, FS_CHUNK_SIZE));
+        while (pos < length && filled && ok) {
+            uint64_t n = take(buffer.data(), min<uint64_t>(FS_CHUNK_SIZE, length - pos));
+            put(buffer.data(), n);
+            pos += n;
+        }
+    }
+    length = pos;
+    if (!filled && !keep_partial) ok = false;
+    summer.finish();
+
+    meta.lock();
+    if (!ok) {
+        unallocate(fs, runs);
+        return false;
+    }
+    // The stored form ends where it was cut short, or inside the last chunk
+    // kept when nothing follows it.
+    uint64_t used = blocks_for(fs, at);
+    unallocate(fs, slice_extents(runs, used, worst));
+    vector<FileExtent> extents = keep;
+    vector<FileExtent> written = slice_extents(runs, 0, used);
+    extents.insert(extents.end(), written.begin(), written.end());
+    release_extents(fs, slice_extents(map.extents, prefix, blocks_for(fs, map.entry.size)));
+    set_extents(fs, i, extents);
+    store_file_sums(fs, extents, prefix, summer.sums);
+    FileEntry &entry = fs->metadata.entries[i];
+    entry.size = prefix * bs + at;
+    entry.raw_size = codec ? length : 0;
+    entry.codec = codec;
+    touch_entry(fs, i);
+    return filled;
+}
+
+// Fill for re-encoding a file from contents position pos on: its old
+// contents with size bytes of data laid over them at offset, and zeros
+// between the old end and offset.
+static ContentFill overlay_fill(FsHandle *fs, const ChunkTable &old_table, uint64_t pos, uint64_t offset,
+                                const char *data, uint64_t size) {
+    return [=](const FileMap &old, char *out, uint64_t n) mutable {
+        uint64_t old_size = content_size(old.entry);
+        uint64_t have = pos < old_size ? min(n, old_size - pos) : 0;
+        bool ok = !have || (old.entry.codec ? read_compressed(fs, old, old_table, pos, have, out)
+                                            : read_file(fs, old.extents, pos, have, out));
+        memset(out + have, 0, n - have);
+        uint64_t lo = max(pos, offset), hi = min(pos + n, offset + size);
+        if (lo < hi) memcpy(out + (lo - pos), data + (lo - offset), hi - lo);
+        pos += n;
+        return ok;
+    };
+}
+
+// Grows the block range [first, last) of a file by the smaller of the
+// extents on either side of it, so that replacing the range leaves the
+// file in fewer pieces. False if it already covers every extent.
+static bool widen_range(const vector<FileExtent> &extents, uint64_t &first, uint64_t &last) {
+    uint64_t before = first, after = last, at = 0;
+    for (const FileExtent &e : extents) {
+        if (at < first && first <= at + e.count) before = at;
+        if (at <= last && last < at + e.count) after = at + e.count;
+        at += e.count;
+    }
+    if (before == first && after == last) return false;
+    if (before < first && (after == last || first - before <= after - last)) first = before;
+    else last = after;
+    return true;
+}
+
+// Extends entry i, whose last block is full or in a hole, to new_size
+// bytes: the blocks it gains are a hole. False, changing nothing, if the
+// extent row has no room for one. Called under meta_lock.
+static bool add_hole(FsHandle *fs, uint64_t i, uint64_t new_size) {
+    FileMap map;
+    get_map(fs, i, map);
+    map.extents.push_back({FS_HOLE, blocks_for(fs, new_size) - blocks_for(fs, map.entry.size)});
+    if (!set_extents(fs, i, map.extents)) return false;
+    fs->metadata.entries[i].size = new_size;
+    touch_entry(fs, i);
+    return true;
+}
+
+// Whether the last block of a file of size bytes is cut short and holds data.
+static bool partial_tail(const FsHandle *fs, const vector<FileExtent> &extents, uint64_t size) {
+    uint64_t bs = fs->metadata.superblock.block_size;
+    return size % bs && file_block(extents, size / bs) != FS_HOLE;
+}
+
+// Writes size bytes at offset into entry i, extending the file when they
+// reach past its end; a gap between the end and offset reads as zeros,
+// whole blocks of it being a hole when the extent row has room. The blocks whose bytes change are replaced by fresh ones, so the
+// committed contents stay intact, while bytes past the old end go in place.
+// The pieces land in one batch, a vectored write per run of blocks. If the new
+// blocks do not fit in the extent row, whole neighbouring extents are
+// replaced with them, and failing that the file is first moved to as few
+// extents as it can. Called with the file lock and meta_lock held.
+static bool write_range(FsHandle *fs, unique_lock<shared_mutex> &meta, uint64_t i, uint64_t offset,
+                        const char *data, uint64_t size) {
+    if (size == 0) return true;
+    uint64_t bs = fs->metadata.superblock.block_size;
+    uint64_t end = offset + size;
+
+    // Bytes past the end of a file cut short in the open transaction still
+    // belong to the committed contents: commit the truncation first.
+    const vector<uint64_t> &shrunk = fs->shrunk_entries;
+    if (end > fs->metadata.entries[i].size && find(shrunk.begin(), shrunk.end(), i) != shrunk.end() &&
+        !commit(fs, meta))
+        return false;
+
+    // Past the end of the last block the gap takes no blocks.
+    if (offset / bs > blocks_for(fs, fs->metadata.entries[i].size)) {
+        FileMap map;
+        get_map(fs, i, map);
+        uint64_t old_size = map.entry.size;
+        if (partial_tail(fs, map.extents, old_size)) {
+            vector<char> zeros(round_up(old_size, bs) - old_size);
+            if (!write_range(fs, meta, i, old_size, zeros.data(), zeros.size())) return false;
+        }
+        add_hole(fs, i, offset / bs * bs);
+    }
+
+    // Blocks [first, last) of the file are replaced; those from `have` on are new.
+    FileMap map;
+    vector<FileExtent> runs, extents;
+    uint64_t first, last;
+    for (int attempt = 0;; ++attempt) {
+        get_map(fs, i, map);
+        uint64_t have = blocks_for(fs, map.entry.size);
+        uint64_t need = blocks_for(fs, max(map.entry.size, end));
+        first = min(offset, map.entry.size) / bs;
+        last = min(have, blocks_for(fs, end));
+        if (offset >= map.entry.size &&
+            (map.entry.size % bs == 0 ||
+             (partial_tail(fs, map.extents, map.entry.size) && !block_shared(fs, file_block(map.extents, have - 1)))))
+            first = last = have;
+        bool fits = false;
+        do {
+            uint64_t hint = first ? file_block(map.extents, first - 1) + 1 : fs->alloc_hint;
+            if (!allocate(fs, meta, last - first + need - have, hint, FS_MAX_EXTENTS, runs)) return false;
+            extents = slice_extents(map.extents, 0, first);
+            extents.insert(extents.end(), runs.begin(), runs.end());
+            vector<FileExtent> rest = slice_extents(map.extents, last, have);
+            extents.insert(extents.end(), rest.begin(), rest.end());
+            merge_extents(extents);
+            fits = extents.size() <= FS_MAX_EXTENTS;
+            if (!fits) unallocate(fs, runs);
+        } while (!fits && widen_range(map.extents, first, last));
+        if (fits) break;
+        if (attempt || !relocate(fs, meta, i)) return false;
+    }
+
+    // File bytes [from, to) are written: the replaced blocks whole, or
+    // everything from the old end on.
+    uint64_t old_size = map.entry.size, new_size = max(old_size, end);
+    uint64_t from = first < last ? first * bs : old_size;
+    uint64_t to = end > old_size ? new_size : min(old_size, last * bs);
+    uint64_t kept = min(offset, old_size);
+    BlockSummer summer(bs);
+    summer.fill = from % bs;
+    if (summer.fill) summer.crc = fs->metadata.sums[file_block(map.extents, from / bs)];
+    mark_file_changed(fs, extents, from, to - from);
+    meta.unlock();
+
+    // Old bytes around the write inside the replaced blocks: less than a
+    // block on either side, unless extents were taken in.
+    vector<char> head(from < kept ? kept - from : 0), tail(end < to ? to - end : 0);
+    bool ok = read_file(fs, map.extents, from, head.size(), head.data()) &&
+              read_file(fs, map.extents, end, tail.size(), tail.data());
+    static const vector<char> zeros(FS_CHUNK_SIZE);
+    vector<iovec> pieces;
+    if (!head.empty()) pieces.push_back({head.data(), head.size()});
+    for (uint64_t gap = offset > old_size ? offset - old_size : 0; gap > 0;) {
+        uint64_t n = min<uint64_t>(gap, zeros.size());
+        pieces.push_back({(void *)zeros.data(), n});
+        gap -= n;
+    }
+    pieces.push_back({(void *)data, size});
+    if (!tail.empty()) pieces.push_back({tail.data(), tail.size()});
+    for (const iovec &piece : pieces) summer.add((const char *)piece.iov_base, piece.iov_len);
+    summer.finish();
+
+    // One segment per run of blocks, cut from the pieces
+    vector<pair<uint64_t, uint64_t>> ranges = file_ranges(fs, extents, from, to - from);
+    vector<iovec> iov;
+    vector<pair<uint64_t, size_t>> starts;      // (image offset, first iovec)
+    size_t k = 0;
+    uint64_t taken = 0;     // bytes of pieces[k] already used
+    for (const auto &r : ranges) {
+        starts.push_back({r.first, iov.size()});
+        for (uint64_t left = r.second; left > 0;) {
+            uint64_t n = min<uint64_t>(left, pieces[k].iov_len - taken);
+            iov.push_back({(char *)pieces[k].iov_base + taken, n});
+            taken += n;
+            left -= n;
+            if (taken == pieces[k].iov_len) {
+                ++k;
+                taken = 0;
+            }
+        }
+    }
+    vector<IoSegment> segments;
+    for (size_t r = 0; r < starts.size(); ++r) {
+        size_t end = r + 1 < starts.size() ? starts[r + 1].second : iov.size();
+        segments.push_back({starts[r].first, &iov[starts[r].second], int(end - starts[r].second), true});
+    }
+    ok = ok && fs->dev->submit(segments.data(), segments.size());
+
+    meta.lock();
+    if (!ok) {
+        unallocate(fs, runs);
+        return false;
+    }
+    store_file_sums(fs, extents, from / bs, summer.sums);
+    release_extents(fs, slice_extents(map.extents, first, last));
+    set_extents(fs, i, extents);
+    fs->metadata.entries[i].size = new_size;
+    touch_entry(fs, i);
+    return true;
+}
+
+// Stored forms of the chunks holding [offset, offset + size) of a
+// compressed file with size bytes of data laid over them, each zero-padded
+// to the bytes its table entry gives it, as one run starting at file byte
+// from. False if one no longer fits.
+static bool recode_chunks(FsHandle *fs, const FileMap &map, const ChunkTable &table, uint64_t offset,
+                          const char *data, uint64_t size, uint64_t &from, vector<char> &stored) {
+    uint64_t C = table.chunk_size, bs = fs->metadata.superblock.block_size;
+    uint64_t a = offset / C, b = (offset + size - 1) / C + 1;
+    pair<uint64_t, uint64_t> span = chunk_span(fs, table, a, b);
+    from = span.first;
+    stored.assign(span.second - span.first, 0);
+    vector<char> plain;
+    for (uint64_t k = a; k < b; ++k) {
+        const CompressedChunk &c = table.chunks[k - table.first];
+        uint64_t start = k * C, length = min(C, map.entry.raw_size - start);
+        plain.resize(length);
+        if (!read_compressed(fs, map, table, start, length, plain.data())) return false;
+        uint64_t lo = max(start, offset), hi = min(start + length, offset + size);
+        memcpy(plain.data() + (lo - start), data + (lo - offset), hi - lo);
+        char *out = stored.data() + ((uint64_t)c.block * bs - from);
+        if (c.bytes & CHUNK_STORED_RAW) memcpy(out, plain.data(), length);
+        else if (!lz_compress(plain.data(), length, out, c.bytes)) return false;
+    }
+    return true;
+}
+
+// write_range on a compressed file, which ends up length bytes long. A
+// change inside the contents re-encodes just the chunks it touches and
+// writes them in place, through write_range, when each still fits; other
+// changes re-encode the file from the first chunk they touch, or the old
+// end if that comes first. Called with the file lock and meta_lock held.
+static bool write_compressed(FsHandle *fs, unique_lock<shared_mutex> &meta, uint64_t i, uint64_t offset,
+                             const char *data, uint64_t size, uint64_t length) {
+    FileMap map;
+    get_map(fs, i, map);
+    ChunkTable table;
+    uint64_t from = 0;
+    vector<char> stored;
+    meta.unlock();
+    bool in_place = size > 0 && offset + size <= map.entry.raw_size && load_chunks(fs, map, offset, size, table) &&
+                    recode_chunks(fs, map, table, offset, data, size, from, stored);
+    bool ok = in_place || load_table(fs, map, 0, UINT64_MAX, table);
+    meta.lock();
+    if (!ok) return false;
+    if (in_place) return write_range(fs, meta, i, from, stored.data(), stored.size());
+
+    uint64_t first = min(offset, map.entry.raw_size) / table.chunk_size;
+    vector<CompressedChunk> kept(table.chunks.begin(), table.chunks.begin() + min<uint64_t>(first, table.count));
+    return encode_file(fs, meta, i, FS_CODEC_LZ, kept, length,
+                       overlay_fill(fs, table, kept.size() * table.chunk_size, offset, data, size));
+}
+
+// Key for finding a file with the same contents. Files with equal keys are
+// still compared byte for byte before they share anything.
+static uint64_t content_key(const char *data, uint64_t size) {
+    return (uint64_t)crc32c(0, data, size) << 32 ^ size;
+}
+
+// Points entry i at the blocks of the file last written with the same key,
+// if that file still holds exactly data. Called with the file lock of i and
+// meta_lock held.
+static bool dedup_write(FsHandle *fs, unique_lock<shared_mutex> &meta, uint64_t i, uint64_t key,
+                        const string &filename, const char *data, int64_t size) {
+    auto it = fs->dedup_index.find(key);
+    if (it == fs->dedup_index.end() || it->second == i) return false;
+    FileMap other;
+    get_map(fs, it->second, other);
+    if (!other.entry.used || other.entry.codec || other.entry.size != (uint64_t)size) return false;
+
+    // Its lock is only tried: waiting for it while holding ours could deadlock.
+    shared_mutex &lock = file_lock(fs, entry_path(fs, it->second));
+    bool own = &lock == &file_lock(fs, filename);
+    if (!own && !lock.try_lock_shared()) return false;
+
+    meta.unlock();
+    int64_t done = 0;
+    bool same = stream_file(fs, other.extents, 0, size, [&](const char *p, int64_t n) {
+        bool equal = memcmp(p, data + done, n) == 0;
+        done += n;
+        return equal;
+    });
+    meta.lock();
+    same = same && share_extents(fs, other.extents);
+    if (!own) lock.unlock_shared();
+    if (!same) return false;
+
+    FileMap map;
+    get_map(fs, i, map);
+    release_extents(fs, map.extents);
+    set_extents(fs, i, other.extents);
+    fs->metadata.entries[i].size = size;
+    return true;
+}
+
+bool fs_write(FsHandle *fs, const string &filename, const char *data, int64_t size) {
+    if (!usable(fs) || size < 0) return false;
+    FsOpTimer timer(FS_OP_WRITE, &filename, size);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+
+    if (fs->metadata.entries[i].codec) {
+        uint64_t done = 0;
+        bool ok = encode_file(fs, meta, i, FS_CODEC_LZ, {}, size, [&](const FileMap &, char *out, uint64_t n) {
+            memcpy(out, data + done, n);
+            done += n;
+            return true;
+        });
+        if (!ok) return false;
+        end_op(fs, meta);
+        meta.unlock();
+        fs_log("WRITE " + filename);
+        return true;
+    }
+
+    bool dedup = fs->options.dedup && size > 0;
+    uint64_t key = dedup ? content_key(data, size) : 0;
+    if (dedup && dedup_write(fs, meta, i, key, filename, data, size)) {
+        touch_entry(fs, i);
+        end_op(fs, meta);
+        meta.unlock();
+        fs_log("WRITE " + filename + " (dedup)");
+        return true;
+    }
+    Reservation r;
+    if (!reserve_blocks(fs, meta, i, size, r)) return false;
+    mark_file_changed(fs, r.extents, 0, size);
+    meta.unlock();
+
+    // The entry changes only once the data is in place.
+    bool ok = write_file(fs, r.extents, 0, data, size);
+    BlockSummer summer(fs->metadata.superblock.block_size);
+    summer.add(data, size);
+    summer.finish();
+    meta.lock();
+    if (!ok) {
+        unallocate(fs, r.runs);
+        return false;
+    }
+    install_blocks(fs, i, r, size);
+    store_file_sums(fs, r.extents, 0, summer.sums);
+    if (dedup) fs->dedup_index[key] = i;
+    end_op(fs, meta);
+    meta.unlock();
+    fs_log("WRITE " + filename);
+    return true;
+}
+
+bool fs_write_at(FsHandle *fs, const string &filename, int64_t offset, const char *data, int64_t size) {
+    if (!usable(fs) || offset < 0 || size < 0) return false;
+    FsOpTimer timer(FS_OP_WRITE, &filename, size);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+    const FileEntry &entry = fs->metadata.entries[i];
+    uint64_t length = max<uint64_t>(entry.raw_size, offset + size);
+    bool ok = entry.codec ? write_compressed(fs, meta, i, offset, data, size, length)
+                          : write_range(fs, meta, i, offset, data, size);
+    if (!ok) return false;
+    end_op(fs, meta);
+    meta.unlock();
+    fs_log("WRITE_AT " + filename + " " + to_string(offset));
+    return true;
+}
+
+bool fs_write_chunks(FsHandle *fs, const string &filename, int64_t size, const FsFillFn &fill) {
+    if (!usable(fs) || size < 0) return false;
+    FsOpTimer timer(FS_OP_WRITE, &filename, size);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+
+    if (fs->metadata.entries[i].codec) {
+        bool filled = encode_file(fs, meta, i, FS_CODEC_LZ, {}, size,
+                                  [&](const FileMap &, char *out, uint64_t n) { return fill(out, n); }, true);
+        end_op(fs, meta);
+        meta.unlock();
+        fs_log("WRITE " + filename);
+        return filled;
+    }
+    Reservation r;
+    if (!reserve_blocks(fs, meta, i, size, r)) return false;
+    mark_file_changed(fs, r.extents, 0, size);
+    meta.unlock();
+
+    vector<char> buffer(min<int64_t>(size, FS_CHUNK_SIZE));
+    BlockSummer summer(fs->metadata.superblock.block_size);
+    int64_t done = 0;
+    bool written = true;
+    while (done < size) {
+        int64_t n = min<int64_t>(FS_CHUNK_SIZE, size - done);
+        if (!fill(buffer.data(), n)) break;
+        if (!(written = write_file(fs, r.extents, done, buffer.data(), n))) break;
+        summer.add(buffer.data(), n);
+        done += n;
+    }
+    summer.finish();
+
+    meta.lock();
+    if (!written) {
+        unallocate(fs, r.runs);
+        return false;
+    }
+    // A fill that gives up leaves the file holding what was written so far.
+    uint64_t keep = blocks_for(fs, done);
+    vector<FileExtent> unused = slice_extents(r.extents, keep, blocks_for(fs, size));
+    r.extents = slice_extents(r.extents, 0, keep);
+    install_blocks(fs, i, r, done);
+    release_extents(fs, unused);
+    store_file_sums(fs, r.extents, 0, summer.sums);
+    end_op(fs, meta);
+    meta.unlock();
+    fs_log("WRITE " + filename);
+    return done == size;
+}
+
+// With verify_reads, checks the blocks holding [offset, offset + size) of a
+// file against their checksums. The caller holds the file lock.
+static bool verify_range(FsHandle *fs, const string &filename, const FileMap &map, uint64_t offset, uint64_t size) {
+    if (!fs->options.verify_reads || size == 0) return true;
+    if (map.entry.codec) {
+        // the stored forms of the chunks holding the range
+        ChunkTable table;
+        if (!load_chunks(fs, map, offset, size, table) || table.chunks.empty()) return false;
+        pair<uint64_t, uint64_t> span = chunk_span(fs, table, table.first, table.first + table.chunks.size());
+        offset = span.first;
+        size = span.second - span.first;
+    }
+    uint64_t bs = fs->metadata.superblock.block_size;
+    uint64_t first = offset / bs, end = blocks_for(fs, offset + size);
+    vector<uint32_t> expected;
+    {
+        shared_lock<shared_mutex> meta(fs->meta_lock);
+        expected = file_sums(fs, map.extents, map.entry.size, first, end);
+    }
+
+    BlockSummer summer(bs);
+    uint64_t from = first * bs, to = min(map.entry.size, end * bs);
+    bool ok = stream_file(fs, map.extents, from, to - from, [&](const char *data, int64_t n) {
+        summer.add(data, n);
+        return true;
+    });
+    summer.finish();
+    if (ok && summer.sums == expected) return true;
+    cerr << "Uyarı: '" << filename << "' dosyasında sağlama toplamı tutmayan blok var.\n";
+    fs_log("CHECKSUM_ERROR " + filename);
+    return false;
+}
+
+// [offset, offset + size) of a file in place: inside the mapping when the
+// image is mapped and the bytes lie in one run, otherwise read into buffer.
+// nullptr on a read error.
+static const char *file_bytes(FsHandle *fs, const vector<FileExtent> &extents, uint64_t offset, uint64_t size,
+                              vector<char> &buffer) {
+    vector<pair<uint64_t, uint64_t>> ranges = file_ranges(fs, extents, offset, size);
+    if (ranges.size() == 1 && ranges[0].first != FS_HOLE)
+        if (const char *mapped = fs->dev->view(ranges[0].first, size)) return mapped;
+    buffer.resize(max<uint64_t>(size, 1));
+    return read_file(fs, extents, offset, size, buffer.data()) ? buffer.data() : nullptr;
+}
+
+bool fs_read(FsHandle *fs, const string &filename, int64_t offset, int64_t size, char *buffer) {
+    if (!usable(fs) || offset < 0 || size < 0) return false;
+    FsOpTimer timer(FS_OP_READ, &filename, size);
+    shared_lock<shared_mutex> file(file_lock(fs, filename));
+    FileMap map;
+    if (!lookup(fs, filename, map)) return false;
+    if ((uint64_t)(offset + size) > content_size(map.entry)) return false;
+    if (!verify_range(fs, filename, map, offset, size)) return false;
+
+    bool ok = read_contents(fs, map, offset, size, buffer);
+    fs_log("READ " + filename, FS_LOG_DEBUG);
+    return ok;
+}
+
+int64_t fs_read_at(FsHandle *fs, const string &filename, int64_t offset, char *buffer, int64_t size) {
+    if (!usable(fs) || offset < 0 || size < 0) return -1;
+    FsOpTimer timer(FS_OP_READ, &filename, size);
+    shared_lock<shared_mutex> file(file_lock(fs, filename));
+    FileMap map;
+    if (!lookup(fs, filename, map)) return -1;
+    uint64_t length = content_size(map.entry);
+    uint64_t n = (uint64_t)offset < length ? min<uint64_t>(size, length - offset) : 0;
+    if (!verify_range(fs, filename, map, offset, n) || !read_contents(fs, map, offset, n, buffer)) return -1;
+    fs_log("READ " + filename, FS_LOG_DEBUG);
+    return n;
+}
+
+bool fs_read_chunks(FsHandle *fs, const string &filename, int64_t offset, int64_t size, const FsChunkFn &fn) {
+    if (!usable(fs) || offset < 0 || size < 0) return false;
+    FsOpTimer timer(FS_OP_READ, &filename, size);
+    shared_lock<shared_mutex> file(file_lock(fs, filename));
+    FileMap map;
+    if (!lookup(fs, filename, map)) return false;
+    if ((uint64_t)(offset + size) > content_size(map.entry)) return false;
+    if (!verify_range(fs, filename, map, offset, size)) return false;
+
+    bool ok = stream_contents(fs, map, offset, size, fn);
+    fs_log("READ " + filename, FS_LOG_DEBUG);
+    return ok;
+}
+
+bool fs_read_view(FsHandle *fs, const string &filename, int64_t offset, int64_t size, string_view &view) {
+    if (!usable(fs) || offset < 0 || size < 0) return false;
+    FsOpTimer timer(FS_OP_READ, &filename, size);
+    shared_lock<shared_mutex> file(file_lock(fs, filename));
+    FileMap map;
+    if (!lookup(fs, filename, map)) return false;
+    if ((uint64_t)(offset + size) > content_size(map.entry)) return false;
+    if (!verify_range(fs, filename, map, offset, size)) return false;
+
+    // Compressed contents only exist expanded, in the scratch buffer.
+    static thread_local vector<char> scratch;
+    const char *data = nullptr;
+    if (!map.entry.codec) {
+        data = file_bytes(fs, map.extents, offset, size, scratch);
+    } else {
+        scratch.resize(max<uint64_t>(size, 1));
+        if (read_contents(fs, map, offset, size, scratch.data())) data = scratch.data();
+    }
+    if (!data) return false;
+    view = string_view(data, size);
+    fs_log("READ " + filename, FS_LOG_DEBUG);
+    return true;
+}
+
+bool fs_list(FsHandle *fs, const string &path, const string &after, size_t count, vector<FsDirEntry> &page) {
+    page.clear();
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_LS, &path);
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    uint64_t dir = FS_ROOT_DIR;
+    if (!is_root(path)) {
+        int64_t i = find_node(fs, path);
+        if (i == -1 || fs->metadata.entries[i].type != FS_TYPE_DIR) return false;
+        dir = i;
+    }
+    for (auto it = fs->listing.upper_bound({dir, after}); it != fs->listing.end() && it->first.first == dir; ++it) {
+        if (page.size() == count) break;
+        const FileEntry &entry = fs->metadata.entries[it->second];
+        page.push_back({it->first.second, entry.type == FS_TYPE_DIR, content_size(entry), entry.size, entry.created});
+    }
+    return true;
+}
+
+FsDirIterator::FsDirIterator(FsHandle *fs, const string &path, size_t page_size)
+    : fs(fs), path(path), page_size(max<size_t>(page_size, 1)) {}
+
+bool FsDirIterator::next(FsDirEntry &entry) {
+    if (at == page.size()) {
+        if (done) return false;
+        string after = page.empty() ? string() : page.back().name;
+        if (!fs_list(fs, path, after, page_size, page)) page.clear();
+        at = 0;
+        done = page.size() < page_size;
+        if (page.empty()) return false;
+    }
+    entry = page[at++];
+    return true;
+}
 
-    Metadata metadata{};
-    metadata.file_count = 0;
-    memset(metadata.entries, 0, sizeof(metadata.entries));
-    memset(metadata.reserved, 0, sizeof(metadata.reserved));
+void fs_ls(FsHandle *fs, const string &path) {
+    if (!usable(fs)) {
+        cerr << "Metadata okunamadı.\n";
+        return;
+    }
+    FsDirIterator it(fs, path);
+    FsDirEntry entry;
+    cout << "Dosyalar:\n";
+    while (it.next(entry)) {
+        if (entry.directory) {
+            cout << "- " << entry.name << "/ (dizin)\n";
+            continue;
+        }
+        cout << "- " << entry.name << " (" << entry.size << " bytes";
+        if (entry.stored != entry.size) cout << ", sıkıştırılmış: " << entry.stored << " bytes";
+        cout << ")\n";
+    }
 
-    lseek(fd, 0, SEEK_SET);
-    write(fd, &metadata, sizeof(Metadata));
-    close(fd);
-    fs_log("FORMAT");
-    return true;
+    fs_log("LS " + path, FS_LOG_DEBUG);
 }
 
-bool fs_load_metadata(Metadata &metadata) {
-    int fd = open(DISK_NAME, O_RDONLY);
-    if (fd < 0) return false;
-    lseek(fd, 0, SEEK_SET);
-    read(fd, &metadata, sizeof(Metadata));
-    close(fd);
-    return true;
+void fs_ls(FsHandle *fs) {
+    fs_ls(fs, "");
 }
 
-bool fs_save_metadata(const Metadata &metadata) {
-    int fd = open(DISK_NAME, O_WRONLY);
-    if (fd < 0) return false;
-    lseek(fd, 0, SEEK_SET);
-    write(fd, &metadata, sizeof(Metadata));
-    close(fd);
-    return true;
+bool fs_exists(FsHandle *fs, const string &filename) {
+    if(filename.empty()) return false;
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_LOOKUP, &filename);
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    return find_node(fs, filename) != -1;
 }
 
-bool fs_create(const string &filename) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
+int64_t fs_size(FsHandle *fs, const string &filename) {
+    if (!usable(fs)) return -1;
+    FsOpTimer timer(FS_OP_LOOKUP, &filename);
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return -1;
+    return content_size(fs->metadata.entries[i]);
+}
 
-    if (filename.length() >= FILENAME_MAX_LEN) return false;
+bool fs_append(FsHandle *fs, const string &filename, const char *data, int64_t size) {
+    if (!usable(fs) || size < 0) return false;
+    FsOpTimer timer(FS_OP_APPEND, &filename, size);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+    // New blocks are added as extents after the old ones; nothing moves.
+    const FileEntry &entry = fs->metadata.entries[i];
+    bool ok = entry.codec ? write_compressed(fs, meta, i, entry.raw_size, data, size, entry.raw_size + size)
+                          : write_range(fs, meta, i, entry.size, data, size);
+    if (!ok) return false;
+    end_op(fs, meta);
+    meta.unlock();
+    fs_log("APPEND " + filename);
+    return true;
+}
 
-    for (int i = 0; i < MAX_FILES; ++i) {
-        if (metadata.entries[i].used && filename == metadata.entries[i].filename)
-            return false;
+bool fs_rename(FsHandle *fs, const string &old_name, const string &new_name) {
+    if (!usable(fs) || old_name.empty()) return false;
+    FsOpTimer timer(FS_OP_RENAME, &old_name);
+    bool directory;
+    {
+        shared_lock<shared_mutex> meta(fs->meta_lock);
+        int64_t i = find_node(fs, old_name);
+        if (i == -1) return false;
+        directory = fs->metadata.entries[i].type == FS_TYPE_DIR;
     }
+    unique_ptr<AllFilesLock> all;
+    unique_ptr<PairLock> files;
+    if (directory) all.reset(new AllFilesLock(fs, true));
+    else files.reset(new PairLock(fs, old_name, true, new_name, true));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_node(fs, old_name);
+    if (i == -1 || (fs->metadata.entries[i].type == FS_TYPE_DIR) != directory) return false;
+    pair<uint64_t, string> key;
+    if (!resolve_parent(fs, new_name, key) || fs->index.count(key)) return false;
+    uint64_t parent = key.first;
+    const string &name = key.second;
+    for (uint64_t p = parent; p != FS_ROOT_DIR; p = fs->metadata.entries[p].parent)
+        if (p == (uint64_t)i) return false;
+
+    FileEntry &entry = fs->metadata.entries[i];
+    drop_name(fs, entry.parent, entry_name(entry));
+    strcpy(entry.filename, name.c_str());
+    entry.parent = parent;
+    add_name(fs, parent, name, i);
+    touch_entry(fs, i);
+    end_op(fs, meta);
+    fs_log("RENAME " + old_name + " " + new_name);
+    return true;
+}
 
-    int index = -1;
-    for (int i = 0; i < MAX_FILES; ++i) {
-        if (!metadata.entries[i].used) {
-            index = i;
-            break;
-        }
+void fs_cat(FsHandle *fs, const string &filename) {
+    if (!usable(fs)) return;
+    FsOpTimer timer(FS_OP_CAT, &filename);
+
+    shared_lock<shared_mutex> file(file_lock(fs, filename));
+    FileMap map;
+    if (!lookup(fs, filename, map)) {
+        cerr << "Dosya bulunamadı.\n";
+        return;
     }
 
-    if (index == -1) return false;
+    stream_contents(fs, map, 0, content_size(map.entry), [](const char *data, int64_t n) {
+        cout.write(data, n);
+        return true;
+    });
+    cout << "\n";
+    fs_log("CAT " + filename, FS_LOG_DEBUG);
+}
 
-    int used_blocks[MAX_FILES] = {0};
-    for (int i = 0; i < MAX_FILES; ++i)
-        if (metadata.entries[i].used)
-            used_blocks[i] = metadata.entries[i].start_block;
+bool fs_truncate(FsHandle *fs, const string &filename, int64_t new_size) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_TRUNCATE, &filename);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    FileMap current;
+    if (!lookup(fs, filename, current)) return false;
+    if (new_size < 0) return false;
+    if ((uint64_t)new_size == content_size(current.entry)) return true;
+
+    if (current.entry.codec) {
+        unique_lock<shared_mutex> meta(fs->meta_lock);
+        if (!write_compressed(fs, meta, find_entry(fs, filename), new_size, nullptr, 0, new_size)) return false;
+        end_op(fs, meta);
+        fs_log("TRUNCATE " + filename);
+        return true;
+    }
 
-    int start_block = (METADATA_SIZE / BLOCK_SIZE);
-    while (find(begin(used_blocks), end(used_blocks), start_block) != end(used_blocks))
-        start_block++;
+    uint64_t bs = fs->metadata.superblock.block_size;
+    if ((uint64_t)new_size > current.entry.size) {
+        // The rest of the last block is zeroed and the blocks after it are a
+        // hole. A shared tail block is copied first, splitting off an extent
+        // of its own unless it is one already. Fails, before changing
+        // anything, when the extent row has no room for both.
+        unique_lock<shared_mutex> meta(fs->meta_lock);
+        int64_t i = find_entry(fs, filename);
+        uint64_t size = current.entry.size, edge = min<uint64_t>(new_size, round_up(size, bs));
+        bool tail = partial_tail(fs, current.extents, size);
+        uint64_t slots = current.extents.size();
+        if (tail && block_shared(fs, file_block(current.extents, size / bs)) && current.extents.back().count > 1)
+            ++slots;
+        if ((uint64_t)new_size > edge && (current.extents.empty() || !is_hole(current.extents.back()))) ++slots;
+        if (slots > FS_MAX_EXTENTS) return false;
+        if (tail) {
+            vector<char> zeros(edge - size);
+            if (!write_range(fs, meta, i, size, zeros.data(), zeros.size())) return false;
+        }
+        add_hole(fs, i, new_size);
+        end_op(fs, meta);
+        fs_log("TRUNCATE " + filename);
+        return true;
+    }
 
-    FileEntry &entry = metadata.entries[index];
-    strcpy(entry.filename, filename.c_str());
-    entry.size = 0;
-    entry.start_block = start_block;
-    entry.created = static_cast<uint32_t>(time(nullptr));
-    entry.used = true;
+    // A new last block that is cut short needs a checksum of what is left.
+    uint64_t keep = blocks_for(fs, new_size);
+    uint64_t tail = new_size % bs;
+    uint64_t tail_block = tail ? file_block(current.extents, keep - 1) : FS_HOLE;
+    uint32_t tail_sum = zeros_sum(tail);
+    if (tail_block != FS_HOLE && !block_sum(fs, tail_block, tail, tail_sum)) return false;
+
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    FileMap map;
+    get_map(fs, i, map);
+    uint64_t have = blocks_for(fs, map.entry.size);
+    bool copy_tail = tail_block != FS_HOLE && block_shared(fs, tail_block);
+    if (copy_tail && slice_extents(map.extents, 0, keep - 1).size() >= FS_MAX_EXTENTS) {
+        // No room for one more extent: move the whole file, which leaves it
+        // sharing nothing.
+        if (!relocate(fs, meta, i)) return false;
+        get_map(fs, i, map);
+        copy_tail = false;
+    }
 
-    metadata.file_count++;
-    fs_save_metadata(metadata);
-    fs_log("CREATE " + filename);
+    vector<FileExtent> extents;
+    if (copy_tail) {
+        // Files sharing that block still see all of it, and a block has a
+        // single checksum: this file gets a copy of its own.
+        vector<FileExtent> runs;
+        if (!allocate(fs, meta, 1, fs->alloc_hint, 1, runs)) return false;
+        uint64_t block = file_block(map.extents, keep - 1);
+        mark_changed(fs, block_offset(fs, runs[0].start), tail);
+        meta.unlock();
+        bool ok = copy_range(fs, block_offset(fs, block), block_offset(fs, runs[0].start), tail);
+        meta.lock();
+        extents = slice_extents(map.extents, 0, keep - 1);
+        extents.push_back(runs[0]);
+        if (!ok || !set_extents(fs, i, extents)) {
+            unallocate(fs, runs);
+            return false;
+        }
+        release_extents(fs, slice_extents(map.extents, keep - 1, have));
+    } else {
+        extents = slice_extents(map.extents, 0, keep);
+        release_extents(fs, slice_extents(map.extents, keep, have));
+        set_extents(fs, i, extents);
+        fs->shrunk_entries.push_back(i);
+    }
+    if (tail) store_file_sums(fs, extents, keep - 1, vector<uint32_t>{tail_sum});
+    fs->metadata.entries[i].size = new_size;
+    touch_entry(fs, i);
+    end_op(fs, meta);
+    fs_log("TRUNCATE " + filename);
     return true;
 }
 
-bool fs_delete(const string &filename) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
-    for (int i = 0; i < MAX_FILES; ++i) {
-        if (metadata.entries[i].used && filename == metadata.entries[i].filename) {
-            metadata.entries[i].used = false;
-            metadata.file_count--;
-            fs_save_metadata(metadata);
-            fs_log("DELETE " + filename);
-            return true;
+bool fs_punch_hole(FsHandle *fs, const string &filename, int64_t offset, int64_t length) {
+    if (!usable(fs) || offset < 0 || length < 0) return false;
+    FsOpTimer timer(FS_OP_TRUNCATE, &filename);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+    FileMap map;
+    get_map(fs, i, map);
+    uint64_t size = content_size(map.entry);
+    uint64_t from = min<uint64_t>(offset, size), to = min<uint64_t>((uint64_t)offset + length, size);
+    if (from == to) return true;
+
+    if (map.entry.codec) {
+        vector<char> zeros(min<uint64_t>(to - from, FS_CHUNK_SIZE));
+        for (uint64_t at = from; at < to; at += zeros.size()) {
+            uint64_t n = min<uint64_t>(zeros.size(), to - at);
+            if (!write_compressed(fs, meta, i, at, zeros.data(), n, size)) return false;
+        }
+    } else {
+        // Blocks [a, b) lie wholly inside the range, the last one counting
+        // as whole when the range runs to the end of the file. Without
+        // room in the extent row for the hole nothing changes.
+        uint64_t bs = fs->metadata.superblock.block_size;
+        uint64_t have = blocks_for(fs, size);
+        uint64_t a = blocks_for(fs, from), b = to == size ? have : to / bs;
+        if (a < b) {
+            vector<FileExtent> extents = slice_extents(map.extents, 0, a);
+            extents.push_back({FS_HOLE, b - a});
+            vector<FileExtent> rest = slice_extents(map.extents, b, have);
+            extents.insert(extents.end(), rest.begin(), rest.end());
+            if (!set_extents(fs, i, extents)) return false;
+            release_extents(fs, slice_extents(map.extents, a, b));
+            touch_entry(fs, i);
+        }
+        // The rest of the range gets zeros where it holds data.
+        vector<char> zeros(min<uint64_t>(to - from, FS_CHUNK_SIZE));
+        for (uint64_t at = from; at < to;) {
+            if (a < b && at == a * bs) {
+                at = b * bs;
+                continue;
+            }
+            uint64_t n = min<uint64_t>(zeros.size(), (a < b && at < a * bs ? a * bs : to) - at);
+            get_map(fs, i, map);
+            vector<FileExtent> part = slice_extents(map.extents, at / bs, blocks_for(fs, at + n));
+            if (!all_of(part.begin(), part.end(), is_hole) && !write_range(fs, meta, i, at, zeros.data(), n)) return false;
+            at += n;
         }
     }
-    return false;
+    end_op(fs, meta);
+    fs_log("PUNCH " + filename + " " + to_string(from) + " " + to_string(to - from));
+    return true;
 }
 
-bool fs_write(const string &filename, const char *data, int size) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
+bool fs_set_codec(FsHandle *fs, const string &filename, FsCodec codec) {
+    if (!usable(fs) || codec > FS_CODEC_LZ) return false;
+    FsOpTimer timer(FS_OP_WRITE, &filename);
+    unique_lock<shared_mutex> file(file_lock(fs, filename));
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t i = find_entry(fs, filename);
+    if (i == -1) return false;
+    FileMap map;
+    get_map(fs, i, map);
+    if (map.entry.codec == codec) return true;
+
+    ChunkTable table;
+    if (map.entry.codec) {
+        meta.unlock();
+        bool ok = load_table(fs, map, 0, UINT64_MAX, table);
+        meta.lock();
+        if (!ok) return false;
+    }
+    if (!encode_file(fs, meta, i, codec, {}, content_size(map.entry), overlay_fill(fs, table, 0, 0, nullptr, 0)))
+        return false;
+    end_op(fs, meta);
+    fs_log("CODEC " + filename + (codec ? " lz" : " none"));
+    return true;
+}
 
-    int fd = open(DISK_NAME, O_RDWR);
-    if (fd < 0) return false;
+bool fs_copy(FsHandle *fs, const string &src_filename, const string &dest_filename) {
+    if (!usable(fs) || src_filename.empty()) return false;
+    FsOpTimer timer(FS_OP_COPY, &src_filename);
+    PairLock files(fs, src_filename, false, dest_filename, true);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    int64_t s = find_entry(fs, src_filename);
+    if (s == -1) return false;
+    if (find_node(fs, dest_filename) != -1) return false;
 
-    for (int i = 0; i < MAX_FILES; ++i) {
-        FileEntry &entry = metadata.entries[i];
-        if (entry.used && filename == entry.filename) {
-            off_t offset = METADATA_SIZE + entry.start_block * BLOCK_SIZE;
-            lseek(fd, offset, SEEK_SET);
-            write(fd, data, size);
-            entry.size = size;
-            fs_save_metadata(metadata);
-            close(fd);
-            fs_log("WRITE " + filename);
-            return true;
-        }
+    int64_t size = fs->metadata.entries[s].size;
+    if (size <= 0) return false;
+
+    int64_t d = create_entry(fs, dest_filename);
+    if (d == -1) return false;
+    FileMap src;
+    get_map(fs, s, src);
+    // The copy keeps the stored form: compressed files stay compressed.
+    FileEntry &copy = fs->metadata.entries[d];
+    if (share_extents(fs, src.extents)) {
+        set_extents(fs, d, src.extents);
+        copy.size = size;
+        copy.raw_size = src.entry.raw_size;
+        copy.codec = src.entry.codec;
+        touch_entry(fs, d);
+        end_op(fs, meta);
+        meta.unlock();
+        fs_log("COPY " + src_filename + " to " + dest_filename);
+        return true;
     }
 
-    close(fd);
-    return false;
+    // Blocks shared by too many files already: copy the data. A copy that
+    // fails leaves no dest behind.
+    Reservation r;
+    if (!reserve_blocks(fs, meta, d, size, r)) {
+        remove_entry(fs, d);
+        end_op(fs, meta);
+        return false;
+    }
+    mark_file_changed(fs, r.extents, 0, size);
+    meta.unlock();
+
+    bool ok = copy_file(fs, src.extents, r.extents, size);
+    meta.lock();
+    if (!ok) {
+        unallocate(fs, r.runs);
+        remove_entry(fs, d);
+        end_op(fs, meta);
+        return false;
+    }
+    install_blocks(fs, d, r, size);
+    copy.raw_size = src.entry.raw_size;
+    copy.codec = src.entry.codec;
+    copy_sums(fs, src.extents, r.extents, size);
+    end_op(fs, meta);
+    meta.unlock();
+    fs_log("COPY " + src_filename + " to " + dest_filename);
+    return true;
 }
 
-bool fs_read(const string &filename, int offset, int size, char *buffer) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
+bool fs_mv(FsHandle *fs, const string &old_name, const string &new_name) {
+    return fs_rename(fs, old_name, new_name);
+}
 
-    int fd = open(DISK_NAME, O_RDONLY);
-    if (fd < 0) return false;
+enum BlockState : char { BLOCK_SAME, BLOCK_UNSURE, BLOCK_DIFFERENT };
+
+// differing_blocks when either file is compressed: the contents are
+// expanded and compared a piece at a time, a block being a block-sized
+// stretch of the contents.
+static bool differing_contents(FsHandle *fs, const FileMap &f1, const FileMap &f2, bool all, vector<uint64_t> &out) {
+    uint64_t bs = fs->metadata.superblock.block_size;
+    uint64_t size1 = content_size(f1.entry), size2 = content_size(f2.entry), common = min(size1, size2);
+    uint64_t checked = size1 == size2 ? blocks_for(fs, common) : common / bs;
+    uint64_t piece = max<uint64_t>(FS_CHUNK_SIZE / bs, 1) * bs;
+    vector<char> data1(min(piece, max<uint64_t>(common, 1))), data2(data1.size());
+    for (uint64_t at = 0; at < checked * bs; at += piece) {
+        uint64_t n = min(piece, common - at);
+        if (!read_contents(fs, f1, at, n, data1.data()) || !read_contents(fs, f2, at, n, data2.data())) return false;
+        for (uint64_t pos = 0; pos < n && at + pos < checked * bs; pos += bs) {
+            uint64_t m = min(bs, n - pos);
+            if (memcmp(data1.data() + pos, data2.data() + pos, m) == 0) continue;
+            out.push_back((at + pos) / bs);
+            if (!all) return true;
+        }
+    }
+    for (uint64_t k = checked; k < blocks_for(fs, max(size1, size2)); ++k) {
+        out.push_back(k);
+        if (!all) break;
+    }
+    return true;
+}
 
-    for (int i = 0; i < MAX_FILES; ++i) {
-        FileEntry &entry = metadata.entries[i];
-        if (entry.used && filename == entry.filename) {
-            if (offset + size > entry.size) {
-                close(fd);
-                return false;
-            }
+// Compares two files block by block and returns the blocks that differ, in
+// order; unless `all`, just one of them. Blocks both files share are equal
+// and blocks past the end of the shorter file differ without a look at the
+// data, and so do blocks whose checksums differ. Only blocks with equal
+// checksums at different places are read and compared. The caller holds both
+// file locks. Returns false on a read error.
+static bool differing_blocks(FsHandle *fs, const FileMap &f1, const FileMap &f2, bool all, vector<uint64_t> &out) {
+    if (f1.entry.codec || f2.entry.codec) return differing_contents(fs, f1, f2, all, out);
+    uint64_t bs = fs->metadata.superblock.block_size;
+    uint64_t common = min(f1.entry.size, f2.entry.size);
+    uint64_t checked = f1.entry.size == f2.entry.size ? blocks_for(fs, common) : common / bs;
+    vector<char> state(blocks_for(fs, max(f1.entry.size, f2.entry.size)), BLOCK_DIFFERENT);
+    uint64_t first_known = checked;    // first block known to differ so far
+    {
+        shared_lock<shared_mutex> meta(fs->meta_lock);
+        const vector<uint32_t> &sums = fs->metadata.sums;
+        BlockCursor c1(f1.extents), c2(f2.extents);
+        for (uint64_t k = 0; k < checked; ++k) {
+            uint64_t b1 = c1.next(), b2 = c2.next();
+            if (b1 == b2) state[k] = BLOCK_SAME;
+            else if (b1 == FS_HOLE || b2 == FS_HOLE || sums[b1] == sums[b2]) state[k] = BLOCK_UNSURE;
+            else first_known = min(first_known, k);
+        }
+    }
 
-            off_t read_offset = METADATA_SIZE + entry.start_block * BLOCK_SIZE + offset;
-            lseek(fd, read_offset, SEEK_SET);
-            read(fd, buffer, size);
-            close(fd);
-            fs_log("READ " + filename);
-            return true;
+    if (!all && first_known < state.size()) {
+        out.push_back(first_known);
+        return true;
+    }
+
+    // Read runs of unsure blocks and compare the data.
+    vector<char> buffer;
+    bool stop = false;
+    for (uint64_t a = 0; a < checked && !stop;) {
+        if (state[a] != BLOCK_UNSURE) {
+            ++a;
+            continue;
         }
+        uint64_t b = a + 1;
+        while (b < checked && state[b] == BLOCK_UNSURE) ++b;
+        uint64_t at = a * bs, skip = 0;
+        bool ok = stream_file(fs, f1.extents, at, min(b * bs, common) - at, [&](const char *data, int64_t n) {
+            const char *other = file_bytes(fs, f2.extents, at, n, buffer);
+            if (!other) return false;
+            for (uint64_t pos = skip > at ? skip - at : 0; pos < (uint64_t)n;) {
+                pos += first_mismatch(data + pos, other + pos, n - pos);
+                if (pos == (uint64_t)n) break;
+                uint64_t block = (at + pos) / bs;
+                state[block] = BLOCK_DIFFERENT;
+                if (!all) {
+                    stop = true;
+                    return false;
+                }
+                skip = (block + 1) * bs;
+                pos = skip - at;
+            }
+            at += n;
+            return true;
+        });
+        if (!ok && !stop) return false;
+        for (uint64_t k = a; k < b; ++k)
+            if (state[k] == BLOCK_UNSURE) state[k] = BLOCK_SAME;
+        a = b;
     }
 
-    close(fd);
-    return false;
+    for (uint64_t k = 0; k < state.size(); ++k) {
+        if (state[k] != BLOCK_DIFFERENT) continue;
+        out.push_back(k);
+        if (!all) break;
+    }
+    return true;
 }
 
-void fs_ls() {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) {
-        cerr << "Metadata okunamadı.\n";
-        return;
+bool fs_diff(FsHandle *fs, const string &file1, const string &file2) {
+    if (!usable(fs) || file1.empty() || file2.empty()) return false;
+    FsOpTimer timer(FS_OP_DIFF, &file1);
+    PairLock files(fs, file1, false, file2, false);
+    FileMap map1, map2;
+    if (!lookup(fs, file1, map1)) return false;
+    if (!lookup(fs, file2, map2)) return false;
+    if (content_size(map1.entry) != content_size(map2.entry)) return false;
+
+    vector<uint64_t> differ;
+    bool same = differing_blocks(fs, map1, map2, false, differ) && differ.empty();
+    fs_log("DIFF " + file1 + " " + file2, FS_LOG_DEBUG);
+    return same;
+}
+
+bool fs_diff_report(FsHandle *fs, const string &file1, const string &file2, FsDiffReport &report) {
+    if (!usable(fs) || file1.empty() || file2.empty()) return false;
+    FsOpTimer timer(FS_OP_DIFF, &file1);
+    PairLock files(fs, file1, false, file2, false);
+    FileMap map1, map2;
+    if (!lookup(fs, file1, map1)) return false;
+    if (!lookup(fs, file2, map2)) return false;
+
+    vector<uint64_t> differ;
+    if (!differing_blocks(fs, map1, map2, true, differ)) return false;
+    report.first_difference = -1;
+    report.ranges.clear();
+    for (size_t a = 0; a < differ.size();) {
+        size_t b = a + 1;
+        while (b < differ.size() && differ[b] == differ[b - 1] + 1) ++b;
+        report.ranges.push_back({differ[a], b - a});
+        a = b;
     }
 
-    cout << "Dosyalar:\n";
-    for (int i = 0; i < MAX_FILES; ++i) {
-        const FileEntry &entry = metadata.entries[i];
-        if (entry.used) {
-            cout << "- " << entry.filename << " (" << entry.size << " bytes)\n";
+    // The exact offset needs the first differing block, unless the files
+    // only differ past the end of the shorter one.
+    if (!differ.empty()) {
+        uint64_t bs = fs->metadata.superblock.block_size;
+        uint64_t common = min(content_size(map1.entry), content_size(map2.entry));
+        uint64_t lo = differ[0] * bs, hi = min(lo + bs, common);
+        report.first_difference = min(lo, common);
+        if (lo < hi) {
+            vector<char> block1(hi - lo), block2(hi - lo);
+            if (!read_contents(fs, map1, lo, hi - lo, block1.data()) ||
+                !read_contents(fs, map2, lo, hi - lo, block2.data()))
+                return false;
+            report.first_difference = lo + first_mismatch(block1.data(), block2.data(), hi - lo);
         }
     }
-
-    fs_log("LS");
+    fs_log("DIFF " + file1 + " " + file2, FS_LOG_DEBUG);
+    return true;
 }
 
-bool fs_exists(const string &filename) {
-    if(filename.empty()) return false;
+// Number for a new snapshot: random, so increments taken on images that
+// went separate ways after a restore never pass for each other.
+static uint64_t new_backup_id(uint64_t old_id) {
+    random_device rd;
+    uint64_t id;
+    do {
+        id = ((uint64_t)rd() << 32 | rd()) ^ (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+    } while (id == 0 || id == old_id);
+    return id;
+}
 
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
-    for (int i = 0; i < MAX_FILES; ++i)
-        if (metadata.entries[i].used && filename == metadata.entries[i].filename)
-            return true;
+// Takes a snapshot with write(fd): commits it under a fresh backup_id and
+// checkpoints the journal, so the image alone holds it, then starts change
+// tracking over if write succeeded. Otherwise the old id is put back.
+static bool take_backup(FsHandle *fs, unique_lock<shared_mutex> &meta, const string &backup_filename,
+                        const function<bool(int fd)> &write) {
+    Superblock &sb = fs->metadata.superblock;
+    uint64_t old_id = sb.backup_id;
+    sb.backup_id = new_backup_id(old_id);
+    fs->sb_dirty = true;
+
+    string temp = backup_filename + ".tmp";
+    int fd = -1;
+    bool ok = commit(fs, meta) && journal_checkpoint(fs->dev, fs->journal) && fs->dev->flush() &&
+              (fd = open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666)) >= 0 &&
+              write(fd) && backup_install(fd, temp, backup_filename);
+    if (fd >= 0) close(fd);
+    if (ok) {
+        fs->changed.reset(fs->changed.nblocks);
+        return true;
+    }
+    unlink(temp.c_str());
+    sb.backup_id = old_id;
+    fs->sb_dirty = true;
+    commit(fs, meta);
     return false;
 }
 
-int fs_size(const string &filename) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return -1;
-    for (int i = 0; i < MAX_FILES; ++i)
-        if (metadata.entries[i].used && filename == metadata.entries[i].filename)
-            return metadata.entries[i].size;
-    return -1;
+bool fs_backup(FsHandle *fs, const string &backup_filename, int threads) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_BACKUP, &backup_filename);
+    AllFilesLock files(fs, false);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    bool ok = take_backup(fs, meta, backup_filename, [&](int fd) {
+        return backup_copy(fs->dev->fd, fd, fs->dev->size, threads);
+    });
+    if (ok) fs_log("BACKUP to " + backup_filename);
+    return ok;
 }
 
-bool fs_append(const string &filename, const char *data, int size) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
+bool fs_backup_incremental(FsHandle *fs, const string &backup_filename, int threads) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_BACKUP, &backup_filename);
+    AllFilesLock files(fs, false);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    const Superblock &sb = fs->metadata.superblock;
+    if (!sb.backup_id) return false;
+
+    IncrementHeader header;
+    memset(&header, 0, sizeof(header));
+    header.base = sb.backup_id;
+    header.volume_size = sb.volume_size;
+    header.block_size = sb.block_size;
+    uint64_t count = 0;
+    bool ok = take_backup(fs, meta, backup_filename, [&](int fd) {
+        // The journal itself is left out but for its header: whatever the
+        // old body holds is older than the sequence the header expects.
+        BlockBitmap &changed = fs->changed;
+        changed.set_range(sb.journal_offset / sb.block_size, 1);
+        vector<uint64_t> blocks;
+        for (int64_t b = 0; b < changed.nblocks; ++b)
+            if (changed.test(b)) blocks.push_back(b);
+        header.id = sb.backup_id;
+        count = blocks.size();
+        return backup_write_increment(fs->dev, fd, header, blocks, threads);
+    });
+    if (ok) fs_log("BACKUP_INCREMENTAL to " + backup_filename + " " + to_string(count) + " blocks");
+    return ok;
+}
 
-    int fd = open(DISK_NAME, O_RDWR);
-    if (fd < 0) return false;
+// Opens a backup for reading, refusing files that do not hold an image.
+static int open_backup(const string &backup_filename) {
+    int fd = open(backup_filename.c_str(), O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    Superblock sb;
+    if (fstat(fd, &st) != 0 || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+        !valid_superblock(sb, st.st_size)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    for (int i = 0; i < MAX_FILES; ++i) {
-        FileEntry &entry = metadata.entries[i];
-        if (entry.used && filename == entry.filename) {
-            off_t offset = METADATA_SIZE + entry.start_block * BLOCK_SIZE + entry.size;
-            lseek(fd, offset, SEEK_SET);
-            write(fd, data, size);
-            entry.size += size;
-            fs_save_metadata(metadata);
-            close(fd);
-            fs_log("APPEND " + filename);
-            return true;
-        }
+// Puts the image a chain of backups describes at path in one step: the
+// full backup is copied under a temporary name, each increment is checked
+// against the snapshot before it and applied, and only a complete, durable
+// result is renamed over the old image. A crash or a bad link in the chain
+// leaves the old image as it was.
+static bool install_image(const vector<string> &chain, const string &path, int threads) {
+    if (chain.empty()) return false;
+    int fd_src = open_backup(chain[0]);
+    if (fd_src < 0) return false;
+    struct stat st;
+    string temp = path + ".restore";
+    int fd_dst = open(temp.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0666);
+    bool ok = fd_dst >= 0 && fstat(fd_src, &st) == 0 && backup_copy(fd_src, fd_dst, st.st_size, threads);
+    close(fd_src);
+
+    Superblock sb;
+    ok = ok && pread(fd_dst, &sb, sizeof(sb), 0) == sizeof(sb);
+    for (size_t k = 1; ok && k < chain.size(); ++k) {
+        int fd_inc = open(chain[k].c_str(), O_RDONLY);
+        IncrementHeader header;
+        ok = fd_inc >= 0 && backup_read_header(fd_inc, header) &&
+             header.base == sb.backup_id && header.block_size == sb.block_size &&
+             header.volume_size == sb.volume_size &&
+             backup_apply_increment(fd_inc, header, fd_dst, threads) &&
+             pread(fd_dst, &sb, sizeof(sb), 0) == sizeof(sb) && sb.backup_id == header.id;
+        if (fd_inc >= 0) close(fd_inc);
     }
 
-    close(fd);
-    return false;
+    ok = ok && fstat(fd_dst, &st) == 0 && valid_superblock(sb, st.st_size) && backup_install(fd_dst, temp, path);
+    if (fd_dst >= 0) close(fd_dst);
+    if (!ok) unlink(temp.c_str());
+    return ok;
 }
 
-bool fs_rename(const string &old_name, const string &new_name) {
-    if (!fs_exists(old_name)) return false;
-    if (fs_exists(new_name)) return false;
+bool fs_restore_chain(FsHandle *fs, const vector<string> &backup_filenames, int threads) {
+    if (!fs) return false;
+    FsOpTimer timer(FS_OP_RESTORE);
+    unique_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    AllFilesLock files(fs, true);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    lock_guard<mutex> committing(fs->commit_lock);
+
+    if (!install_image(backup_filenames, fs->path, threads)) return false;
+
+    // The image is a new file, possibly of a new size: reopen and remap it.
+    // The old device still points at the replaced file, so if the new one
+    // cannot be opened or loaded the handle is left unusable: no files, and
+    // every access to the image fails.
+    const FsMountOptions &options = fs->options;
+    Device *dev = device_open(fs->path, options.use_mmap, options.cache_bytes, options.direct_io, options.io_uring);
+    delete fs->dev;
+    fs->dev = dev;
+
+    // Changes not committed before the restore are dropped with the old image.
+    fs->durable_generation = fs->generation++;
+    if (!dev || !load_image(fs)) {
+        delete fs->dev;
+        fs->dev = device_closed();
+        fs->closed = true;
+        fs->metadata = Metadata();
+        reset_state(fs);
+        build_index(fs);
+        load_snapshots(fs);
+        return false;
+    }
+    // The image is exactly the last snapshot of the chain.
+    fs->closed = false;
+    fs->changed.reset(fs->changed.nblocks);
+    fs_log("RESTORE from " + backup_filenames.back());
+    return true;
+}
 
-    if (new_name.length() >= FILENAME_MAX_LEN) return false;
+bool fs_restore(FsHandle *fs, const string &backup_filename, int threads) {
+    return fs_restore_chain(fs, vector<string>{backup_filename}, threads);
+}
 
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
+// Most bytes one write of an import carries
+#define IMPORT_RUN (8 << 20)
+// An import places and commits files in batches of at most this many bytes
+// and files.
+#define IMPORT_BATCH (256 << 20)
+#define IMPORT_BATCH_FILES 4096
+// Piece of a file an export reads and writes at a time
+#define EXPORT_PIECE (8 << 20)
+
+// A host file on its way into the image
+struct ImportFile {
+    string host;
+    string path;        // in the image
+    uint64_t size;
+    vector<FileExtent> extents;
+};
+
+// Blocks [first, first + count) of files[file]
+struct ImportPiece {
+    size_t file;
+    uint64_t first;
+    uint64_t count;
+};
+
+// count consecutive data blocks from start, filled by the pieces in order
+struct ImportRun {
+    uint64_t start;
+    uint64_t count;
+    vector<ImportPiece> pieces;
+};
+
+static bool host_read(int fd, char *buffer, uint64_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, buffer, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
 
-    for (int i = 0; i < MAX_FILES; ++i) {
-        if (metadata.entries[i].used && old_name == metadata.entries[i].filename) {
-            strcpy(metadata.entries[i].filename, new_name.c_str());
-            fs_save_metadata(metadata);
-            fs_log("RENAME " + old_name + " " + new_name);
-            return true;
-        }
+static bool host_write(int fd, const char *data, uint64_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        offset += n;
+        length -= n;
     }
+    return true;
+}
 
-    return false;
+// Adds the directories (each before what is in it) and files under the host
+// directory root/relative, in name order, with their paths relative to
+// root. Other entries and names the image cannot hold are skipped with a
+// warning. False if a directory cannot be read.
+static bool scan_host_tree(const string &root, const string &relative, vector<string> &dirs,
+                           vector<ImportFile> &files) {
+    string dir = relative.empty() ? root : root + "/" + relative;
+    DIR *d = opendir(dir.c_str());
+    if (!d) return false;
+    vector<string> names;
+    while (dirent *e = readdir(d)) names.push_back(e->d_name);
+    closedir(d);
+    sort(names.begin(), names.end());
+
+    for (const string &name : names) {
+        if (name == "." || name == "..") continue;
+        string host = dir + "/" + name, path = relative.empty() ? name : relative + "/" + name;
+        struct stat st;
+        bool known = valid_name(name) && lstat(host.c_str(), &st) == 0 && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode));
+        if (!known) {
+            cerr << "Uyarı: '" << host << "' atlandı.\n";
+        } else if (S_ISDIR(st.st_mode)) {
+            dirs.push_back(path);
+            if (!scan_host_tree(root, path, dirs, files)) return false;
+        } else {
+            files.push_back({host, path, (uint64_t)st.st_size, {}});
+        }
+    }
+    return true;
 }
 
-void fs_cat(const string &filename) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return;
+// Imports as many of files[a, b) as there are blocks and slots for. Their
+// blocks are taken first, one file after another, and filled from the host
+// files by runs of consecutive blocks on `threads` threads; the entries
+// change only once the data is in place, and are committed together.
+// Returns the end of the files imported, or a, with `ok` false, if the
+// data could not be written. Called with every file lock and meta_lock held.
+static size_t import_batch(FsHandle *fs, unique_lock<shared_mutex> &meta, vector<ImportFile> &files, size_t a,
+                           size_t b, int threads, bool &ok) {
+    uint64_t bs = fs->metadata.superblock.block_size;
+    size_t slots = fs->free_slots.size(), end = a;
+    for (; end < b; ++end) {
+        ImportFile &f = files[end];
+        int64_t i = find_node(fs, f.path);
+        if (i != -1 ? fs->metadata.entries[i].type != FS_TYPE_FILE : slots == 0) break;
+        if (!allocate(fs, meta, blocks_for(fs, f.size), fs->alloc_hint, FS_MAX_EXTENTS, f.extents)) break;
+        if (i == -1) --slots;
+        mark_file_changed(fs, f.extents, 0, f.size);
+    }
 
-    int fd = open(DISK_NAME, O_RDONLY);
-    if (fd < 0) return;
+    vector<ImportRun> runs;
+    uint64_t per_run = max<uint64_t>(1, IMPORT_RUN / bs);
+    for (size_t k = a; k < end; ++k) {
+        uint64_t first = 0;
+        for (const FileExtent &e : files[k].extents) {
+            for (uint64_t done = 0; done < e.count;) {
+                uint64_t start = e.start + done;
+                if (runs.empty() || runs.back().start + runs.back().count != start || runs.back().count == per_run)
+                    runs.push_back({start, 0, {}});
+                uint64_t n = min(e.count - done, per_run - runs.back().count);
+                runs.back().pieces.push_back({k, first + done, n});
+                runs.back().count += n;
+                done += n;
+            }
+            first += e.count;
+        }
+    }
 
-    for (int i = 0; i < MAX_FILES; ++i) {
-        const FileEntry &entry = metadata.entries[i];
-        if (entry.used && filename == entry.filename) {
-            char *buffer = new char[entry.size + 1];
-            off_t offset = METADATA_SIZE + entry.start_block * BLOCK_SIZE;
-            lseek(fd, offset, SEEK_SET);
-            read(fd, buffer, entry.size);
-            buffer[entry.size] = '\0';
-            cout << buffer << "\n";
-            delete[] buffer;
-            fs_log("CAT " + filename);
-            close(fd);
-            return;
+    vector<vector<uint32_t>> sums(runs.size());
+    meta.unlock();
+    ok = backup_parallel(runs.size(), threads, [&](size_t r) {
+        const ImportRun &run = runs[r];
+        vector<char> buffer(run.count * bs);
+        char *at = buffer.data();
+        for (const ImportPiece &piece : run.pieces) {
+            const ImportFile &f = files[piece.file];
+            uint64_t offset = piece.first * bs, n = min(piece.count * bs, f.size - offset);
+            int fd = open(f.host.c_str(), O_RDONLY);
+            bool read = fd >= 0 && host_read(fd, at, n, offset);
+            if (fd >= 0) close(fd);
+            if (!read) return false;
+            BlockSummer summer(bs);
+            summer.add(at, n);
+            summer.finish();
+            sums[r].insert(sums[r].end(), summer.sums.begin(), summer.sums.end());
+            at += piece.count * bs;
         }
+        return fs->dev->write_at(block_offset(fs, run.start), buffer.data(), buffer.size());
+    });
+    meta.lock();
+
+    if (!ok) {
+        for (size_t k = a; k < end; ++k) unallocate(fs, files[k].extents);
+        return a;
+    }
+    for (size_t k = a; k < end; ++k) {
+        const ImportFile &f = files[k];
+        int64_t i = find_node(fs, f.path);
+        if (i == -1) i = create_entry(fs, f.path);
+        FileMap map;
+        get_map(fs, i, map);
+        release_extents(fs, map.extents);
+        set_extents(fs, i, f.extents);
+        FileEntry &entry = fs->metadata.entries[i];
+        entry.size = f.size;
+        entry.raw_size = 0;
+        entry.codec = FS_CODEC_NONE;
+        touch_entry(fs, i);
     }
+    for (size_t r = 0; r < runs.size(); ++r) {
+        copy(sums[r].begin(), sums[r].end(), fs->metadata.sums.begin() + runs[r].start);
+        touch_sums(fs, runs[r].start, runs[r].count);
+    }
+    ok = commit(fs, meta);
+    return end;
+}
 
-    close(fd);
-    cerr << "Dosya bulunamadı.\n";
+bool fs_import_tree(FsHandle *fs, const string &host_dir, const string &path, int threads) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_IMPORT, &path);
+    vector<string> dirs;
+    vector<ImportFile> files;
+    if (!scan_host_tree(host_dir, "", dirs, files)) return false;
+
+    // path and the directories above it first, then those from the host
+    string prefix;
+    vector<string> make;
+    for (size_t a = path.find_first_not_of('/'); a != string::npos; a = path.find_first_not_of('/', a)) {
+        a = min(path.find('/', a), path.size());
+        make.push_back(path.substr(0, a));
+    }
+    if (!make.empty()) prefix = make.back() + "/";
+    for (const string &dir : dirs) make.push_back(prefix + dir);
+    for (ImportFile &f : files) f.path = prefix + f.path;
+
+    uint64_t bytes = 0;
+    size_t done = 0;
+    bool ok = true;
+    {
+        AllFilesLock all(fs, true);
+        unique_lock<shared_mutex> meta(fs->meta_lock);
+        for (const string &dir : make) {
+            int64_t i = find_node(fs, dir);
+            if (i == -1) i = create_entry(fs, dir, FS_TYPE_DIR);
+            if (i == -1 || fs->metadata.entries[i].type != FS_TYPE_DIR) {
+                ok = false;
+                break;
+            }
+        }
+        end_op(fs, meta);
+    }
+    while (ok && done < files.size()) {
+        size_t end = done;
+        for (uint64_t batch = 0; end < files.size() && end - done < IMPORT_BATCH_FILES &&
+                                 (end == done || batch + files[end].size <= IMPORT_BATCH);)
+            batch += files[end++].size;
+        AllFilesLock all(fs, true);
+        unique_lock<shared_mutex> meta(fs->meta_lock);
+        size_t imported = import_batch(fs, meta, files, done, end, threads, ok);
+        for (size_t k = done; ok && k < imported; ++k) bytes += files[k].size;
+        ok = ok && imported == end;
+        done = imported;
+    }
+    fs_log("IMPORT " + host_dir + " to /" + prefix + " " + to_string(done) + " files " + to_string(bytes) + " bytes");
+    return ok;
 }
 
-void fs_log(const string &message) {
-    ofstream logFile("fs.log", ios::app);
-    if (logFile.is_open()) {
-        time_t now = time(nullptr);
-        logFile << "[" << ctime(&now) << "] " << message << endl;
-        logFile.close();
+// Adds the directories (each before what is in it) and files under the
+// directory dir, with their paths relative to it. Called under meta_lock.
+static void collect_tree(const FsHandle *fs, uint64_t dir, const string &relative, vector<string> &dirs,
+                         vector<pair<string, FileMap>> &files) {
+    auto it = fs->listing.lower_bound({dir, string()});
+    for (; it != fs->listing.end() && it->first.first == dir; ++it) {
+        string path = relative.empty() ? it->first.second : relative + "/" + it->first.second;
+        const FileEntry &entry = fs->metadata.entries[it->second];
+        if (entry.type == FS_TYPE_DIR) {
+            dirs.push_back(path);
+            collect_tree(fs, it->second, path, dirs, files);
+        } else if (entry.type == FS_TYPE_FILE) {
+            files.push_back({path, FileMap()});
+            get_map(fs, it->second, files.back().second);
+        }
     }
 }
 
-bool fs_truncate(const string &filename, int new_size) {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return false;
-
-    for (int i = 0; i < MAX_FILES; ++i) {
-        FileEntry &entry = metadata.entries[i];
-        if (entry.used && filename == entry.filename) {
-            if (new_size >= entry.size) return false;
-            entry.size = new_size;
-            fs_save_metadata(metadata);
-            fs_log("TRUNCATE " + filename);
-            return true;
+bool fs_export_tree(FsHandle *fs, const string &path, const string &host_dir, int threads) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_EXPORT, &path);
+    AllFilesLock all(fs, false);
+    vector<string> dirs;
+    vector<pair<string, FileMap>> files;
+    string prefix;
+    {
+        shared_lock<shared_mutex> meta(fs->meta_lock);
+        uint64_t top = FS_ROOT_DIR;
+        if (!is_root(path)) {
+            int64_t i = find_node(fs, path);
+            if (i == -1 || fs->metadata.entries[i].type != FS_TYPE_DIR) return false;
+            top = i;
+            prefix = entry_path(fs, i) + "/";
         }
+        collect_tree(fs, top, "", dirs, files);
     }
 
-    return false;
+    if (mkdir(host_dir.c_str(), 0777) != 0 && errno != EEXIST) return false;
+    for (const string &dir : dirs)
+        if (mkdir((host_dir + "/" + dir).c_str(), 0777) != 0 && errno != EEXIST) return false;
+
+    // Every file at its full size first, then its pieces in any order.
+    bool ok = backup_parallel(files.size(), threads, [&](size_t k) {
+        int fd = open((host_dir + "/" + files[k].first).c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        if (fd < 0) return false;
+        off_t size = content_size(files[k].second.entry);
+        bool sized = size == 0 || fallocate(fd, 0, 0, size) == 0 || ftruncate(fd, size) == 0;
+        close(fd);
+        return sized;
+    });
+    vector<pair<size_t, uint64_t>> pieces;     // (file, offset)
+    for (size_t k = 0; k < files.size(); ++k)
+        for (uint64_t offset = 0; offset < content_size(files[k].second.entry); offset += EXPORT_PIECE)
+            pieces.push_back({k, offset});
+    uint64_t bytes = 0;
+    for (const auto &f : files) bytes += content_size(f.second.entry);
+
+    ok = ok && backup_parallel(pieces.size(), threads, [&](size_t p) {
+        const FileMap &map = files[pieces[p].first].second;
+        uint64_t offset = pieces[p].second, n = min<uint64_t>(EXPORT_PIECE, content_size(map.entry) - offset);
+        vector<char> buffer(n);
+        if (!verify_range(fs, prefix + files[pieces[p].first].first, map, offset, n) ||
+            !read_contents(fs, map, offset, n, buffer.data()))
+            return false;
+        int fd = open((host_dir + "/" + files[pieces[p].first].first).c_str(), O_WRONLY);
+        bool written = fd >= 0 && host_write(fd, buffer.data(), n, offset);
+        if (fd >= 0) close(fd);
+        return written;
+    });
+    if (ok) fs_log("EXPORT /" + prefix + " to " + host_dir + " " + to_string(files.size()) + " files " +
+                   to_string(bytes) + " bytes");
+    return ok;
 }
 
-bool fs_copy(const string &src_filename, const string &dest_filename) {
-    if (!fs_exists(src_filename)) return false;
-    if (fs_exists(dest_filename)) return false;
+// The snapshot called name, or null.
+static shared_ptr<const Snapshot> find_snapshot(FsHandle *fs, const string &name) {
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    auto it = fs->snapshots.find(name);
+    return it == fs->snapshots.end() ? nullptr : it->second;
+}
 
-    int size = fs_size(src_filename);
-    if (size <= 0) return false;
+// Entry and extents of the file at filename as a snapshot holds it; false
+// if it holds none there.
+static bool snapshot_lookup(const Snapshot &snap, const string &filename, FileMap &map) {
+    pair<uint64_t, string> key;
+    if (!resolve_in(snap.index, snap.entries, filename, key)) return false;
+    auto it = snap.index.find(key);
+    if (it == snap.index.end() || snap.entries[it->second].type != FS_TYPE_FILE) return false;
+    map_in(snap.entries, snap.extents, it->second, map);
+    return true;
+}
 
-    char *buffer = new char[size];
-    if (!fs_read(src_filename, 0, size, buffer)) {
-        delete[] buffer;
+bool fs_snapshot_create(FsHandle *fs, const string &name) {
+    if (!usable(fs) || !valid_name(name)) return false;
+    FsOpTimer timer(FS_OP_SNAPSHOT, &name);
+    shared_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    // Writers wait until the snapshot is committed: a block it holds must not
+    // be given back by a commit that does not have the snapshot yet.
+    AllFilesLock files(fs, true);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    if (fs->snapshots.count(name)) return false;
+
+    auto snap = make_shared<Snapshot>();
+    snap->entries = fs->metadata.entries;
+    snap->extents = fs->metadata.extents;
+    for (FileEntry &entry : snap->entries)
+        if (entry.type == FS_TYPE_SNAPSHOT) entry.used = false;
+    index_snapshot(*snap);
+    vector<char> table = snapshot_table(*snap);
+
+    // The tables go to fresh blocks first; the entry pointing to them is
+    // added once they are written.
+    vector<FileExtent> runs;
+    if (fs->free_slots.empty() ||
+        !allocate(fs, meta, blocks_for(fs, table.size()), fs->alloc_hint, FS_MAX_EXTENTS, runs))
         return false;
-    }
-
-    if (!fs_create(dest_filename)) {
-        delete[] buffer;
+    mark_file_changed(fs, runs, 0, table.size());
+    meta.unlock();
+    bool ok = write_file(fs, runs, 0, table.data(), table.size());
+    BlockSummer summer(fs->metadata.superblock.block_size);
+    summer.add(table.data(), table.size());
+    summer.finish();
+    meta.lock();
+    int64_t i = ok ? add_entry(fs, {FS_SNAPSHOT_DIR, name}, FS_TYPE_SNAPSHOT) : -1;
+    if (i == -1) {
+        unallocate(fs, runs);
         return false;
     }
-
-    bool result = fs_write(dest_filename, buffer, size);
-    delete[] buffer;
-    fs_log("COPY " + src_filename + " to " + dest_filename);
-    return result;
+    set_extents(fs, i, runs);
+    store_file_sums(fs, runs, 0, summer.sums);
+    fs->metadata.entries[i].size = table.size();
+    touch_entry(fs, i);
+
+    snap->slot = i;
+    snap->created = fs->metadata.entries[i].created;
+    freeze(fs, *snap);
+    fs->snapshots[name] = snap;
+    if (!commit(fs, meta)) return false;
+    fs_log("SNAPSHOT " + name + " " + to_string(snap->files) + " entries");
+    return true;
 }
 
-bool fs_mv(const string &old_name, const string &new_name) {
-    return fs_rename(old_name, new_name);
+bool fs_snapshot_delete(FsHandle *fs, const string &name) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_SNAPSHOT, &name);
+    unique_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    auto it = fs->snapshots.find(name);
+    if (it == fs->snapshots.end()) return false;
+    uint64_t i = it->second->slot;
+    fs->snapshots.erase(it);
+
+    FileMap map;
+    get_map(fs, i, map);
+    release_extents(fs, map.extents);
+    set_extents(fs, i, {});
+    remove_entry(fs, i);
+
+    // Blocks that were frozen and are no more go back, unless a live file
+    // still holds them.
+    BlockBitmap was = move(fs->frozen);
+    refreeze(fs);
+    BlockBitmap live;
+    live.reset(fs->metadata.superblock.data_blocks);
+    const vector<FileEntry> &entries = fs->metadata.entries;
+    for (uint64_t slot = 0; slot < entries.size(); ++slot) {
+        if (!entries[slot].used) continue;
+        for (uint32_t k = 0; k < entries[slot].extent_count; ++k) {
+            const FileExtent &e = fs->metadata.extents[slot * FS_MAX_EXTENTS + k];
+            if (!is_hole(e)) live.set_range(e.start, e.count);
+        }
+    }
+    uint64_t freed = 0;
+    for (int64_t b = 0; b < was.nblocks;) {
+        if (!was.test(b) || fs->frozen.test(b) || live.test(b)) {
+            ++b;
+            continue;
+        }
+        int64_t end = b + 1;
+        while (end < was.nblocks && was.test(end) && !fs->frozen.test(end) && !live.test(end)) ++end;
+        free_blocks(fs, b, end - b);
+        freed += end - b;
+        b = end;
+    }
+    if (!commit(fs, meta)) return false;
+    fs_log("SNAPSHOT_DELETE " + name + " " + to_string(freed) + " blocks");
+    return true;
 }
 
-bool fs_diff(const string &file1, const string &file2) {
-    if (!fs_exists(file1)) return false;
-    if (!fs_exists(file2)) return false;
+bool fs_snapshot_list(FsHandle *fs, vector<FsSnapshotInfo> &snapshots) {
+    snapshots.clear();
+    if (!usable(fs)) return false;
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    for (const auto &s : fs->snapshots) snapshots.push_back({s.first, s.second->created, s.second->files});
+    return true;
+}
 
-    int size1 = fs_size(file1);
-    int size2 = fs_size(file2);
+int64_t fs_snapshot_size(FsHandle *fs, const string &snapshot, const string &filename) {
+    if (!usable(fs)) return -1;
+    FsOpTimer timer(FS_OP_LOOKUP, &filename);
+    shared_ptr<const Snapshot> snap = find_snapshot(fs, snapshot);
+    FileMap map;
+    if (!snap || !snapshot_lookup(*snap, filename, map)) return -1;
+    return content_size(map.entry);
+}
 
-    if (size1 != size2) return false;
+int64_t fs_snapshot_read(FsHandle *fs, const string &snapshot, const string &filename, int64_t offset,
+                         char *buffer, int64_t size) {
+    if (!usable(fs) || offset < 0 || size < 0) return -1;
+    FsOpTimer timer(FS_OP_READ, &filename, size);
+    shared_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    shared_ptr<const Snapshot> snap = find_snapshot(fs, snapshot);
+    FileMap map;
+    if (!snap || !snapshot_lookup(*snap, filename, map)) return -1;
+    uint64_t length = content_size(map.entry);
+    uint64_t n = (uint64_t)offset < length ? min<uint64_t>(size, length - offset) : 0;
+    if (!verify_range(fs, snapshot + ":" + filename, map, offset, n) || !read_contents(fs, map, offset, n, buffer))
+        return -1;
+    fs_log("SNAPSHOT_READ " + snapshot + " " + filename, FS_LOG_DEBUG);
+    return n;
+}
 
-    char *buf1 = new char[size1];
-    char *buf2 = new char[size2];
-    bool result = fs_read(file1, 0, size1, buf1) && fs_read(file2, 0, size2, buf2);
+// Path -> slot of every file and directory of an entry table.
+static map<string, uint64_t> all_paths(const vector<FileEntry> &entries) {
+    map<string, uint64_t> paths;
+    for (uint64_t i = 0; i < entries.size(); ++i)
+        if (entries[i].used && entries[i].type != FS_TYPE_SNAPSHOT) paths[path_in(entries, i)] = i;
+    return paths;
+}
 
-    bool same = result && (memcmp(buf1, buf2, size1) == 0);
+bool fs_snapshot_diff(FsHandle *fs, const string &from, const string &to, vector<FsSnapshotChange> &changes) {
+    changes.clear();
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_DIFF, &from);
+    shared_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    // The live side holds still under every file lock.
+    unique_ptr<AllFilesLock> files;
+    if (from.empty() || to.empty()) files.reset(new AllFilesLock(fs, false));
+
+    Snapshot live;
+    shared_ptr<const Snapshot> sides[2];
+    const string *names[2] = {&from, &to};
+    for (int k = 0; k < 2; ++k) {
+        if (!names[k]->empty()) {
+            sides[k] = find_snapshot(fs, *names[k]);
+            if (!sides[k]) return false;
+        } else if (live.entries.empty()) {
+            shared_lock<shared_mutex> meta(fs->meta_lock);
+            live.entries = fs->metadata.entries;
+            live.extents = fs->metadata.extents;
+        }
+    }
+    const Snapshot &a = sides[0] ? *sides[0] : live, &b = sides[1] ? *sides[1] : live;
+
+    map<string, uint64_t> paths_a = all_paths(a.entries), paths_b = all_paths(b.entries);
+    auto ia = paths_a.begin(), ib = paths_b.begin();
+    while (ia != paths_a.end() || ib != paths_b.end()) {
+        if (ib == paths_b.end() || (ia != paths_a.end() && ia->first < ib->first)) {
+            changes.push_back({ia->first, FS_CHANGE_REMOVED});
+            ++ia;
+            continue;
+        }
+        if (ia == paths_a.end() || ib->first < ia->first) {
+            changes.push_back({ib->first, FS_CHANGE_ADDED});
+            ++ib;
+            continue;
+        }
+        FileMap map_a, map_b;
+        map_in(a.entries, a.extents, ia->second, map_a);
+        map_in(b.entries, b.extents, ib->second, map_b);
+        bool modified = map_a.entry.type != map_b.entry.type;
+        if (!modified && map_a.entry.type == FS_TYPE_FILE) {
+            modified = content_size(map_a.entry) != content_size(map_b.entry);
+            vector<uint64_t> differ;
+            if (!modified && !differing_blocks(fs, map_a, map_b, false, differ)) return false;
+            modified = modified || !differ.empty();
+        }
+        if (modified) changes.push_back({ia->first, FS_CHANGE_MODIFIED});
+        ++ia;
+        ++ib;
+    }
+    fs_log("SNAPSHOT_DIFF " + (from.empty() ? "-" : from) + " " + (to.empty() ? "-" : to), FS_LOG_DEBUG);
+    return true;
+}
 
-    delete[] buf1;
-    delete[] buf2;
+bool fs_snapshot_rollback(FsHandle *fs, const string &name) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_SNAPSHOT, &name);
+    shared_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    AllFilesLock files(fs, true);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    auto it = fs->snapshots.find(name);
+    if (it == fs->snapshots.end()) return false;
+    const Snapshot &snap = *it->second;
+    Metadata &metadata = fs->metadata;
+    vector<FileEntry> &entries = metadata.entries;
+
+    // Entries of the snapshot keep their slots, but for those taken by a
+    // snapshot made later, which move to slots free in both.
+    vector<uint64_t> slot_of(entries.size(), UINT64_MAX), spare;
+    for (uint64_t i = entries.size(); i-- > 0;) {
+        bool taken = entries[i].used && entries[i].type == FS_TYPE_SNAPSHOT;
+        if (!taken && !snap.entries[i].used) spare.push_back(i);
+        if (snap.entries[i].used) slot_of[i] = taken ? UINT64_MAX - 1 : i;
+    }
+    for (uint64_t &slot : slot_of) {
+        if (slot != UINT64_MAX - 1) continue;
+        if (spare.empty()) return false;
+        slot = spare.back();
+        spare.pop_back();
+    }
 
-    fs_log("DIFF " + file1 + " " + file2);
-    return same;
+    // The live files let go of their blocks, which are freed unless a
+    // snapshot holds them; then the snapshot's files take theirs back.
+    uint64_t files_now = 0;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        if (entries[i].used && entries[i].type == FS_TYPE_SNAPSHOT) {
+            files_now++;
+            continue;
+        }
+        if (entries[i].used) {
+            FileMap map;
+            get_map(fs, i, map);
+            release_extents(fs, map.extents);
+        }
+        entries[i].used = false;
+        set_extents(fs, i, {});
+    }
+    BlockBitmap claimed;
+    claimed.reset(metadata.superblock.data_blocks);
+    for (uint64_t s = 0; s < snap.entries.size(); ++s) {
+        if (!snap.entries[s].used) continue;
+        uint64_t i = slot_of[s];
+        entries[i] = snap.entries[s];
+        if (entries[i].parent != FS_ROOT_DIR) entries[i].parent = slot_of[entries[i].parent];
+        copy_n(snap.extents.begin() + s * FS_MAX_EXTENTS, FS_MAX_EXTENTS, extent_row(metadata, i));
+        for (uint32_t k = 0; k < entries[i].extent_count; ++k) {
+            const FileExtent &e = extent_row(metadata, i)[k];
+            for (uint64_t b = e.start; !is_hole(e) && b < e.start + e.count; ++b) {
+                if (!claimed.test(b)) {
+                    claimed.set_range(b, 1);
+                    continue;
+                }
+                metadata.refs[b]++;
+                touch_refs(fs, b, 1);
+            }
+        }
+        files_now++;
+    }
+    metadata.superblock.file_count = files_now;
+    fs->sb_dirty = true;
+    for (uint64_t i = 0; i < entries.size(); ++i) touch_entry(fs, i);
+    build_index(fs);
+    fs->dedup_index.clear();
+    if (!commit(fs, meta)) return false;
+    fs_log("SNAPSHOT_ROLLBACK " + name);
+    return true;
 }
 
-bool fs_backup(const string &backup_filename) {
-    int fd_src = open(DISK_NAME, O_RDONLY);
-    int fd_dst = open(backup_filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
-    if (fd_src < 0 || fd_dst < 0) return false;
-
-    char buffer[1024];
-    int bytes;
-    while ((bytes = read(fd_src, buffer, sizeof(buffer))) > 0)
-        write(fd_dst, buffer, bytes);
+bool fs_backup_snapshot(FsHandle *fs, const string &snapshot, const string &backup_filename) {
+    if (!usable(fs)) return false;
+    FsOpTimer timer(FS_OP_BACKUP, &backup_filename);
+    shared_lock<shared_mutex> snapshots(fs->snapshot_lock);
+    shared_ptr<const Snapshot> snap = find_snapshot(fs, snapshot);
+    if (!snap) return false;
+
+    // The volume as the snapshot holds it: its tables, with a bitmap and
+    // reference counts worked out from them, and the checksums of its blocks,
+    // which stay as they are while it exists. No change tracking, no
+    // defragmenting under way.
+    Metadata image;
+    {
+        shared_lock<shared_mutex> meta(fs->meta_lock);
+        image.superblock = fs->metadata.superblock;
+        image.sums = fs->metadata.sums;
+    }
+    Superblock &sb = image.superblock;
+    sb.file_count = snap->files;
+    sb.backup_id = 0;
+    sb.defrag_slot = sb.defrag_to = sb.defrag_count = sb.defrag_done = sb.defrag_extent = 0;
+    image.bitmap.reset(sb.data_blocks);
+    image.refs.assign(sb.data_blocks, 0);
+    for (uint64_t i = 0; i < snap->entries.size(); ++i) {
+        if (!snap->entries[i].used) continue;
+        for (uint32_t k = 0; k < snap->entries[i].extent_count; ++k) {
+            const FileExtent &e = snap->extents[i * FS_MAX_EXTENTS + k];
+            for (uint64_t b = e.start; !is_hole(e) && b < e.start + e.count; ++b) {
+                if (image.bitmap.test(b)) image.refs[b]++;
+                else image.bitmap.set_range(b, 1);
+            }
+        }
+    }
 
-    close(fd_src);
-    close(fd_dst);
-    fs_log("BACKUP to " + backup_filename);
+    string temp = backup_filename + ".tmp";
+    int fd = open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    bool ok = fd >= 0 && ftruncate(fd, sb.volume_size) == 0;
+    if (fd >= 0) close(fd);
+    Device *dev = ok ? device_open(temp, false) : nullptr;
+    Journal journal;
+    journal.offset = sb.journal_offset;
+    journal.bytes = sb.journal_bytes;
+    journal.block_size = sb.block_size;
+    ok = dev && dev->write_at(0, &sb, sizeof(sb)) &&
+         dev->write_at(sb.entry_offset, snap->entries.data(), snap->entries.size() * sizeof(FileEntry)) &&
+         dev->write_at(sb.extent_offset, snap->extents.data(), snap->extents.size() * sizeof(FileExtent)) &&
+         dev->write_at(sb.bitmap_offset, image.bitmap.words.data(), (sb.data_blocks + 63) / 64 * 8) &&
+         dev->write_at(sb.refcount_offset, image.refs.data(), sb.data_blocks * sizeof(uint16_t)) &&
+         dev->write_at(sb.checksum_offset, image.sums.data(), sb.data_blocks * sizeof(uint32_t)) &&
+         journal_format(dev, journal);
+
+    // The data: runs of the blocks the snapshot holds, a piece at a time.
+    vector<char> buffer(FS_CHUNK_SIZE);
+    uint64_t copied = 0;
+    for (int64_t b = 0; ok && b < image.bitmap.nblocks;) {
+        if (!image.bitmap.test(b)) {
+            ++b;
+            continue;
+        }
+        int64_t end = b + 1;
+        while (end < image.bitmap.nblocks && image.bitmap.test(end)) ++end;
+        uint64_t offset = block_offset(fs, b), bytes = (end - b) * sb.block_size;
+        for (uint64_t done = 0; ok && done < bytes;) {
+            uint64_t n = min<uint64_t>(buffer.size(), bytes - done);
+            ok = fs->dev->read_at(offset + done, buffer.data(), n) && dev->write_at(offset + done, buffer.data(), n);
+            done += n;
+        }
+        copied += bytes;
+        b = end;
+    }
+    ok = ok && backup_install(dev->fd, temp, backup_filename);
+    delete dev;
+    if (!ok) {
+        unlink(temp.c_str());
+        return false;
+    }
+    fs_log("BACKUP_SNAPSHOT " + snapshot + " to " + backup_filename + " " + to_string(copied) + " bytes");
     return true;
 }
 
-bool fs_restore(const string &backup_filename) {
-    int fd_src = open(backup_filename.c_str(), O_RDONLY);
-    if(fd_src <= 0) return false;
-    
-    int fd_dst = open(DISK_NAME, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-    if(fd_dst <= 0) return false;
+// Extent k of the file in slot
+struct PlacedExtent {
+    uint64_t start;
+    uint64_t count;
+    uint64_t slot;
+    uint64_t k;
+
+    bool operator<(const PlacedExtent &other) const { return start < other.start; }
+};
+
+// Picks the next move that brings the used blocks closer to one run from
+// block 0, sets `used` to the length of that run, and returns false when
+// there is nothing left to gain. Extents reaching past the run go, largest
+// first, to the first hole inside it that takes them. When none fits, the
+// extent right after the first hole slides down into it, or, if it is
+// larger, moves out past the run so the hole grows by its blocks. Extents
+// sharing blocks, snapshots' ones among them, stay where they are.
+static bool plan_move(FsHandle *fs, PlacedExtent &move, uint64_t &to, uint64_t &used) {
+    const vector<FileEntry> &entries = fs->metadata.entries;
+    vector<PlacedExtent> extents;   // in disk order
+    used = fs->metadata.superblock.data_blocks - fs->metadata.bitmap.free_count();
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].used) continue;
+        for (uint64_t k = 0; k < entries[i].extent_count; ++k) {
+            const FileExtent &e = fs->metadata.extents[i * FS_MAX_EXTENTS + k];
+            if (!is_hole(e)) extents.push_back({e.start, e.count, i, k});
+        }
+    }
+    for (const auto &s : fs->snapshots) {
+        const Snapshot &snap = *s.second;
+        for (uint64_t i = 0; i < snap.entries.size(); ++i) {
+            for (uint64_t k = 0; snap.entries[i].used && k < snap.entries[i].extent_count; ++k) {
+                const FileExtent &e = snap.extents[i * FS_MAX_EXTENTS + k];
+                if (!is_hole(e)) extents.push_back({e.start, e.count, UINT64_MAX, k});
+            }
+        }
+    }
+    sort(extents.begin(), extents.end());
+
+    // Holes starting inside the run, and the largest extent any of them takes
+    vector<pair<uint64_t, uint64_t>> holes;     // (start, count)
+    uint64_t at = 0, fits = 0;
+    for (const PlacedExtent &e : extents) {
+        if (at >= used) break;
+        if (e.start > at) {
+            holes.push_back({at, e.start - at});
+            fits = max(fits, min(e.start - at, used - at));
+        }
+        at = max(at, e.start + e.count);
+    }
+    if (holes.empty()) return false;
 
-    char buffer[1024];
-    int bytes;
-    while ((bytes = read(fd_src, buffer, sizeof(buffer))) > 0)
-        write(fd_dst, buffer, bytes);
+    uint64_t best = 0;
+    for (const PlacedExtent &e : extents) {
+        if (e.start + e.count > used && e.count <= fits && e.count > best && !shared(fs, e.start, e.count)) {
+            best = e.count;
+            move = e;
+        }
+    }
+    if (best) {
+        for (const auto &h : holes) {
+            if (h.second >= best && h.first + best <= used) {
+                to = h.first;
+                return true;
+            }
+        }
+    }
 
-    close(fd_src);
-    close(fd_dst);
-    fs_log("RESTORE from " + backup_filename);
+    const auto &hole = holes[0];
+    auto next = lower_bound(extents.begin(), extents.end(), PlacedExtent{hole.first + hole.second, 0, 0, 0});
+    if (next == extents.end()) return false;
+    move = *next;
+    if (shared(fs, move.start, move.count)) return false;
+    if (move.count <= hole.second) {
+        to = hole.first;
+        return true;
+    }
+    if (used + move.count > fs->metadata.superblock.data_blocks) return false;
+    int64_t run = fs->metadata.bitmap.find_run(move.count, used);
+    if (run < (int64_t)used) return false;
+    to = run;
     return true;
 }
 
-void fs_defragment() {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) return;
-
-    int current_block = METADATA_SIZE / BLOCK_SIZE;
-    int fd = open(DISK_NAME, O_RDWR);
-
-    for (int i = 0; i < MAX_FILES; ++i) {
-        FileEntry &entry = metadata.entries[i];
-        if (entry.used && entry.start_block > current_block) {
-            char *buffer = new char[entry.size];
-            lseek(fd, METADATA_SIZE + entry.start_block * BLOCK_SIZE, SEEK_SET);
-            read(fd, buffer, entry.size);
+bool fs_defragment_step(FsHandle *fs, int max_ms) {
+    if (!usable(fs)) return true;
+    FsOpTimer timer(FS_OP_DEFRAG);
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(max_ms);
+    unique_lock<shared_mutex> meta(fs->meta_lock);
+    Metadata &metadata = fs->metadata;
+    Superblock &sb = metadata.superblock;
+
+    for (;;) {
+        if (!sb.defrag_slot) {
+            // Blocks freed since the last commit are still taken; settle them.
+            if (!fs->pending_free.empty() && !commit(fs, meta)) return true;
+            PlacedExtent move;
+            uint64_t to, used;
+            if (!plan_move(fs, move, to, used)) {
+                fs->alloc_hint = used;
+                return true;
+            }
+            if (!metadata.bitmap.range_free(to, move.count)) return true;
+            metadata.bitmap.set_range(to, move.count);
+            mark_changed(fs, block_offset(fs, to), move.count * sb.block_size);
+            sb.defrag_slot = move.slot + 1;
+            sb.defrag_extent = move.k;
+            sb.defrag_to = to;
+            sb.defrag_count = move.count;
+            sb.defrag_done = 0;
+            fs->sb_dirty = true;
+        }
 
-            entry.start_block = current_block;
-            lseek(fd, METADATA_SIZE + current_block * BLOCK_SIZE, SEEK_SET);
-            write(fd, buffer, entry.size);
+        uint64_t slot = sb.defrag_slot - 1;
+        string name = entry_path(fs, slot);
+        meta.unlock();
+        unique_lock<shared_mutex> file(file_lock(fs, name));
+        meta.lock();
+        // The file may have changed or moved before its lock was ours.
+        if (sb.defrag_slot != slot + 1 || name != entry_path(fs, slot)) continue;
+
+        FileExtent &extent = extent_row(metadata, slot)[sb.defrag_extent];
+        uint64_t from = block_offset(fs, extent.start);
+        uint64_t to = block_offset(fs, sb.defrag_to);
+        uint64_t size = sb.defrag_count * sb.block_size;
+        uint64_t done = sb.defrag_done;
+        meta.unlock();
+
+        // Copy piece by piece until the move is done or the time is up.
+        bool ok = true;
+        while (ok && done < size) {
+            uint64_t n = min<uint64_t>(FS_CHUNK_SIZE, size - done);
+            ok = copy_range(fs, from + done, to + done, n);
+            if (ok) done += n;
+            if (chrono::steady_clock::now() >= deadline) break;
+        }
 
-            delete[] buffer;
-            current_block += (entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        } else if (entry.used) {
-            current_block = max(current_block, entry.start_block + (entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        meta.lock();
+        if (!ok) {
+            touch_entry(fs, slot);
+            commit(fs, meta);
+            return true;
+        }
+        sb.defrag_done = done;
+        fs->sb_dirty = true;
+        bool moved = false;
+        if (done == size && shared(fs, extent.start, sb.defrag_count)) {
+            // Copied meanwhile: the blocks now belong to more than this file.
+            touch_entry(fs, slot);
+        } else if (done == size) {
+            vector<uint32_t> &sums = metadata.sums;
+            copy(sums.begin() + extent.start, sums.begin() + extent.start + sb.defrag_count,
+                 sums.begin() + sb.defrag_to);
+            touch_sums(fs, sb.defrag_to, sb.defrag_count);
+            free_blocks(fs, extent.start, sb.defrag_count);
+            extent.start = sb.defrag_to;
+            FileMap map;
+            get_map(fs, slot, map);
+            set_extents(fs, slot, map.extents);
+            sb.defrag_slot = 0;
+            touch_entry(fs, slot);
+            moved = true;
         }
+        // Either the move is finished or how far it got is on disk.
+        commit(fs, meta);
+        if (moved) fs_log("DEFRAG_MOVE " + name);
+        if (chrono::steady_clock::now() >= deadline) return false;
     }
+}
 
-    fs_save_metadata(metadata);
-    close(fd);
+void fs_defragment(FsHandle *fs) {
+    if (!usable(fs)) return;
+    while (!fs_defragment_step(fs, 50)) {}
     fs_log("DEFRAGMENT");
 }
 
-void fs_check_integrity() {
-    Metadata metadata;
-    if (!fs_load_metadata(metadata)) {
+// Part of a file the scrub checks in one go
+struct ScrubPiece {
+    const Snapshot *snap;   // holding the file, nullptr for a live one
+    uint64_t slot;
+    uint64_t first;     // block of the file
+    uint64_t count;
+};
+
+#define SCRUB_PIECE (4 << 20)
+
+// Reads the pieces back on `threads` threads and returns the (piece, block
+// of the file) of every block that does not match its checksum. Called with
+// the Metadata held still.
+static vector<pair<size_t, uint64_t>> scrub_data(FsHandle *fs, const vector<ScrubPiece> &pieces, int threads) {
+    const Metadata &metadata = fs->metadata;
+    uint64_t bs = metadata.superblock.block_size;
+    vector<pair<size_t, uint64_t>> bad;
+    mutex bad_lock;
+    atomic<size_t> next(0);
+
+    auto scan = [&]() {
+        for (size_t k; (k = next++) < pieces.size();) {
+            const ScrubPiece &piece = pieces[k];
+            FileMap map;
+            if (piece.snap) map_in(piece.snap->entries, piece.snap->extents, piece.slot, map);
+            else get_map(fs, piece.slot, map);
+            uint64_t from = piece.first * bs, to = min(map.entry.size, (piece.first + piece.count) * bs);
+            BlockSummer summer(bs);
+            bool ok = stream_file(fs, map.extents, from, to - from, [&](const char *data, int64_t n) {
+                summer.add(data, n);
+                return true;
+            });
+            summer.finish();
+            vector<FileExtent> blocks = slice_extents(map.extents, piece.first, piece.first + piece.count);
+            BlockCursor cursor(blocks);
+            for (uint64_t b = 0; b < piece.count; ++b) {
+                uint64_t block = cursor.next();
+                if (ok && (block == FS_HOLE || summer.sums[b] == metadata.sums[block])) continue;
+                lock_guard<mutex> guard(bad_lock);
+                bad.push_back({k, piece.first + b});
+            }
+        }
+    };
+
+    unsigned n = threads > 0 ? threads : max(1u, thread::hardware_concurrency());
+    n = min<size_t>(n, pieces.size());
+    vector<thread> pool;
+    for (unsigned t = 1; t < n; ++t) pool.emplace_back(scan);
+    scan();
+    for (thread &t : pool) t.join();
+    sort(bad.begin(), bad.end());
+    return bad;
+}
+
+bool fs_check_integrity(FsHandle *fs, int threads) {
+    if (!usable(fs)) {
         cerr << "Metadata okunamadı.\n";
-        return;
+        return false;
     }
-
+    FsOpTimer timer(FS_OP_CHECK);
+    AllFilesLock files(fs, false);
+    shared_lock<shared_mutex> meta(fs->meta_lock);
+    const Metadata &metadata = fs->metadata;
+    const vector<FileEntry> &entries = metadata.entries;
     bool overlap = false;
-    for (int i = 0; i < MAX_FILES; ++i) {
-        for (int j = i + 1; j < MAX_FILES; ++j) {
-            if (metadata.entries[i].used && metadata.entries[j].used) {
-                int start1 = metadata.entries[i].start_block;
-                int end1 = start1 + (metadata.entries[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-                int start2 = metadata.entries[j].start_block;
-                int end2 = start2 + (metadata.entries[j].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-                if (max(start1, start2) < min(end1, end2)) {
-                    cerr << "Uyarı: '" << metadata.entries[i].filename
-                         << "' ve '" << metadata.entries[j].filename << "' blok çakışması içeriyor.\n";
-                    overlap = true;
-                }
+
+    // Extents in disk order. Each one is checked against the extent before
+    // it that reaches furthest, which finds every overlap in one sweep.
+    vector<PlacedExtent> extents;
+    vector<uint64_t> holders;   // slots holding blocks
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].used) continue;
+        if (!extents_valid(fs, i)) {
+            cerr << "Uyarı: '" << entries[i].filename << "' disk sınırlarının dışına taşıyor.\n";
+            overlap = true;
+        } else if (entries[i].size > 0) {
+            holders.push_back(i);
+            for (uint64_t k = 0; k < entries[i].extent_count; ++k) {
+                const FileExtent &e = metadata.extents[i * FS_MAX_EXTENTS + k];
+                if (!is_hole(e)) extents.push_back({e.start, e.count, i, k});
+            }
+        }
+    }
+    sort(extents.begin(), extents.end());
+    uint64_t reach = 0, owner = 0;
+    for (const PlacedExtent &e : extents) {
+        uint64_t end = e.start + e.count;
+        if (e.start < reach) {
+            // Blocks counted as shared may belong to more than one extent.
+            bool counted = true;
+            for (uint64_t b = e.start; counted && b < min(end, reach); ++b) counted = metadata.refs[b] > 0;
+            if (!counted) {
+                cerr << "Uyarı: '" << entries[owner].filename
+                     << "' ve '" << entries[e.slot].filename << "' blok çakışması içeriyor.\n";
+                overlap = true;
+            }
+        }
+        if (end > reach) {
+            reach = end;
+            owner = e.slot;
+        }
+    }
+
+    BlockBitmap expected;
+    expected.reset(metadata.superblock.data_blocks);
+    vector<int64_t> users(metadata.superblock.data_blocks + 1, 0);   // as differences
+    for (const PlacedExtent &e : extents) {
+        expected.set_range(e.start, e.count);
+        users[e.start]++;
+        users[e.start + e.count]--;
+    }
+    int64_t count = 0;
+    for (uint64_t b = 0; b < metadata.refs.size(); ++b) {
+        count += users[b];
+        if (metadata.refs[b] != max<int64_t>(count - 1, 0)) {
+            cerr << "Uyarı: blok referans sayıları dosya tablosuyla uyuşmuyor.\n";
+            overlap = true;
+            break;
+        }
+    }
+    // held by snapshots
+    for (size_t w = 0; w < expected.words.size(); ++w) expected.words[w] |= fs->frozen.words[w];
+    // freed, but not committed yet
+    for (const auto &f : fs->pending_free) expected.set_range(f.first, f.second);
+    // where the defragmenter is moving a file
+    if (metadata.superblock.defrag_slot)
+        expected.set_range(metadata.superblock.defrag_to, metadata.superblock.defrag_count);
+    if (expected.words != metadata.bitmap.words) {
+        cerr << "Uyarı: blok bitmap'i dosya tablosuyla uyuşmuyor.\n";
+        overlap = true;
+    }
+
+    // Files sharing all their blocks, in the live tables or a snapshot's,
+    // are read once, the rest in pieces.
+    map<const Snapshot *, string> sources{{nullptr, ""}};
+    for (const auto &s : fs->snapshots) sources[s.second.get()] = s.first + ":";
+    vector<pair<vector<uint64_t>, pair<const Snapshot *, uint64_t>>> layouts;    // (size and extents, file)
+    for (const auto &source : sources) {
+        const Snapshot *snap = source.first;
+        const vector<FileEntry> &table = snap ? snap->entries : entries;
+        const vector<FileExtent> &rows = snap ? snap->extents : metadata.extents;
+        for (uint64_t slot = 0; slot < table.size(); ++slot) {
+            if (!table[slot].used || !table[slot].size) continue;
+            if (!snap && !binary_search(holders.begin(), holders.end(), slot)) continue;
+            vector<uint64_t> layout{table[slot].size};
+            for (uint64_t k = 0; k < table[slot].extent_count; ++k) {
+                const FileExtent &e = rows[slot * FS_MAX_EXTENTS + k];
+                layout.insert(layout.end(), {e.start, e.count});
             }
+            layouts.push_back({layout, {snap, slot}});
         }
     }
+    sort(layouts.begin(), layouts.end());
+    vector<ScrubPiece> pieces;
+    uint64_t per_piece = max<uint64_t>(1, SCRUB_PIECE / metadata.superblock.block_size);
+    for (size_t k = 0; k < layouts.size(); ++k) {
+        const Snapshot *snap = layouts[k].second.first;
+        uint64_t slot = layouts[k].second.second;
+        if (k > 0 && layouts[k - 1].first == layouts[k].first) continue;
+        uint64_t blocks = blocks_for(fs, layouts[k].first[0]);
+        for (uint64_t first = 0; first < blocks; first += per_piece)
+            pieces.push_back({snap, slot, first, min(per_piece, blocks - first)});
+    }
+    vector<pair<size_t, uint64_t>> bad = scrub_data(fs, pieces, threads);
+    for (size_t a = 0; a < bad.size();) {
+        const ScrubPiece &piece = pieces[bad[a].first];
+        size_t b = a;
+        while (b < bad.size() && pieces[bad[b].first].snap == piece.snap && pieces[bad[b].first].slot == piece.slot) ++b;
+        string name = sources[piece.snap] + path_in(piece.snap ? piece.snap->entries : entries, piece.slot);
+        cerr << "Uyarı: '" << name << "' dosyasında " << b - a
+             << " blok sağlama toplamıyla uyuşmuyor (ilki: " << bad[a].second << ". blok).\n";
+        overlap = true;
+        a = b;
+    }
 
     if (!overlap) cout << "Tüm dosyalar bütünlüğünü koruyor.\n";
-    fs_log("CHECK_INTEGRITY");
+    fs_log("CHECK_INTEGRITY", FS_LOG_DEBUG);
+    return !overlap;
 }
 
+bool fs_load_metadata(Metadata &metadata) { return fs_load_metadata(fs_default(), metadata); }
+bool fs_save_metadata(const Metadata &metadata) { return fs_save_metadata(fs_default(), metadata); }
+bool fs_create(const string &filename) { return fs_create(fs_default(), filename); }
+bool fs_delete(const string &filename) { return fs_delete(fs_default(), filename); }
+bool fs_write(const string &filename, const char *data, int64_t size) { return fs_write(fs_default(), filename, data, size); }
+bool fs_read(const string &filename, int64_t offset, int64_t size, char *buffer) { return fs_read(fs_default(), filename, offset, size, buffer); }
+bool fs_write_at(const string &filename, int64_t offset, const char *data, int64_t size) { return fs_write_at(fs_default(), filename, offset, data, size); }
+int64_t fs_read_at(const string &filename, int64_t offset, char *buffer, int64_t size) { return fs_read_at(fs_default(), filename, offset, buffer, size); }
+bool fs_write_chunks(const string &filename, int64_t size, const FsFillFn &fill) { return fs_write_chunks(fs_default(), filename, size, fill); }
+bool fs_read_chunks(const string &filename, int64_t offset, int64_t size, const FsChunkFn &fn) { return fs_read_chunks(fs_default(), filename, offset, size, fn); }
+void fs_ls() { fs_ls(fs_default()); }
+void fs_ls(const string &path) { fs_ls(fs_default(), path); }
+bool fs_mkdir(const string &path) { return fs_mkdir(fs_default(), path); }
+bool fs_rmdir(const string &path) { return fs_rmdir(fs_default(), path); }
+bool fs_rename(const string &old_name, const string &new_name) { return fs_rename(fs_default(), old_name, new_name); }
+bool fs_exists(const string &filename) { return fs_exists(fs_default(), filename); }
+int64_t fs_size(const string &filename) { return fs_size(fs_default(), filename); }
+bool fs_append(const string &filename, const char *data, int64_t size) { return fs_append(fs_default(), filename, data, size); }
+bool fs_truncate(const string &filename, int64_t new_size) { return fs_truncate(fs_default(), filename, new_size); }
+bool fs_punch_hole(const string &filename, int64_t offset, int64_t length) { return fs_punch_hole(fs_default(), filename, offset, length); }
+bool fs_set_codec(const string &filename, FsCodec codec) { return fs_set_codec(fs_default(), filename, codec); }
+bool fs_copy(const string &src_filename, const string &dest_filename) { return fs_copy(fs_default(), src_filename, dest_filename); }
+bool fs_mv(const string &old_name, const string &new_name) { return fs_mv(fs_default(), old_name, new_name); }
+void fs_defragment() { fs_defragment(fs_default()); }
+bool fs_defragment_step(int max_ms) { return fs_defragment_step(fs_default(), max_ms); }
+bool fs_check_integrity() { return fs_check_integrity(fs_default()); }
+bool fs_backup(const string &backup_filename) { return fs_backup(fs_default(), backup_filename); }
+bool fs_backup_incremental(const string &backup_filename) { return fs_backup_incremental(fs_default(), backup_filename); }
+bool fs_restore(const string &backup_filename) { return fs_restore_chain(vector<string>{backup_filename}); }
+bool fs_restore_chain(const vector<string> &backup_filenames) {
+    if (fs_default()) return fs_restore_chain(fs_default(), backup_filenames);
+
+    // No mountable image yet: put the restored one in place and mount it later.
+    if (!install_image(backup_filenames, DISK_NAME, 0)) return false;
+    fs_log("RESTORE from " + backup_filenames.back());
+    return true;
+}
+void fs_cat(const string &filename) { fs_cat(fs_default(), filename); }
+bool fs_diff(const string &file1, const string &file2) { return fs_diff(fs_default(), file1, file2); }
+bool fs_diff_report(const string &file1, const string &file2, FsDiffReport &report) { return fs_diff_report(fs_default(), file1, file2, report); }
+bool fs_snapshot_create(const string &name) { return fs_snapshot_create(fs_default(), name); }
+bool fs_snapshot_delete(const string &name) { return fs_snapshot_delete(fs_default(), name); }
+bool fs_snapshot_list(vector<FsSnapshotInfo> &snapshots) { return fs_snapshot_list(fs_default(), snapshots); }
+int64_t fs_snapshot_size(const string &snapshot, const string &filename) { return fs_snapshot_size(fs_default(), snapshot, filename); }
+int64_t fs_snapshot_read(const string &snapshot, const string &filename, int64_t offset, char *buffer, int64_t size) { return fs_snapshot_read(fs_default(), snapshot, filename, offset, buffer, size); }
+bool fs_snapshot_diff(const string &from, const string &to, vector<FsSnapshotChange> &changes) { return fs_snapshot_diff(fs_default(), from, to, changes); }
+bool fs_snapshot_rollback(const string &name) { return fs_snapshot_rollback(fs_default(), name); }
+bool fs_backup_snapshot(const string &snapshot, const string &backup_filename) { return fs_backup_snapshot(fs_default(), snapshot, backup_filename); }
+bool fs_import_tree(const string &host_dir, const string &path) { return fs_import_tree(fs_default(), host_dir, path); }
+bool fs_export_tree(const string &path, const string &host_dir) { return fs_export_tree(fs_default(), path, host_dir); }
@@ -0,0 +1,81 @@
+#include "../include/fs_async.h"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct FsAsync {
+    FsHandle *fs;
+    mutex lock;
+    condition_variable ready;
+    deque<function<void()>> queue;
+    bool stopping = false;
+    vector<thread> workers;
+};
+
+static void work(FsAsync *async) {
+    for (;;) {
+        function<void()> call;
+        {
+            unique_lock<mutex> guard(async->lock);
+            async->ready.wait(guard, [&] { return async->stopping || !async->queue.empty(); });
+            if (async->queue.empty()) return;
+            call = move(async->queue.front());
+            async->queue.pop_front();
+        }
+        call();
+    }
+}
+
+FsAsync *fs_async_start(FsHandle *fs, int queue_depth) {
+    if (!fs || queue_depth < 1) return nullptr;
+    FsAsync *async = new FsAsync;
+    async->fs = fs;
+    for (int t = 0; t < queue_depth; ++t) async->workers.emplace_back(work, async);
+    return async;
+}
+
+void fs_async_stop(FsAsync *async) {
+    if (!async) return;
+    {
+        lock_guard<mutex> guard(async->lock);
+        async->stopping = true;
+    }
+    async->ready.notify_all();
+    for (thread &t : async->workers) t.join();
+    delete async;
+}
+
+// Queues call and returns the future of its result.
+template <typename T>
+static future<T> enqueue(FsAsync *async, function<T(FsHandle *fs)> call) {
+    auto task = make_shared<packaged_task<T()>>(bind(move(call), async->fs));
+    future<T> result = task->get_future();
+    {
+        lock_guard<mutex> guard(async->lock);
+        async->queue.push_back([task] { (*task)(); });
+    }
+    async->ready.notify_one();
+    return result;
+}
+
+future<int64_t> fs_read_async(FsAsync *async, const string &filename, int64_t offset, char *buffer, int64_t size) {
+    return enqueue<int64_t>(async, [=](FsHandle *fs) { return fs_read_at(fs, filename, offset, buffer, size); });
+}
+
+future<bool> fs_write_async(FsAsync *async, const string &filename, int64_t offset, const char *data, int64_t size) {
+    return enqueue<bool>(async, [=](FsHandle *fs) { return fs_write_at(fs, filename, offset, data, size); });
+}
+
+future<bool> fs_append_async(FsAsync *async, const string &filename, const char *data, int64_t size) {
+    return enqueue<bool>(async, [=](FsHandle *fs) { return fs_append(fs, filename, data, size); });
+}
+
+future<bool> fs_copy_async(FsAsync *async, const string &src_filename, const string &dest_filename) {
+    return enqueue<bool>(async, [=](FsHandle *fs) { return fs_copy(fs, src_filename, dest_filename); });
+}
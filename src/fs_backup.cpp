@@ -0,0 +1,225 @@
+#include "../include/fs_backup.h"
+#include "../include/fs_crc.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Piece the blocks of an increment are moved in
+#define BACKUP_BUFFER (1 << 20)
+// Range of a whole-image copy one thread takes at a time
+#define BACKUP_STRIPE (16 << 20)
+
+struct ChangesHeader {
+    char magic[8];
+    uint64_t id;
+    uint64_t blocks;
+    uint32_t crc;       // of the bitmap words
+    uint32_t unused;
+};
+
+static bool read_full(int fd, void *buffer, uint64_t length, uint64_t offset) {
+    char *p = static_cast<char *>(buffer);
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *data, uint64_t length, uint64_t offset) {
+    const char *p = static_cast<const char *>(data);
+    while (length > 0) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool backup_parallel(size_t count, int threads, const function<bool(size_t)> &fn) {
+    size_t n = threads > 0 ? threads : max(1u, thread::hardware_concurrency());
+    n = min(n, count);
+    atomic<size_t> next(0);
+    atomic<bool> ok(true);
+    auto work = [&] {
+        for (size_t k; ok && (k = next++) < count;)
+            if (!fn(k)) ok = false;
+    };
+    vector<thread> pool;
+    for (size_t t = 1; t < n; ++t) pool.emplace_back(work);
+    work();
+    for (thread &t : pool) t.join();
+    return ok;
+}
+
+// Copies [offset, offset + bytes) of fd_src to the same place in fd_dst.
+static bool copy_stripe(int fd_src, int fd_dst, uint64_t offset, uint64_t bytes) {
+    loff_t in = offset, out = offset, end = offset + bytes;
+    while (in < end) {
+        ssize_t n = copy_file_range(fd_src, &in, fd_dst, &out, end - in, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) continue;
+        if (n == 0) return false;
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) return false;
+
+        // Not supported between these files: copy the rest through a buffer.
+        vector<char> buffer(min<uint64_t>(BACKUP_BUFFER, end - in));
+        while (in < end) {
+            uint64_t piece = min<uint64_t>(buffer.size(), end - in);
+            if (!read_full(fd_src, buffer.data(), piece, in) || !write_full(fd_dst, buffer.data(), piece, out))
+                return false;
+            in += piece;
+            out += piece;
+        }
+    }
+    return true;
+}
+
+bool backup_copy(int fd_src, int fd_dst, uint64_t bytes, int threads) {
+    // Sized up front, so the threads only write inside it.
+    if (ftruncate(fd_dst, bytes) != 0) return false;
+    return backup_parallel((bytes + BACKUP_STRIPE - 1) / BACKUP_STRIPE, threads, [&](size_t k) {
+        uint64_t from = (uint64_t)k * BACKUP_STRIPE;
+        return copy_stripe(fd_src, fd_dst, from, min<uint64_t>(BACKUP_STRIPE, bytes - from));
+    });
+}
+
+// Calls fn(first, count) for each run of consecutive block numbers in
+// blocks[from, to).
+template <typename Fn>
+static bool for_each_run(const vector<uint64_t> &blocks, size_t from, size_t to, Fn fn) {
+    for (size_t a = from; a < to;) {
+        size_t b = a + 1;
+        while (b < to && blocks[b] == blocks[b - 1] + 1) ++b;
+        if (!fn(a, b - a)) return false;
+        a = b;
+    }
+    return true;
+}
+
+bool backup_write_increment(Device *dev, int fd, IncrementHeader header, const vector<uint64_t> &blocks,
+                            int threads) {
+    uint64_t bs = header.block_size;
+    uint64_t per_piece = max<uint64_t>(1, BACKUP_BUFFER / bs);
+    vector<ManifestEntry> manifest(blocks.size());
+    uint64_t data_at = sizeof(header) + manifest.size() * sizeof(ManifestEntry);
+
+    bool ok = backup_parallel((blocks.size() + per_piece - 1) / per_piece, threads, [&](size_t piece) {
+        size_t at = piece * per_piece, end = min<size_t>(blocks.size(), at + per_piece);
+        vector<char> buffer((end - at) * bs);
+        bool read = for_each_run(blocks, at, end, [&](size_t first, size_t count) {
+            return dev->read_at(blocks[first] * bs, &buffer[(first - at) * bs], count * bs);
+        });
+        if (!read) return false;
+        for (size_t k = at; k < end; ++k) {
+            manifest[k].block = blocks[k];
+            manifest[k].crc = crc32c(0, &buffer[(k - at) * bs], bs);
+            manifest[k].unused = 0;
+        }
+        return write_full(fd, buffer.data(), buffer.size(), data_at + at * bs);
+    });
+    if (!ok) return false;
+
+    memcpy(header.magic, INCREMENT_MAGIC, sizeof(header.magic));
+    header.blocks = blocks.size();
+    header.manifest_crc = crc32c(0, manifest.data(), manifest.size() * sizeof(ManifestEntry));
+    header.unused = 0;
+    header.crc = crc32c(0, &header, offsetof(IncrementHeader, crc));
+    return write_full(fd, manifest.data(), manifest.size() * sizeof(ManifestEntry), sizeof(header)) &&
+           write_full(fd, &header, sizeof(header), 0);
+}
+
+bool backup_read_header(int fd, IncrementHeader &header) {
+    return read_full(fd, &header, sizeof(header), 0) &&
+           memcmp(header.magic, INCREMENT_MAGIC, sizeof(header.magic)) == 0 &&
+           header.crc == crc32c(0, &header, offsetof(IncrementHeader, crc)) &&
+           header.block_size > 0 && header.blocks <= header.volume_size / header.block_size;
+}
+
+bool backup_apply_increment(int fd, const IncrementHeader &header, int fd_image, int threads) {
+    uint64_t bs = header.block_size;
+    vector<ManifestEntry> manifest(header.blocks);
+    if (!read_full(fd, manifest.data(), manifest.size() * sizeof(ManifestEntry), sizeof(header)) ||
+        crc32c(0, manifest.data(), manifest.size() * sizeof(ManifestEntry)) != header.manifest_crc)
+        return false;
+
+    vector<uint64_t> blocks(manifest.size());
+    for (size_t k = 0; k < manifest.size(); ++k) {
+        blocks[k] = manifest[k].block;
+        if (blocks[k] >= header.volume_size / bs || (k > 0 && blocks[k] <= blocks[k - 1])) return false;
+    }
+
+    uint64_t per_piece = max<uint64_t>(1, BACKUP_BUFFER / bs);
+    uint64_t data_at = sizeof(header) + manifest.size() * sizeof(ManifestEntry);
+    return backup_parallel((blocks.size() + per_piece - 1) / per_piece, threads, [&](size_t piece) {
+        size_t at = piece * per_piece, end = min<size_t>(blocks.size(), at + per_piece);
+        vector<char> buffer((end - at) * bs);
+        if (!read_full(fd, buffer.data(), buffer.size(), data_at + at * bs)) return false;
+        for (size_t k = at; k < end; ++k)
+            if (crc32c(0, &buffer[(k - at) * bs], bs) != manifest[k].crc) return false;
+        return for_each_run(blocks, at, end, [&](size_t first, size_t count) {
+            return write_full(fd_image, &buffer[(first - at) * bs], count * bs, blocks[first] * bs);
+        });
+    });
+}
+
+bool backup_install(int fd, const string &temp, const string &path) {
+    if (fdatasync(fd) != 0 || rename(temp.c_str(), path.c_str()) != 0) return false;
+
+    size_t slash = path.find_last_of('/');
+    string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+    int fd_dir = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd_dir >= 0) {
+        fsync(fd_dir);
+        close(fd_dir);
+    }
+    return true;
+}
+
+bool backup_load_changes(const string &path, uint64_t id, BlockBitmap &changed) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    ChangesHeader header;
+    vector<uint64_t> words(changed.words.size());
+    bool ok = read_full(fd, &header, sizeof(header), 0) &&
+              memcmp(header.magic, CHANGES_MAGIC, sizeof(header.magic)) == 0 &&
+              header.id == id && header.blocks == (uint64_t)changed.nblocks &&
+              read_full(fd, words.data(), words.size() * sizeof(uint64_t), sizeof(header)) &&
+              header.crc == crc32c(0, words.data(), words.size() * sizeof(uint64_t));
+    close(fd);
+    if (ok) changed.words = words;
+    return ok;
+}
+
+bool backup_save_changes(const string &path, uint64_t id, const BlockBitmap &changed) {
+    string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd < 0) return false;
+    ChangesHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHANGES_MAGIC, sizeof(header.magic));
+    header.id = id;
+    header.blocks = changed.nblocks;
+    header.crc = crc32c(0, changed.words.data(), changed.words.size() * sizeof(uint64_t));
+    bool ok = write_full(fd, &header, sizeof(header), 0) &&
+              write_full(fd, changed.words.data(), changed.words.size() * sizeof(uint64_t), sizeof(header)) &&
+              backup_install(fd, temp, path);
+    close(fd);
+    if (!ok) unlink(temp.c_str());
+    return ok;
+}
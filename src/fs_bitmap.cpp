@@ -0,0 +1,143 @@
+#include "../include/fs_bitmap.h"
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+static uint64_t word_mask(int64_t from, int64_t to) {
+    // bits [from, to) of one word, 0 <= from < to <= 64
+    uint64_t high = to == 64 ? ~0ull : ((1ull << to) - 1);
+    return high & ~((1ull << from) - 1);
+}
+
+static void widen(int64_t &lo, int64_t &hi, int64_t w) {
+    if (lo == hi) {
+        lo = w;
+        hi = w + 1;
+    } else {
+        lo = min(lo, w);
+        hi = max(hi, w + 1);
+    }
+}
+
+void BlockBitmap::reset(int64_t blocks) {
+    nblocks = blocks;
+    words.assign((blocks + 63) / 64, 0);
+    if (blocks % 64)
+        words.back() = ~0ull << (blocks % 64);
+    clean();
+}
+
+void BlockBitmap::load(const unsigned char *bytes, int64_t blocks) {
+    reset(blocks);
+    uint64_t tail = words.empty() ? 0 : words.back();
+    memcpy(words.data(), bytes, words.size() * sizeof(uint64_t));
+    if (!words.empty()) words.back() |= tail;
+}
+
+void BlockBitmap::mark_all_dirty() {
+    dirty_lo = 0;
+    dirty_hi = words.size();
+}
+
+void BlockBitmap::clean() {
+    dirty_lo = dirty_hi = 0;
+}
+
+bool BlockBitmap::test(int64_t block) const {
+    return (words[block / 64] >> (block % 64)) & 1;
+}
+
+bool BlockBitmap::range_free(int64_t start, int64_t count) const {
+    if (start < 0 || count < 0 || start + count > nblocks) return false;
+    int64_t end = start + count;
+    while (start < end) {
+        int64_t w = start / 64, from = start % 64;
+        int64_t to = min<int64_t>(64, from + (end - start));
+        if (words[w] & word_mask(from, to)) return false;
+        start += to - from;
+    }
+    return true;
+}
+
+void BlockBitmap::set_range(int64_t start, int64_t count) {
+    int64_t end = start + count;
+    while (start < end) {
+        int64_t w = start / 64, from = start % 64;
+        int64_t to = min<int64_t>(64, from + (end - start));
+        words[w] |= word_mask(from, to);
+        widen(dirty_lo, dirty_hi, w);
+        start += to - from;
+    }
+}
+
+void BlockBitmap::clear_range(int64_t start, int64_t count) {
+    int64_t end = start + count;
+    while (start < end) {
+        int64_t w = start / 64, from = start % 64;
+        int64_t to = min<int64_t>(64, from + (end - start));
+        words[w] &= ~word_mask(from, to);
+        widen(dirty_lo, dirty_hi, w);
+        start += to - from;
+    }
+}
+
+int64_t BlockBitmap::find_run(int64_t count, int64_t hint) const {
+    if (count <= 0) return hint;
+    if (hint < 0 || hint >= nblocks) hint = 0;
+
+    int64_t run_start = 0, run_len = 0;
+    for (size_t w = hint / 64; w < words.size(); ++w) {
+        uint64_t word = words[w];
+        int bit = 0;
+        if (w == (size_t)(hint / 64)) {
+            // blocks before the hint count as used
+            bit = hint % 64;
+            word |= bit ? ((1ull << bit) - 1) : 0;
+        }
+
+        if (word == ~0ull) {
+            run_len = 0;
+            continue;
+        }
+        if (word == 0) {
+            if (run_len == 0) run_start = w * 64;
+            run_len += 64;
+            if (run_len >= count) return run_start;
+            continue;
+        }
+
+        while (bit < 64) {
+            uint64_t rest = word >> bit;
+            if (rest & 1) {
+                uint64_t inv = ~rest;
+                bit += inv ? __builtin_ctzll(inv) : 64 - bit;
+                run_len = 0;
+            } else {
+                int zeros = rest ? __builtin_ctzll(rest) : 64 - bit;
+                if (run_len == 0) run_start = w * 64 + bit;
+                run_len += zeros;
+                if (run_len >= count) return run_start;
+                bit += zeros;
+            }
+        }
+    }
+    return -1;
+}
+
+int64_t BlockBitmap::run_length(int64_t start) const {
+    int64_t at = start;
+    while (at < nblocks) {
+        int64_t w = at / 64, bit = at % 64;
+        uint64_t used = words[w] >> bit;
+        if (used) return min(nblocks, at + __builtin_ctzll(used)) - start;
+        at += 64 - bit;
+    }
+    return nblocks - start;
+}
+
+int64_t BlockBitmap::free_count() const {
+    int64_t used = 0;
+    for (uint64_t word : words) used += __builtin_popcountll(word);
+    return (int64_t)words.size() * 64 - used;
+}
@@ -0,0 +1,76 @@
+#include "../include/fs_compare.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+size_t mismatch_bytes(const unsigned char *a, const unsigned char *b, size_t at, size_t length) {
+    while (at < length && a[at] == b[at]) ++at;
+    return at;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so this needs no check.
+size_t mismatch_sse2(const void *pa, const void *pb, size_t length) {
+    const unsigned char *a = static_cast<const unsigned char *>(pa);
+    const unsigned char *b = static_cast<const unsigned char *>(pb);
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 16)), _mm_loadu_si128((const __m128i *)(b + i + 16)));
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 32)), _mm_loadu_si128((const __m128i *)(b + i + 32)));
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 48)), _mm_loadu_si128((const __m128i *)(b + i + 48)));
+        __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(all) != 0xffff) break;
+    }
+    // The 64 bytes holding the difference, or what is left, 16 at a time
+    for (; i + 16 <= length; i += 16) {
+        __m128i e = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        unsigned differ = _mm_movemask_epi8(e) ^ 0xffff;
+        if (differ) return i + __builtin_ctz(differ);
+    }
+    return mismatch_bytes(a, b, i, length);
+}
+
+__attribute__((target("avx2")))
+size_t mismatch_avx2(const void *pa, const void *pb, size_t length) {
+    const unsigned char *a = static_cast<const unsigned char *>(pa);
+    const unsigned char *b = static_cast<const unsigned char *>(pb);
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m256i e0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i e1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)), _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_and_si256(e0, e1)) != 0xffffffffu) break;
+    }
+    for (; i + 32 <= length; i += 32) {
+        __m256i e = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        unsigned differ = ~(unsigned)_mm256_movemask_epi8(e);
+        if (differ) return i + __builtin_ctz(differ);
+    }
+    return i + mismatch_sse2(a + i, b + i, length - i);
+}
+
+#endif
+
+typedef size_t (*MismatchFn)(const void *, const void *, size_t);
+
+MismatchFn pick_mismatch() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) return mismatch_avx2;
+    return mismatch_sse2;
+#else
+    return [](const void *a, const void *b, size_t length) {
+        return mismatch_bytes(static_cast<const unsigned char *>(a), static_cast<const unsigned char *>(b), 0, length);
+    };
+#endif
+}
+
+const MismatchFn mismatch_impl = pick_mismatch();
+
+}
+
+size_t first_mismatch(const void *a, const void *b, size_t length) {
+    return mismatch_impl(a, b, length);
+}
@@ -0,0 +1,178 @@
+#include "../include/fs_compress.h"
+#include <cstring>
+
+// Hash table of recent positions, 2^HASH_BITS slots
+#define HASH_BITS 14
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+// No match starts in the last bytes of the input; they end as literals.
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+
+namespace {
+
+uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash4(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Bytes p and ref have in common, p running up to end; 8 at a time.
+size_t common_length(const unsigned char *p, const unsigned char *ref, const unsigned char *end) {
+    const unsigned char *start = p;
+    while (p + 8 <= end) {
+        uint64_t diff = read64(p) ^ read64(ref);
+        if (diff) return p - start + (__builtin_ctzll(diff) >> 3);
+        p += 8;
+        ref += 8;
+    }
+    while (p < end && *p == *ref) {
+        ++p;
+        ++ref;
+    }
+    return p - start;
+}
+
+// Copies n bytes 8 at a time, so it writes up to 7 past dst + n; the
+// caller makes sure there is room. src may trail dst by 8 or more.
+void wild_copy(unsigned char *dst, const unsigned char *src, size_t n) {
+    unsigned char *end = dst + n;
+    do {
+        memcpy(dst, src, 8);
+        dst += 8;
+        src += 8;
+    } while (dst < end);
+}
+
+// Writes the rest of a length past the 15 held in the token.
+bool put_length(unsigned char *&op, unsigned char *end, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op == end) return false;
+        *op++ = 255;
+    }
+    if (op == end) return false;
+    *op++ = (unsigned char)length;
+    return true;
+}
+
+bool get_length(const unsigned char *&ip, const unsigned char *end, size_t &length) {
+    for (;;) {
+        if (ip == end) return false;
+        unsigned char b = *ip++;
+        length += b;
+        if (b != 255) return true;
+    }
+}
+
+// One sequence: literals [anchor, anchor + literals), then a match of
+// match bytes (0 for the closing sequence) offset back.
+bool put_sequence(unsigned char *&op, unsigned char *end, const unsigned char *anchor, size_t literals,
+                  size_t offset, size_t match) {
+    if (op == end) return false;
+    unsigned char *token = op++;
+    *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15 && !put_length(op, end, literals - 15)) return false;
+    if ((size_t)(end - op) < literals) return false;
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (!match) return true;
+
+    if (end - op < 2) return false;
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    size_t rest = match - MIN_MATCH;
+    *token |= rest < 15 ? rest : 15;
+    return rest < 15 || put_length(op, end, rest - 15);
+}
+
+}
+
+size_t lz_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+size_t lz_compress(const void *data, size_t length, void *out, size_t capacity) {
+    static thread_local uint32_t table[1 << HASH_BITS];    // position + 1, 0 for none
+    memset(table, 0, sizeof(table));
+    const unsigned char *in = static_cast<const unsigned char *>(data);
+    const unsigned char *ip = in, *anchor = in, *end = in + length;
+    const unsigned char *limit = length > MATCH_LIMIT ? end - MATCH_LIMIT : in;
+    unsigned char *op = static_cast<unsigned char *>(out), *oend = op + capacity;
+
+    // Misses make the search step grow, so data that does not compress
+    // goes by quickly.
+    unsigned misses = 0;
+    while (ip < limit) {
+        uint32_t seq = read32(ip);
+        uint32_t h = hash4(seq);
+        uint32_t prev = table[h];
+        table[h] = ip - in + 1;
+        const unsigned char *ref = in + prev - 1;
+        if (!prev || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+        while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+            --ip;
+            --ref;
+        }
+        const unsigned char *mp = ip + MIN_MATCH;
+        mp += common_length(mp, ref + MIN_MATCH, end - LAST_LITERALS);
+        if (!put_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip)) return 0;
+        ip = anchor = mp;
+        // the position before the match end seeds the table too
+        if (ip < limit) table[hash4(read32(ip - 2))] = ip - 2 - in + 1;
+    }
+    if (!put_sequence(op, oend, anchor, end - anchor, 0, 0)) return 0;
+    return op - static_cast<unsigned char *>(out);
+}
+
+bool lz_decompress(const void *data, size_t length, void *out, size_t out_length) {
+    const unsigned char *ip = static_cast<const unsigned char *>(data), *iend = ip + length;
+    unsigned char *begin = static_cast<unsigned char *>(out), *op = begin, *oend = op + out_length;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !get_length(ip, iend, literals)) return false;
+        if ((size_t)(iend - ip) < literals || (size_t)(oend - op) < literals) return false;
+        if ((size_t)(iend - ip) >= literals + 8 && (size_t)(oend - op) >= literals + 8) wild_copy(op, ip, literals);
+        else memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == iend || op == oend) break;
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(ip, iend, match)) return false;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - begin) || (size_t)(oend - op) < match) return false;
+        const unsigned char *from = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= match + 8) {
+            wild_copy(op, from, match);
+            op += match;
+        } else if (offset >= match) {
+            memcpy(op, from, match);
+            op += match;
+        } else {
+            // overlapping: repeats the last offset bytes
+            for (size_t k = 0; k < match; ++k) *op++ = from[k];
+        }
+    }
+    // zeros padding the input out to a block
+    for (; ip < iend; ++ip)
+        if (*ip) return false;
+    return op == oend;
+}
@@ -0,0 +1,138 @@
+#include "../include/fs_crc.h"
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+// The hardware version runs three streams of this many bytes side by side,
+// then once more with the short length for what is left.
+const size_t CRC_LONG = 8192;
+const size_t CRC_SHORT = 256;
+
+struct Crc32cTable {
+    uint32_t t[8][256];
+    // Moves a raw CRC state over CRC_LONG or CRC_SHORT zero bytes, a byte of
+    // the state at a time.
+    uint32_t long_shift[4][256];
+    uint32_t short_shift[4][256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+        build_shift(long_shift, CRC_LONG);
+        build_shift(short_shift, CRC_SHORT);
+    }
+
+    // Feeding zeros is linear in the state: shift each single bit once and
+    // combine those for every byte value.
+    void build_shift(uint32_t shift[4][256], size_t zeros) {
+        uint32_t bit[32];
+        for (int b = 0; b < 32; ++b) {
+            uint32_t c = 1u << b;
+            for (size_t n = 0; n < zeros; ++n) c = (c >> 8) ^ t[0][c & 0xff];
+            bit[b] = c;
+        }
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t v = 0; v < 256; ++v) {
+                uint32_t c = 0;
+                for (int b = 0; b < 8; ++b)
+                    if (v >> b & 1) c ^= bit[8 * k + b];
+                shift[k][v] = c;
+            }
+        }
+    }
+};
+
+const Crc32cTable table;
+
+#if defined(__x86_64__)
+
+uint32_t shift_state(const uint32_t shift[4][256], uint32_t c) {
+    return shift[0][c & 0xff] ^ shift[1][(c >> 8) & 0xff] ^ shift[2][(c >> 16) & 0xff] ^ shift[3][c >> 24];
+}
+
+uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Runs of 3 * lane bytes as three independent crc32 chains, so the
+// instruction's latency is hidden; the chains are joined by shifting.
+__attribute__((target("sse4.2")))
+uint64_t crc32c_lanes(uint64_t c0, const unsigned char *&p, size_t &length, size_t lane,
+                      const uint32_t shift[4][256]) {
+    while (length >= 3 * lane) {
+        uint64_t c1 = 0, c2 = 0;
+        for (const unsigned char *end = p + lane; p < end; p += 8) {
+            c0 = _mm_crc32_u64(c0, load64(p));
+            c1 = _mm_crc32_u64(c1, load64(p + lane));
+            c2 = _mm_crc32_u64(c2, load64(p + 2 * lane));
+        }
+        c0 = shift_state(shift, (uint32_t)c0) ^ c1;
+        c0 = shift_state(shift, (uint32_t)c0) ^ c2;
+        p += 2 * lane;
+        length -= 3 * lane;
+    }
+    return c0;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t c = ~crc;
+    for (; length && ((uintptr_t)p & 7); --length) c = _mm_crc32_u8((uint32_t)c, *p++);
+    c = crc32c_lanes(c, p, length, CRC_LONG, table.long_shift);
+    c = crc32c_lanes(c, p, length, CRC_SHORT, table.short_shift);
+    for (; length >= 8; length -= 8, p += 8) c = _mm_crc32_u64(c, load64(p));
+    for (; length; --length) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return ~(uint32_t)c;
+}
+
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t, const void *, size_t);
+
+Crc32cFn pick_crc32c() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) return crc32c_hw;
+#endif
+    return crc32c_sw;
+}
+
+const Crc32cFn crc32c_impl = pick_crc32c();
+
+}
+
+// Slicing-by-8: eight table lookups per 8 input bytes.
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    while (length >= 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = table.t[7][lo & 0xff] ^ table.t[6][(lo >> 8) & 0xff] ^
+              table.t[5][(lo >> 16) & 0xff] ^ table.t[4][lo >> 24] ^
+              table.t[3][hi & 0xff] ^ table.t[2][(hi >> 8) & 0xff] ^
+              table.t[1][(hi >> 16) & 0xff] ^ table.t[0][hi >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length--) crc = (crc >> 8) ^ table.t[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    return crc32c_impl(crc, data, length);
+}
+
+bool crc32c_hw_available() {
+    return crc32c_impl != crc32c_sw;
+}
@@ -0,0 +1,721 @@
+#include "../include/fs_device.h"
+#include "../include/fs_stats.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+#include <thread>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define URING_ENTRIES 256
+
+// Block cache geometry: pages of CACHE_PAGE bytes, in groups of CACHE_GROUP
+// consecutive pages that belong to the same one of CACHE_SHARDS shards.
+#define CACHE_PAGE 4096
+#define CACHE_GROUP 32
+#define CACHE_SHARDS 16
+#define CACHE_MIN_FRAMES (2 * CACHE_GROUP)   // per shard
+
+bool Device::writev_at(uint64_t offset, const iovec *iov, int count) {
+    for (int k = 0; k < count; ++k) {
+        if (!write_at(offset, iov[k].iov_base, iov[k].iov_len)) return false;
+        offset += iov[k].iov_len;
+    }
+    return true;
+}
+
+bool Device::submit(const IoSegment *segments, int count) {
+    for (int k = 0; k < count; ++k) {
+        const IoSegment &s = segments[k];
+        if (s.write) {
+            if (!writev_at(s.offset, s.iov, s.iovcnt)) return false;
+            continue;
+        }
+        uint64_t offset = s.offset;
+        for (int j = 0; j < s.iovcnt; ++j) {
+            if (!read_at(offset, s.iov[j].iov_base, s.iov[j].iov_len)) return false;
+            offset += s.iov[j].iov_len;
+        }
+    }
+    return true;
+}
+
+namespace {
+
+atomic<int64_t> crash_countdown(0);
+
+// Crash points for testing: dies without cleanup once the countdown set by
+// device_crash_after runs out.
+void crash_point() {
+    if (crash_countdown.load(memory_order_relaxed) > 0 && crash_countdown.fetch_sub(1) == 1)
+        _exit(86);
+}
+
+// preadv/pwritev until every byte of the iovecs has moved.
+bool transfer(int fd, bool write, uint64_t offset, iovec *iov, int count) {
+    while (count > 0) {
+        int batch = min(count, IOV_MAX);
+        ssize_t n = write ? pwritev(fd, iov, batch, offset) : preadv(fd, iov, batch, offset);
+        if (write)
+            stats_count_io(0, 1, 0, 0, max<ssize_t>(n, 0));
+        else
+            stats_count_io(1, 0, 0, max<ssize_t>(n, 0), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        offset += n;
+        while (count > 0 && (uint64_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+uint64_t segment_bytes(const IoSegment &s) {
+    uint64_t bytes = 0;
+    for (int j = 0; j < s.iovcnt; ++j) bytes += s.iov[j].iov_len;
+    return bytes;
+}
+
+// io_uring driven through the raw system calls. Threads fill the
+// submission queue under sq_lock and enter the kernel once per batch; a
+// thread of the ring's own reaps the completions and wakes them. No more
+// transfers are in flight than the completion queue holds, so it never
+// overflows.
+struct IoRing {
+    // Completions a batch is waiting for
+    struct Batch {
+        mutex lock;
+        condition_variable done;
+        int left = 0;
+        vector<int32_t> results;
+    };
+    // user_data of one submission; nullptr stops the reaper
+    struct Tag {
+        Batch *batch;
+        int index;
+    };
+
+    int ring_fd = -1;
+    unsigned sq_entries = 0, cq_entries = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    void *sq_map = MAP_FAILED, *cq_map = MAP_FAILED, *sqe_map = MAP_FAILED;
+    size_t sq_bytes = 0, cq_bytes = 0, sqe_bytes = 0;
+
+    mutex sq_lock;
+    condition_variable room;
+    unsigned in_flight = 0;
+    thread reaper;
+
+    ~IoRing() {
+        if (reaper.joinable()) {
+            {
+                lock_guard<mutex> guard(sq_lock);
+                io_uring_sqe *sqe = &sqes[*sq_tail & *sq_mask];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = IORING_OP_NOP;
+                sq_array[*sq_tail & *sq_mask] = *sq_tail & *sq_mask;
+                __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+                while (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0) < 0 && errno == EINTR) {}
+            }
+            reaper.join();
+        }
+        if (sqe_map != MAP_FAILED) munmap(sqe_map, sqe_bytes);
+        if (cq_map != MAP_FAILED && cq_map != sq_map) munmap(cq_map, cq_bytes);
+        if (sq_map != MAP_FAILED) munmap(sq_map, sq_bytes);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    bool setup(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring_fd < 0) return false;
+        sq_entries = p.sq_entries;
+        cq_entries = p.cq_entries;
+
+        sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) sq_bytes = cq_bytes = max(sq_bytes, cq_bytes);
+        sq_map = mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED) return false;
+        cq_map = (p.features & IORING_FEAT_SINGLE_MMAP)
+                     ? sq_map
+                     : mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED) return false;
+        sqe_bytes = p.sq_entries * sizeof(io_uring_sqe);
+        sqe_map = mmap(nullptr, sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqe_map == MAP_FAILED) return false;
+
+        char *sq = static_cast<char *>(sq_map), *cq = static_cast<char *>(cq_map);
+        sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        sqes = static_cast<io_uring_sqe *>(sqe_map);
+        reaper = thread([this] { reap(); });
+        return true;
+    }
+
+    void reap() {
+        for (bool stop = false; !stop;) {
+            // interrupted or not, whatever has completed is reaped
+            syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            unsigned head = *cq_head, tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            unsigned completed = 0;
+            for (; head != tail; ++head) {
+                const io_uring_cqe &cqe = cqes[head & *cq_mask];
+                Tag *tag = reinterpret_cast<Tag *>(cqe.user_data);
+                if (!tag) {
+                    stop = true;
+                    continue;
+                }
+                Batch *batch = tag->batch;
+                lock_guard<mutex> guard(batch->lock);
+                batch->results[tag->index] = cqe.res;
+                if (--batch->left == 0) batch->done.notify_one();
+                completed++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (completed) {
+                lock_guard<mutex> guard(sq_lock);
+                in_flight -= completed;
+                room.notify_all();
+            }
+        }
+    }
+
+    // Queues segments [first, first + n) and enters the kernel. Entries it
+    // could not hand over are taken back off the queue and counted as done
+    // with nothing moved. Called with sq_lock held.
+    void push(int fd, const IoSegment *segments, vector<Tag> &tags, int first, int n, Batch &batch) {
+        unsigned tail = *sq_tail;
+        for (int k = first; k < first + n; ++k) {
+            unsigned index = tail & *sq_mask;
+            io_uring_sqe *sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = segments[k].write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->off = segments[k].offset;
+            sqe->addr = reinterpret_cast<uint64_t>(segments[k].iov);
+            sqe->len = segments[k].iovcnt;
+            sqe->user_data = reinterpret_cast<uint64_t>(&tags[k]);
+            sq_array[index] = index;
+            ++tail;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        in_flight += n;
+        for (;;) {
+            long r = syscall(__NR_io_uring_enter, ring_fd, n, 0, 0, nullptr, 0);
+            if (r >= 0 || (errno != EINTR && errno != EAGAIN && errno != EBUSY)) break;
+        }
+        // The kernel only takes entries inside io_uring_enter, which only
+        // we call to submit while holding sq_lock.
+        unsigned taken = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned left = tail - taken;
+        if (left) {
+            __atomic_store_n(sq_tail, taken, __ATOMIC_RELEASE);
+            in_flight -= left;
+            lock_guard<mutex> guard(batch.lock);
+            batch.left -= left;
+        }
+    }
+
+    // Runs a batch: as few submissions as the queues allow, then waits for
+    // all of it. Returns the bytes each segment moved, or a negative errno.
+    vector<int32_t> run(int fd, const IoSegment *segments, int count) {
+        Batch batch;
+        batch.left = count;
+        batch.results.assign(count, 0);
+        vector<Tag> tags(count);
+        for (int k = 0; k < count; ++k) tags[k] = {&batch, k};
+
+        for (int first = 0; first < count;) {
+            unique_lock<mutex> guard(sq_lock);
+            room.wait(guard, [&] { return in_flight < cq_entries; });
+            int n = min<int>({count - first, (int)sq_entries, (int)(cq_entries - in_flight)});
+            push(fd, segments, tags, first, n, batch);
+            first += n;
+        }
+        unique_lock<mutex> guard(batch.lock);
+        batch.done.wait(guard, [&] { return batch.left == 0; });
+        return batch.results;
+    }
+};
+
+struct FileDevice : Device {
+    unique_ptr<IoRing> ring;
+
+    ~FileDevice() override {
+        ring.reset();
+        close(fd);
+    }
+
+    bool read_at(uint64_t offset, void *buffer, uint64_t length) override {
+        char *p = static_cast<char *>(buffer);
+        while (length > 0) {
+            ssize_t n = pread(fd, p, length, offset);
+            stats_count_io(1, 0, 0, max<ssize_t>(n, 0), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    bool write_at(uint64_t offset, const void *data, uint64_t length) override {
+        crash_point();
+        const char *p = static_cast<const char *>(data);
+        while (length > 0) {
+            ssize_t n = pwrite(fd, p, length, offset);
+            stats_count_io(0, 1, 0, 0, max<ssize_t>(n, 0));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    bool writev_at(uint64_t offset, const iovec *iov, int count) override {
+        crash_point();
+        vector<iovec> left(iov, iov + count);
+        return transfer(fd, true, offset, left.data(), count);
+    }
+
+    // Through the ring: one system call for the batch, and what a segment
+    // left undone (a short transfer, or too many buffers) is finished with
+    // preadv/pwritev. Without it, one of those per segment.
+    bool submit(const IoSegment *segments, int count) override {
+        bool writes = false;
+        for (int k = 0; k < count; ++k) writes = writes || segments[k].write;
+        if (writes) crash_point();
+        vector<int32_t> results(count, 0);
+        if (ring && count) {
+            results = ring->run(fd, segments, count);
+            uint64_t read = 0, written = 0;
+            for (int k = 0; k < count; ++k)
+                (segments[k].write ? written : read) += max<int32_t>(results[k], 0);
+            stats_count_io(!writes, writes, 0, read, written);
+        }
+        for (int k = 0; k < count; ++k) {
+            const IoSegment &s = segments[k];
+            uint64_t done = max<int32_t>(results[k], 0);
+            if (done == segment_bytes(s)) continue;
+            vector<iovec> left(s.iov, s.iov + s.iovcnt);
+            size_t j = 0;
+            for (; done >= left[j].iov_len; ++j) done -= left[j].iov_len;
+            left[j].iov_base = static_cast<char *>(left[j].iov_base) + done;
+            left[j].iov_len -= done;
+            if (!transfer(fd, s.write, s.offset + (uint64_t)max<int32_t>(results[k], 0), &left[j], left.size() - j))
+                return false;
+        }
+        return true;
+    }
+
+    bool sync() override {
+        crash_point();
+        stats_count_io(0, 0, 1, 0, 0);
+        return fdatasync(fd) == 0;
+    }
+};
+
+struct MmapDevice : Device {
+    char *base = nullptr;
+    mutex dirty_lock;
+    uint64_t dirty_lo = 0, dirty_hi = 0;   // span written since the last sync
+
+    ~MmapDevice() override {
+        if (base) munmap(base, size);
+        close(fd);
+    }
+
+    bool read_at(uint64_t offset, void *buffer, uint64_t length) override {
+        if (offset > size || length > size - offset) return false;
+        memcpy(buffer, base + offset, length);
+        stats_count_io(0, 0, 0, length, 0);
+        return true;
+    }
+
+    bool write_at(uint64_t offset, const void *data, uint64_t length) override {
+        if (offset > size || length > size - offset) return false;
+        crash_point();
+        // callers may move data inside the mapping itself
+        memmove(base + offset, data, length);
+        stats_count_io(0, 0, 0, 0, length);
+        lock_guard<mutex> guard(dirty_lock);
+        if (dirty_lo == dirty_hi) {
+            dirty_lo = offset;
+            dirty_hi = offset + length;
+        } else {
+            dirty_lo = min(dirty_lo, offset);
+            dirty_hi = max(dirty_hi, offset + length);
+        }
+        return true;
+    }
+
+    bool sync() override {
+        crash_point();
+        uint64_t lo, hi;
+        {
+            lock_guard<mutex> guard(dirty_lock);
+            lo = dirty_lo;
+            hi = dirty_hi;
+            dirty_lo = dirty_hi = 0;
+        }
+        if (lo == hi) return true;
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        lo = lo / page * page;
+        stats_count_io(0, 0, 1, 0, 0);
+        return msync(base + lo, hi - lo, MS_SYNC) == 0;
+    }
+
+    const char *view(uint64_t offset, uint64_t length) override {
+        if (offset > size || length > size - offset) return nullptr;
+        stats_count_io(0, 0, 0, length, 0);
+        return base + offset;
+    }
+};
+
+// Write-back cache of image pages in front of preadv/pwritev. Frames come
+// from one aligned pool allocated up front, so io_fd may be O_DIRECT. Each
+// shard has its own lock, frames and CLOCK hand and keeps its lock through
+// the I/O it does; a group of pages lives in one shard, so a run of misses
+// is one read, and threads on different parts of the image seldom meet.
+// Dirty pages are written back, sorted and merged into runs, on sync, on
+// flush, and when half of a shard is dirty.
+struct CachedDevice : Device {
+    static const uint64_t NO_PAGE = UINT64_MAX;
+
+    struct Frame {
+        uint64_t page = NO_PAGE;
+        bool dirty = false;
+        bool referenced = false;   // CLOCK bit
+        bool loading = false;      // claimed by a read in progress
+    };
+
+    struct Shard {
+        mutex lock;
+        vector<Frame> frames;
+        char *memory = nullptr;
+        unordered_map<uint64_t, uint32_t> table;   // page -> frame
+        uint32_t hand = 0;
+        uint32_t dirty = 0;
+    };
+
+    int io_fd = -1;
+    char *pool = nullptr;
+    unique_ptr<Shard[]> shards;
+    uint32_t shard_frames = 0;
+    atomic<uint64_t> next_read{UINT64_MAX};   // where a sequential reader goes on
+
+    ~CachedDevice() override {
+        flush();
+        if (io_fd != fd) close(io_fd);
+        close(fd);
+        free(pool);
+    }
+
+    uint64_t page_bytes(uint64_t page) const {
+        return min<uint64_t>(CACHE_PAGE, size - page * CACHE_PAGE);
+    }
+
+    char *data(Shard &shard, uint32_t frame) {
+        return shard.memory + (uint64_t)frame * CACHE_PAGE;
+    }
+
+    // Writes the given dirty frames back in page order, one call per run of
+    // consecutive pages. The caller holds the locks of their shards.
+    bool write_back(vector<pair<Shard *, uint32_t>> &frames) {
+        sort(frames.begin(), frames.end(), [](const pair<Shard *, uint32_t> &a, const pair<Shard *, uint32_t> &b) {
+            return a.first->frames[a.second].page < b.first->frames[b.second].page;
+        });
+        vector<iovec> iov;
+        for (size_t a = 0; a < frames.size();) {
+            uint64_t first = frames[a].first->frames[frames[a].second].page;
+            size_t b = a;
+            iov.clear();
+            for (; b < frames.size() && frames[b].first->frames[frames[b].second].page == first + (b - a); ++b)
+                iov.push_back({data(*frames[b].first, frames[b].second), page_bytes(first + (b - a))});
+            crash_point();
+            if (!transfer(io_fd, true, first * CACHE_PAGE, iov.data(), iov.size())) return false;
+            for (size_t k = a; k < b; ++k) {
+                frames[k].first->frames[frames[k].second].dirty = false;
+                frames[k].first->dirty--;
+            }
+            stats_count_cache(0, 0, 0, 0, b - a);
+            a = b;
+        }
+        return true;
+    }
+
+    bool flush_shard(Shard &shard) {
+        vector<pair<Shard *, uint32_t>> frames;
+        for (uint32_t i = 0; i < shard_frames; ++i)
+            if (shard.frames[i].dirty) frames.push_back({&shard, i});
+        return write_back(frames);
+    }
+
+    bool flush() override {
+        vector<unique_lock<mutex>> locks;
+        vector<pair<Shard *, uint32_t>> frames;
+        for (int s = 0; s < CACHE_SHARDS; ++s) {
+            locks.emplace_back(shards[s].lock);
+            for (uint32_t i = 0; i < shard_frames; ++i)
+                if (shards[s].frames[i].dirty) frames.push_back({&shards[s], i});
+        }
+        return write_back(frames);
+    }
+
+    bool sync() override {
+        crash_point();
+        stats_count_io(0, 0, 1, 0, 0);
+        return flush() && fdatasync(io_fd) == 0;
+    }
+
+    // A frame for page, taken from the CLOCK hand: free frames first, then
+    // clean ones whose bit is clear. If everything is dirty the shard is
+    // written back first. Returns -1 if that fails.
+    int64_t claim(Shard &shard, uint64_t page) {
+        for (int round = 0; round < 2; ++round) {
+            for (uint32_t step = 0; step < 2 * shard_frames; ++step) {
+                uint32_t i = shard.hand;
+                shard.hand = (shard.hand + 1) % shard_frames;
+                Frame &frame = shard.frames[i];
+                if (frame.loading) continue;
+                if (frame.page != NO_PAGE) {
+                    if (frame.referenced) {
+                        frame.referenced = false;
+                        continue;
+                    }
+                    if (frame.dirty) continue;
+                    shard.table.erase(frame.page);
+                    stats_count_cache(0, 0, 0, 1, 0);
+                }
+                frame.page = page;
+                frame.referenced = true;
+                shard.table[page] = i;
+                return i;
+            }
+            if (round == 0 && !flush_shard(shard)) return -1;
+        }
+        return -1;
+    }
+
+    // Reads pages [first, end) of a group into the cache; none is cached yet.
+    bool load(Shard &shard, uint64_t first, uint64_t end) {
+        vector<uint32_t> claimed;
+        vector<iovec> iov;
+        bool ok = true;
+        for (uint64_t page = first; ok && page < end; ++page) {
+            int64_t i = claim(shard, page);
+            if (i < 0) {
+                ok = false;
+                break;
+            }
+            shard.frames[i].loading = true;
+            claimed.push_back(i);
+            iov.push_back({data(shard, i), page_bytes(page)});
+        }
+        ok = ok && transfer(io_fd, false, first * CACHE_PAGE, iov.data(), iov.size());
+        for (uint32_t i : claimed) {
+            Frame &frame = shard.frames[i];
+            frame.loading = false;
+            if (!ok) {
+                shard.table.erase(frame.page);
+                frame.page = NO_PAGE;
+                frame.referenced = false;
+            }
+        }
+        return ok;
+    }
+
+    // Copies between buffer and the pages of one group, [offset, offset +
+    // length), reading in what is missing: a partly written page first,
+    // and for a sequential reader the rest of the group too.
+    bool access_group(uint64_t offset, uint64_t length, char *out, const char *in, bool sequential) {
+        uint64_t first = offset / CACHE_PAGE, last = (offset + length - 1) / CACHE_PAGE;
+        uint64_t group_end = min((first / CACHE_GROUP + 1) * CACHE_GROUP, (size + CACHE_PAGE - 1) / CACHE_PAGE);
+        Shard &shard = shards[first / CACHE_GROUP % CACHE_SHARDS];
+        lock_guard<mutex> guard(shard.lock);
+        uint64_t hits = 0, misses = 0, ahead = 0;
+
+        for (uint64_t page = first; page <= last; ++page) {
+            uint64_t start = max(offset, page * CACHE_PAGE);
+            uint64_t stop = min(offset + length, page * CACHE_PAGE + page_bytes(page));
+            auto it = shard.table.find(page);
+            if (it == shard.table.end()) {
+                if (in && start == page * CACHE_PAGE && stop - start == page_bytes(page)) {
+                    // overwritten whole: nothing to read
+                    if (claim(shard, page) < 0) return false;
+                } else {
+                    uint64_t end = page + 1;
+                    uint64_t want = in ? end : last + 1;
+                    if (!in && sequential) want = group_end;
+                    while (end < want && !shard.table.count(end)) ++end;
+                    if (!load(shard, page, end)) return false;
+                    misses += min(end, last + 1) - page;
+                    ahead += end > last + 1 ? end - last - 1 : 0;
+                }
+                it = shard.table.find(page);
+            } else {
+                hits++;
+            }
+            Frame &frame = shard.frames[it->second];
+            frame.referenced = true;
+            char *bytes = data(shard, it->second) + (start - page * CACHE_PAGE);
+            if (in) {
+                memcpy(bytes, in + (start - offset), stop - start);
+                if (!frame.dirty) shard.dirty++;
+                frame.dirty = true;
+            } else {
+                memcpy(out + (start - offset), bytes, stop - start);
+            }
+        }
+        stats_count_cache(hits, misses, ahead, 0, 0);
+        return !in || shard.dirty <= shard_frames / 2 || flush_shard(shard);
+    }
+
+    bool access(uint64_t offset, uint64_t length, char *out, const char *in) {
+        if (offset > size || length > size - offset) return false;
+        bool sequential = false;
+        if (out) sequential = next_read.exchange(offset + length, memory_order_relaxed) == offset;
+        while (length > 0) {
+            uint64_t group_stop = (offset / (CACHE_PAGE * CACHE_GROUP) + 1) * CACHE_PAGE * CACHE_GROUP;
+            uint64_t n = min(length, group_stop - offset);
+            if (!access_group(offset, n, out, in, sequential)) return false;
+            offset += n;
+            length -= n;
+            if (out) out += n;
+            if (in) in += n;
+        }
+        return true;
+    }
+
+    bool read_at(uint64_t offset, void *buffer, uint64_t length) override {
+        return access(offset, length, static_cast<char *>(buffer), nullptr);
+    }
+
+    bool write_at(uint64_t offset, const void *data, uint64_t length) override {
+        crash_point();
+        return access(offset, length, nullptr, static_cast<const char *>(data));
+    }
+};
+
+Device *cache_open(int fd, const string &path, uint64_t size, uint64_t cache_bytes, bool direct_io) {
+    uint64_t frames = max<uint64_t>(cache_bytes / CACHE_PAGE / CACHE_SHARDS, CACHE_MIN_FRAMES);
+    char *pool = static_cast<char *>(aligned_alloc(CACHE_PAGE, frames * CACHE_SHARDS * CACHE_PAGE));
+    if (!pool) {
+        close(fd);
+        return nullptr;
+    }
+    CachedDevice *dev = new CachedDevice;
+    dev->fd = dev->io_fd = fd;
+    dev->size = size;
+    dev->pool = pool;
+    dev->shard_frames = frames;
+    dev->shards.reset(new CachedDevice::Shard[CACHE_SHARDS]);
+    for (int s = 0; s < CACHE_SHARDS; ++s) {
+        dev->shards[s].frames.resize(frames);
+        dev->shards[s].memory = pool + s * frames * CACHE_PAGE;
+    }
+    // O_DIRECT needs whole aligned pages, so the image must be made of them;
+    // where it is refused (tmpfs, say) the cache runs on the page cache.
+    if (direct_io && size % CACHE_PAGE == 0) {
+        int direct = open(path.c_str(), O_RDWR | O_DIRECT);
+        if (direct >= 0) dev->io_fd = direct;
+    }
+    return dev;
+}
+
+}
+
+void device_crash_after(int64_t operations) {
+    crash_countdown.store(operations);
+}
+
+bool device_uring(const Device *dev) {
+    const FileDevice *file = dynamic_cast<const FileDevice *>(dev);
+    return file && file->ring;
+}
+
+struct ClosedDevice : Device {
+    bool read_at(uint64_t, void *, uint64_t) override { return false; }
+    bool write_at(uint64_t, const void *, uint64_t) override { return false; }
+    bool writev_at(uint64_t, const iovec *, int) override { return false; }
+    bool submit(const IoSegment *, int) override { return false; }
+    bool sync() override { return false; }
+    bool flush() override { return false; }
+};
+
+Device *device_closed() {
+    return new ClosedDevice;
+}
+
+Device *device_open(const string &path, bool use_mmap, uint64_t cache_bytes, bool direct_io, bool uring) {
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    if (!use_mmap && cache_bytes) return cache_open(fd, path, st.st_size, cache_bytes, direct_io);
+    if (!use_mmap) {
+        FileDevice *dev = new FileDevice;
+        dev->fd = fd;
+        dev->size = st.st_size;
+        // No io_uring (an old kernel, or one that forbids it): plain preadv/pwritev.
+        if (uring) {
+            dev->ring.reset(new IoRing);
+            if (!dev->ring->setup(URING_ENTRIES)) dev->ring.reset();
+        }
+        return dev;
+    }
+
+    // The whole image is mapped at once; a 64-bit address space has room
+    // for volumes far larger than the disk behind them.
+    void *base = st.st_size ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                            : MAP_FAILED;
+    if (base == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    MmapDevice *dev = new MmapDevice;
+    dev->fd = fd;
+    dev->size = st.st_size;
+    dev->base = static_cast<char *>(base);
+    return dev;
+}
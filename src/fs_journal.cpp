@@ -0,0 +1,151 @@
+#include "../include/fs_journal.h"
+#include "../include/fs_crc.h"
+#include <cstring>
+#include <cstddef>
+
+using namespace std;
+
+static uint64_t round_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// Bytes a transaction takes in the region, commit block included.
+static uint64_t txn_footprint(const Journal &journal, uint64_t payload_bytes) {
+    return round_up(sizeof(TxnHeader) + payload_bytes, journal.block_size) + journal.block_size;
+}
+
+void JournalTxn::add(uint64_t offset, const void *data, uint64_t length) {
+    size_t at = payload.size();
+    payload.resize(at + 2 * sizeof(uint64_t) + length);
+    memcpy(&payload[at], &offset, sizeof(offset));
+    memcpy(&payload[at + sizeof(offset)], &length, sizeof(length));
+    memcpy(&payload[at + 2 * sizeof(uint64_t)], data, length);
+    records++;
+}
+
+void JournalTxn::clear() {
+    payload.clear();
+    records = 0;
+}
+
+// Walks the records of a payload, checking each lies below limit.
+static bool apply_records(Device *dev, const char *payload, uint64_t bytes, uint32_t records, uint64_t limit) {
+    uint64_t at = 0;
+    for (uint32_t r = 0; r < records; ++r) {
+        uint64_t offset, length;
+        if (bytes - at < 2 * sizeof(uint64_t)) return false;
+        memcpy(&offset, payload + at, sizeof(offset));
+        memcpy(&length, payload + at + sizeof(offset), sizeof(length));
+        at += 2 * sizeof(uint64_t);
+        if (length > bytes - at || offset > limit || length > limit - offset) return false;
+        if (!dev->write_at(offset, payload + at, length)) return false;
+        at += length;
+    }
+    return true;
+}
+
+static bool write_header(Device *dev, Journal &journal) {
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.sequence = journal.sequence;
+    header.crc = crc32c(0, &header, offsetof(JournalHeader, crc));
+    journal.head = journal.block_size;
+    return dev->write_at(journal.offset, &header, sizeof(header));
+}
+
+bool journal_format(Device *dev, Journal &journal) {
+    journal.sequence = 1;
+    return write_header(dev, journal);
+}
+
+bool journal_checkpoint(Device *dev, Journal &journal) {
+    // Once the in-place copies are durable nothing needs replaying. The new
+    // header becomes durable with the first barrier of the next commit.
+    return dev->sync() && write_header(dev, journal);
+}
+
+bool journal_open(Device *dev, Journal &journal, int *replayed) {
+    JournalHeader header;
+    if (!dev->read_at(journal.offset, &header, sizeof(header))) return false;
+    if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.crc != crc32c(0, &header, offsetof(JournalHeader, crc)))
+        return false;
+
+    journal.sequence = header.sequence;
+    int count = 0;
+    vector<char> payload;
+    for (uint64_t at = journal.block_size; at + 2 * journal.block_size <= journal.bytes;) {
+        TxnHeader txn;
+        if (!dev->read_at(journal.offset + at, &txn, sizeof(txn))) break;
+        if (memcmp(txn.magic, TXN_MAGIC, sizeof(txn.magic)) != 0 ||
+            txn.crc != crc32c(0, &txn, offsetof(TxnHeader, crc)) ||
+            txn.sequence != journal.sequence ||
+            txn.payload_bytes > journal.bytes ||
+            at + txn_footprint(journal, txn.payload_bytes) > journal.bytes)
+            break;
+
+        uint64_t commit_at = at + txn_footprint(journal, txn.payload_bytes) - journal.block_size;
+        TxnCommit commit;
+        payload.resize(txn.payload_bytes);
+        if (!dev->read_at(journal.offset + commit_at, &commit, sizeof(commit)) ||
+            memcmp(commit.magic, COMMIT_MAGIC, sizeof(commit.magic)) != 0 ||
+            commit.crc != crc32c(0, &commit, offsetof(TxnCommit, crc)) ||
+            commit.sequence != txn.sequence || commit.payload_crc != txn.payload_crc ||
+            !dev->read_at(journal.offset + at + sizeof(txn), payload.data(), payload.size()) ||
+            crc32c(0, payload.data(), payload.size()) != txn.payload_crc)
+            break;
+
+        if (!apply_records(dev, payload.data(), payload.size(), txn.records, journal.limit)) return false;
+        journal.sequence++;
+        count++;
+        at += txn_footprint(journal, txn.payload_bytes);
+    }
+
+    if (replayed) *replayed = count;
+    return journal_checkpoint(dev, journal);
+}
+
+bool journal_commit(Device *dev, Journal &journal, const JournalTxn &txn) {
+    if (txn.empty()) return true;
+    uint64_t footprint = txn_footprint(journal, txn.payload.size());
+
+    if (footprint > journal.bytes - journal.block_size) {
+        // Cannot be made atomic; at least leave it durable. The transactions
+        // logged before it must not be replayed over it after a crash, so
+        // the journal is emptied, durably, first.
+        return journal_checkpoint(dev, journal) && dev->sync() &&
+               apply_records(dev, txn.payload.data(), txn.payload.size(), txn.records, journal.limit) &&
+               dev->sync();
+    }
+    if (journal.head + footprint > journal.bytes && !journal_checkpoint(dev, journal)) return false;
+
+    uint32_t payload_crc = crc32c(0, txn.payload.data(), txn.payload.size());
+    TxnHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TXN_MAGIC, sizeof(header.magic));
+    header.sequence = journal.sequence;
+    header.payload_bytes = txn.payload.size();
+    header.records = txn.records;
+    header.payload_crc = payload_crc;
+    header.crc = crc32c(0, &header, offsetof(TxnHeader, crc));
+
+    TxnCommit commit;
+    memset(&commit, 0, sizeof(commit));
+    memcpy(commit.magic, COMMIT_MAGIC, sizeof(commit.magic));
+    commit.sequence = journal.sequence;
+    commit.payload_crc = payload_crc;
+    commit.crc = crc32c(0, &commit, offsetof(TxnCommit, crc));
+
+    uint64_t at = journal.offset + journal.head;
+    bool ok = dev->write_at(at, &header, sizeof(header)) &&
+              dev->write_at(at + sizeof(header), txn.payload.data(), txn.payload.size()) &&
+              dev->sync() &&
+              dev->write_at(at + footprint - journal.block_size, &commit, sizeof(commit)) &&
+              dev->sync();
+    if (!ok) return false;
+
+    journal.head += footprint;
+    journal.sequence++;
+    return apply_records(dev, txn.payload.data(), txn.payload.size(), txn.records, journal.limit);
+}
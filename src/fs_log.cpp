@@ -0,0 +1,182 @@
+#include "../include/fs_log.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const uint64_t RING_SLOTS = 4096;   // power of two
+const size_t TEXT_MAX = 232;
+
+// One queued line. seq tells producers and the flusher whose turn the slot
+// is: pos when free for the producer at pos, pos + 1 once that line is in.
+struct LogSlot {
+    atomic<uint64_t> seq;
+    uint64_t ns;
+    uint16_t length;
+    char text[TEXT_MAX];
+};
+
+// Bounded multi-producer ring drained by one flusher at a time.
+struct Logger {
+    LogSlot slots[RING_SLOTS];
+    atomic<uint64_t> head{0};        // next position handed to a producer
+    atomic<uint64_t> tail{0};        // next position to write out
+    atomic<int> level{FS_LOG_DEBUG};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    mutex drain_lock;                // one drain at a time; guards fd and out
+    int fd = -1;
+    string out;
+
+    mutex wake_lock;
+    condition_variable wake;
+    bool stopping = false;
+    atomic<bool> stopped{false};
+    thread flusher;
+
+    Logger() {
+        for (uint64_t i = 0; i < RING_SLOTS; ++i) slots[i].seq.store(i, memory_order_relaxed);
+    }
+};
+
+Logger *logger = nullptr;
+once_flag logger_once;
+
+bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Moves every finished line into the file with a single write.
+bool drain(Logger *log) {
+    lock_guard<mutex> guard(log->drain_lock);
+    if (log->fd < 0) {
+        log->fd = open(FS_LOG_FILE, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (log->fd < 0) return false;
+        time_t now = time(nullptr);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        log->out += "[        0.000000] LOG_OPEN ";
+        log->out += stamp;
+        log->out += "\n";
+    }
+
+    uint64_t pos = log->tail.load(memory_order_relaxed);
+    for (;; ++pos) {
+        LogSlot &slot = log->slots[pos & (RING_SLOTS - 1)];
+        if (slot.seq.load(memory_order_acquire) != pos + 1) break;
+        char stamp[32];
+        int n = snprintf(stamp, sizeof(stamp), "[%9llu.%06llu] ",
+                         (unsigned long long)(slot.ns / 1000000000),
+                         (unsigned long long)(slot.ns / 1000 % 1000000));
+        log->out.append(stamp, n);
+        log->out.append(slot.text, slot.length);
+        log->out += '\n';
+        slot.seq.store(pos + RING_SLOTS, memory_order_release);
+    }
+    log->tail.store(pos, memory_order_release);
+
+    bool ok = write_all(log->fd, log->out.data(), log->out.size());
+    log->out.clear();
+    return ok;
+}
+
+void flusher_main(Logger *log) {
+    unique_lock<mutex> lock(log->wake_lock);
+    while (!log->stopping) {
+        log->wake.wait_for(lock, chrono::milliseconds(100));
+        lock.unlock();
+        drain(log);
+        lock.lock();
+    }
+}
+
+// At exit: stop the thread and write what is left. Lines logged after this
+// point are written straight away by the caller.
+void shutdown_logger() {
+    Logger *log = logger;
+    {
+        lock_guard<mutex> lock(log->wake_lock);
+        log->stopping = true;
+    }
+    log->wake.notify_one();
+    log->flusher.join();
+    log->stopped.store(true);
+    drain(log);
+}
+
+Logger *get_logger() {
+    call_once(logger_once, [] {
+        // Never freed, so late loggers during static destruction stay safe.
+        logger = new Logger;
+        logger->flusher = thread(flusher_main, logger);
+        atexit(shutdown_logger);
+    });
+    return logger;
+}
+
+}
+
+void fs_log(const string &message, FsLogLevel level) {
+    Logger *log = get_logger();
+    if (level < log->level.load(memory_order_relaxed)) return;
+
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - log->start).count();
+    uint64_t pos = log->head.load(memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &log->slots[pos & (RING_SLOTS - 1)];
+        int64_t diff = (int64_t)(slot->seq.load(memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (log->head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // Ring full: let the flusher catch up.
+            if (log->stopped.load()) drain(log);
+            else log->wake.notify_one();
+            this_thread::yield();
+            pos = log->head.load(memory_order_relaxed);
+        } else {
+            pos = log->head.load(memory_order_relaxed);
+        }
+    }
+
+    slot->ns = ns;
+    slot->length = min(message.size(), TEXT_MAX);
+    memcpy(slot->text, message.data(), slot->length);
+    slot->seq.store(pos + 1, memory_order_release);
+
+    if (log->stopped.load(memory_order_relaxed)) drain(log);
+    else if (pos - log->tail.load(memory_order_relaxed) == RING_SLOTS / 2) log->wake.notify_one();
+}
+
+void fs_log_set_level(FsLogLevel level) {
+    get_logger()->level.store(level);
+}
+
+bool fs_log_enabled(FsLogLevel level) {
+    return level >= get_logger()->level.load(memory_order_relaxed);
+}
+
+bool fs_log_flush() {
+    return drain(get_logger());
+}
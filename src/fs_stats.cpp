@@ -0,0 +1,273 @@
+#include "../include/fs_stats.h"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <cstddef>
+#include <unistd.h>
+
+using namespace std;
+
+// Most events a trace keeps; later ones are dropped.
+#define TRACE_MAX_EVENTS 1000000
+
+namespace {
+
+const size_t WORDS = sizeof(FsStats) / sizeof(uint64_t);
+static_assert(sizeof(FsStats) % sizeof(uint64_t) == 0, "FsStats must be made of uint64_t");
+
+// One thread's counters. Only the owner writes them, with plain relaxed
+// loads and stores, so counting costs no more than ordinary additions;
+// fs_stats reads them from other threads.
+struct alignas(64) ThreadCounters {
+    atomic<uint64_t> words[WORDS];
+    uint32_t tid;
+
+    ThreadCounters() {
+        for (atomic<uint64_t> &w : words) w.store(0, memory_order_relaxed);
+    }
+};
+
+struct Registry {
+    mutex lock;
+    vector<ThreadCounters *> live;
+    uint64_t retired[WORDS] = {};   // counts of threads that have exited
+    uint32_t next_tid = 1;
+};
+
+// Never destroyed: threads may still exit while statics are torn down.
+Registry &registry() {
+    static Registry *r = new Registry;
+    return *r;
+}
+
+size_t op_word(FsOp op, size_t field_offset) {
+    return (op * sizeof(FsOpStats) + field_offset) / sizeof(uint64_t);
+}
+
+size_t io_word(size_t field_offset) {
+    return field_offset / sizeof(uint64_t);
+}
+
+bool is_max_word(size_t w) {
+    const size_t per_op = sizeof(FsOpStats) / sizeof(uint64_t);
+    return w < FS_OP_COUNT * per_op && w % per_op == offsetof(FsOpStats, max_ns) / sizeof(uint64_t);
+}
+
+void merge(uint64_t *into, size_t w, uint64_t value) {
+    into[w] = is_max_word(w) ? max(into[w], value) : into[w] + value;
+}
+
+thread_local ThreadCounters *counters = nullptr;
+thread_local bool slot_gone = false;
+
+struct ThreadSlot {
+    bool armed = false;
+
+    ~ThreadSlot() {
+        slot_gone = true;
+        if (!counters) return;
+        Registry &r = registry();
+        lock_guard<mutex> guard(r.lock);
+        for (size_t w = 0; w < WORDS; ++w) merge(r.retired, w, counters->words[w].load(memory_order_relaxed));
+        r.live.erase(find(r.live.begin(), r.live.end(), counters));
+        delete counters;
+        counters = nullptr;
+    }
+};
+
+// The slot only hands the counters back at thread exit; the hot path reads
+// the plain pointer, which needs no initialisation check. Counting after the
+// slot is gone (static destructors on the main thread) gets counters that
+// stay registered for good.
+thread_local ThreadSlot slot;
+
+ThreadCounters &mine() {
+    if (!counters) {
+        ThreadCounters *c = new ThreadCounters;
+        Registry &r = registry();
+        lock_guard<mutex> guard(r.lock);
+        c->tid = r.next_tid++;
+        r.live.push_back(c);
+        counters = c;
+        if (!slot_gone) slot.armed = true;
+    }
+    return *counters;
+}
+
+void add(ThreadCounters &c, size_t w, uint64_t value) {
+    c.words[w].store(c.words[w].load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+struct TraceEvent {
+    FsOp op;
+    string name;
+    uint32_t tid;
+    uint64_t start_ns;      // since the trace started
+    uint64_t duration_ns;
+    uint64_t bytes;
+};
+
+atomic<bool> tracing(false);
+atomic<uint64_t> trace_min_ns(0);
+mutex trace_lock;
+vector<TraceEvent> trace_events;
+chrono::steady_clock::time_point trace_origin;
+
+const char *OP_NAMES[FS_OP_COUNT] = {
+    "create", "delete", "write", "read", "append", "truncate", "rename", "copy", "diff",
+    "cat", "ls", "lookup", "defrag_step", "check", "backup", "restore", "commit", "mount",
+    "snapshot", "import", "export",
+};
+
+string json_escape(const string &text) {
+    string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            out += hex;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+}
+
+FsOpTimer::~FsOpTimer() {
+    auto end = chrono::steady_clock::now();
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    ThreadCounters &c = mine();
+    add(c, op_word(op, offsetof(FsOpStats, count)), 1);
+    add(c, op_word(op, offsetof(FsOpStats, total_ns)), ns);
+    add(c, op_word(op, offsetof(FsOpStats, bytes)), bytes);
+    size_t max_w = op_word(op, offsetof(FsOpStats, max_ns));
+    if (ns > c.words[max_w].load(memory_order_relaxed)) c.words[max_w].store(ns, memory_order_relaxed);
+    int bucket = ns ? min(63 - __builtin_clzll(ns), FS_STATS_BUCKETS - 1) : 0;
+    add(c, op_word(op, offsetof(FsOpStats, buckets) + bucket * sizeof(uint64_t)), 1);
+
+    if (!tracing.load(memory_order_relaxed) || ns < trace_min_ns.load(memory_order_relaxed)) return;
+    lock_guard<mutex> guard(trace_lock);
+    if (!tracing.load(memory_order_relaxed) || trace_events.size() >= TRACE_MAX_EVENTS) return;
+    uint64_t at = start > trace_origin ? chrono::duration_cast<chrono::nanoseconds>(start - trace_origin).count() : 0;
+    trace_events.push_back({op, name ? *name : string(), c.tid, at, ns, bytes});
+}
+
+void stats_count_io(uint64_t read_calls, uint64_t write_calls, uint64_t sync_calls,
+                    uint64_t bytes_read, uint64_t bytes_written) {
+    ThreadCounters &c = mine();
+    if (read_calls) add(c, io_word(offsetof(FsStats, read_calls)), read_calls);
+    if (write_calls) add(c, io_word(offsetof(FsStats, write_calls)), write_calls);
+    if (sync_calls) add(c, io_word(offsetof(FsStats, sync_calls)), sync_calls);
+    if (bytes_read) add(c, io_word(offsetof(FsStats, bytes_read)), bytes_read);
+    if (bytes_written) add(c, io_word(offsetof(FsStats, bytes_written)), bytes_written);
+}
+
+void stats_count_metadata(uint64_t loads, uint64_t saves) {
+    ThreadCounters &c = mine();
+    if (loads) add(c, io_word(offsetof(FsStats, metadata_loads)), loads);
+    if (saves) add(c, io_word(offsetof(FsStats, metadata_saves)), saves);
+}
+
+void stats_count_cache(uint64_t hits, uint64_t misses, uint64_t readahead, uint64_t evictions,
+                       uint64_t writebacks) {
+    ThreadCounters &c = mine();
+    if (hits) add(c, io_word(offsetof(FsStats, cache_hits)), hits);
+    if (misses) add(c, io_word(offsetof(FsStats, cache_misses)), misses);
+    if (readahead) add(c, io_word(offsetof(FsStats, cache_readahead)), readahead);
+    if (evictions) add(c, io_word(offsetof(FsStats, cache_evictions)), evictions);
+    if (writebacks) add(c, io_word(offsetof(FsStats, cache_writebacks)), writebacks);
+}
+
+FsStats fs_stats() {
+    uint64_t sum[WORDS];
+    Registry &r = registry();
+    {
+        lock_guard<mutex> guard(r.lock);
+        memcpy(sum, r.retired, sizeof(sum));
+        for (ThreadCounters *c : r.live)
+            for (size_t w = 0; w < WORDS; ++w) merge(sum, w, c->words[w].load(memory_order_relaxed));
+    }
+    FsStats stats;
+    memcpy(&stats, sum, sizeof(stats));
+    return stats;
+}
+
+void fs_stats_reset() {
+    Registry &r = registry();
+    lock_guard<mutex> guard(r.lock);
+    memset(r.retired, 0, sizeof(r.retired));
+    for (ThreadCounters *c : r.live)
+        for (atomic<uint64_t> &w : c->words) w.store(0, memory_order_relaxed);
+}
+
+uint64_t fs_stats_percentile_ns(const FsOpStats &op, double q) {
+    if (!op.count) return 0;
+    uint64_t want = max<uint64_t>(1, (uint64_t)(q * op.count + 0.5)), seen = 0;
+    for (int b = 0; b < FS_STATS_BUCKETS - 1; ++b) {
+        seen += op.buckets[b];
+        if (seen >= want) return min<uint64_t>(op.max_ns, (2ull << b) - 1);
+    }
+    return op.max_ns;
+}
+
+const char *fs_op_name(FsOp op) {
+    return op < FS_OP_COUNT ? OP_NAMES[op] : "?";
+}
+
+void fs_stats_print(const FsStats &stats) {
+    cout << "islem  sayi  ort_us  p50_us  p99_us  p999_us  maks_us  bayt\n";
+    for (int i = 0; i < FS_OP_COUNT; ++i) {
+        const FsOpStats &op = stats.ops[i];
+        if (!op.count) continue;
+        cout << fs_op_name((FsOp)i) << "  " << op.count << "  " << op.total_ns / 1e3 / op.count << "  "
+             << fs_stats_percentile_ns(op, 0.5) / 1e3 << "  " << fs_stats_percentile_ns(op, 0.99) / 1e3 << "  "
+             << fs_stats_percentile_ns(op, 0.999) / 1e3 << "  " << op.max_ns / 1e3 << "  " << op.bytes << "\n";
+    }
+    cout << "Goruntu: " << stats.read_calls << " okuma, " << stats.write_calls << " yazma, " << stats.sync_calls
+         << " sync cagrisi; " << stats.bytes_read << " bayt okundu, " << stats.bytes_written << " bayt yazildi\n"
+         << "Metadata: " << stats.metadata_loads << " yukleme, " << stats.metadata_saves << " kayit\n";
+    uint64_t lookups = stats.cache_hits + stats.cache_misses;
+    if (lookups)
+        cout << "Onbellek: " << stats.cache_hits << " isabet, " << stats.cache_misses << " iska (isabet orani %"
+             << 100.0 * stats.cache_hits / lookups << "), " << stats.cache_readahead << " onden okuma, "
+             << stats.cache_evictions << " cikarma, " << stats.cache_writebacks << " geri yazma\n";
+}
+
+void fs_trace_start(uint64_t min_us) {
+    lock_guard<mutex> guard(trace_lock);
+    trace_events.clear();
+    trace_origin = chrono::steady_clock::now();
+    trace_min_ns.store(min_us * 1000, memory_order_relaxed);
+    tracing.store(true, memory_order_relaxed);
+}
+
+bool fs_trace_stop(const string &path) {
+    vector<TraceEvent> events;
+    {
+        lock_guard<mutex> guard(trace_lock);
+        tracing.store(false, memory_order_relaxed);
+        events.swap(trace_events);
+    }
+    ofstream out(path);
+    if (!out) return false;
+    out << "{\"traceEvents\": [";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent &e = events[i];
+        // Chrome trace times are microseconds
+        out << (i ? ",\n" : "\n") << "{\"name\": \"" << fs_op_name(e.op) << "\", \"cat\": \"fs\", \"ph\": \"X\", \"ts\": "
+            << e.start_ns / 1e3 << ", \"dur\": " << e.duration_ns / 1e3 << ", \"pid\": " << getpid()
+            << ", \"tid\": " << e.tid << ", \"args\": {\"file\": \"" << json_escape(e.name) << "\", \"bytes\": "
+            << e.bytes << "}}";
+    }
+    out << "\n], \"displayTimeUnit\": \"ns\"}\n";
+    return (bool)out;
+}
@@ -1,19 +1,311 @@
 #include "../include/fs.h"
+#include "../include/fs_stats.h"
 #include <iostream>
-#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
 
 using namespace std;
 
+// Bos satir varsayilan degeri secer.
+uint64_t ask_number(const string &prompt, uint64_t default_value) {
+    string line;
+    cout << prompt << " [" << default_value << "]: ";
+    getline(cin, line);
+    if (line.empty()) return default_value;
+    return strtoull(line.c_str(), nullptr, 10);
+}
+
 void pause_() {
     cout << "\nDevam etmek icin ENTER'a basin...";
     cin.ignore();
     cin.get();
 }
 
-int main() {
+struct BatchOptions {
+    string disk = DISK_NAME;
+    FsMountOptions mount;
+    bool timing = false;
+    bool keep_going = false;
+    int threads = 0;    // backup, restore, import-tree, export-tree; 0: one per core
+};
+
+static const char *BATCH_HELP =
+    "Komutlar (satir basina bir tane, # ile baslayan satirlar yorum):\n"
+    "  format [disk_boyutu [blok_boyutu [dosya_sayisi]]]\n"
+    "  create AD | delete AD | exists AD | size AD | cat AD | ls [DIZIN]\n"
+    "  mkdir DIZIN | rmdir DIZIN   (adlar yoldur: dizin/alt/dosya)\n"
+    "  write AD METIN... | write AD @dosya     (dosya: diskin disindaki bir dosya)\n"
+    "  append AD METIN... | append AD @dosya\n"
+    "  write-at AD OFSET METIN... | write-at AD OFSET @dosya\n"
+    "  read AD [OFSET BOYUT] | export AD dosya\n"
+    "  rename ESKI YENI | copy KAYNAK HEDEF | truncate AD BOYUT | diff AD1 AD2\n"
+    "  punch AD OFSET UZUNLUK   (araligi sifirla, bloklarini birak)\n"
+    "  compress AD on|off   (dosyayi sikistirilmis tut / ac)\n"
+    "  check [is_parcacigi] | defrag | flush | sync\n"
+    "  backup YEDEK | backup-inc YEDEK | restore YEDEK [ARTIMLI...]\n"
+    "  import-tree KLASOR [DIZIN] | export-tree DIZIN KLASOR   (KLASOR: diskin disindaki bir dizin)\n"
+    "  snapshot AD | snapshot-delete AD | snapshots | rollback AD\n"
+    "  snapshot-read GORUNTU AD [OFSET BOYUT] | backup-snap GORUNTU YEDEK\n"
+    "  snapshot-diff GORUNTU [GORUNTU2]   (ikincisi yoksa canli disk)\n"
+    "  stats [reset] | trace start [en_az_us] | trace stop DOSYA.json\n";
+
+// Whole contents of a file outside the image.
+static bool read_host_file(const string &path, string &data) {
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    ostringstream out;
+    out << in.rdbuf();
+    data = out.str();
+    return true;
+}
+
+// Data argument of write, append and write-at: the rest of the line, or a host file
+// given as @path.
+static bool command_data(const string &rest, string &data) {
+    if (!rest.empty() && rest[0] == '@') return read_host_file(rest.substr(1), data);
+    data = rest;
+    return true;
+}
+
+// Runs one batch command on fs; format remounts it. Returns false if the
+// command failed or is unknown.
+static bool run_command(FsHandle *&fs, const BatchOptions &options, const string &line) {
+    istringstream words(line);
+    string cmd, a, b;
+    words >> cmd >> a;
+    string rest;
+    getline(words >> ws, rest);
+    istringstream more(rest);
+    more >> b;
+
+    if (cmd == "format") {
+        FsGeometry geometry;
+        istringstream args(a + " " + rest);
+        args >> geometry.volume_size >> geometry.block_size >> geometry.max_files;
+        fs_unmount(fs);
+        bool ok = fs_format(options.disk, geometry);
+        fs = fs_mount(options.disk, options.mount);
+        return ok && fs;
+    }
+    if (cmd == "create") return fs_create(fs, a);
+    if (cmd == "delete" || cmd == "rm") return fs_delete(fs, a);
+    if (cmd == "exists") {
+        bool found = fs_exists(fs, a);
+        cout << (found ? "var" : "yok") << "\n";
+        return found;
+    }
+    if (cmd == "size") {
+        int64_t size = fs_size(fs, a);
+        if (size >= 0) cout << size << "\n";
+        return size >= 0;
+    }
+    if (cmd == "ls") {
+        vector<FsDirEntry> page;
+        if (!fs_list(fs, a, "", 1, page)) return false;
+        fs_ls(fs, a);
+        return true;
+    }
+    if (cmd == "mkdir") return fs_mkdir(fs, a);
+    if (cmd == "rmdir") return fs_rmdir(fs, a);
+    if (cmd == "cat") {
+        if (!fs_exists(fs, a)) return false;
+        fs_cat(fs, a);
+        return true;
+    }
+    if (cmd == "write" && !rest.empty() && rest[0] == '@') {
+        // Streamed, so large host files need no buffer of their size.
+        ifstream in(rest.substr(1), ios::binary | ios::ate);
+        if (!in) return false;
+        int64_t size = in.tellg();
+        in.seekg(0);
+        return fs_write_chunks(fs, a, size, [&](char *data, int64_t n) {
+            return (bool)in.read(data, n);
+        });
+    }
+    if (cmd == "write" || cmd == "append") {
+        string data;
+        if (!command_data(rest, data)) return false;
+        return cmd == "write" ? fs_write(fs, a, data.data(), data.size()) : fs_append(fs, a, data.data(), data.size());
+    }
+    if (cmd == "write-at") {
+        string data, tail;
+        getline(more >> ws, tail);
+        if (b.empty() || !command_data(tail, data)) return false;
+        return fs_write_at(fs, a, atoll(b.c_str()), data.data(), data.size());
+    }
+    if (cmd == "read") {
+        int64_t offset = 0, size = fs_size(fs, a);
+        if (!b.empty()) {
+            offset = atoll(b.c_str());
+            more >> size;
+        }
+        bool ok = size >= 0 && fs_read_chunks(fs, a, offset, size, [](const char *data, int64_t n) {
+            cout.write(data, n);
+            return true;
+        });
+        cout << "\n";
+        return ok;
+    }
+    if (cmd == "export") {
+        ofstream out(rest, ios::binary | ios::trunc);
+        int64_t size = fs_size(fs, a);
+        return out && size >= 0 && fs_read_chunks(fs, a, 0, size, [&](const char *data, int64_t n) {
+            return (bool)out.write(data, n);
+        });
+    }
+    if (cmd == "rename" || cmd == "mv") return fs_rename(fs, a, b);
+    if (cmd == "copy" || cmd == "cp") return fs_copy(fs, a, b);
+    if (cmd == "truncate") return !b.empty() && fs_truncate(fs, a, atoll(b.c_str()));
+    if (cmd == "punch") {
+        int64_t length = -1;
+        more >> length;
+        return !b.empty() && fs_punch_hole(fs, a, atoll(b.c_str()), length);
+    }
+    if (cmd == "compress") {
+        if (b != "on" && b != "off") return false;
+        return fs_set_codec(fs, a, b == "on" ? FS_CODEC_LZ : FS_CODEC_NONE);
+    }
+    if (cmd == "diff") {
+        FsDiffReport report;
+        if (!fs_diff_report(fs, a, b, report)) return false;
+        if (report.first_difference < 0) cout << "ayni\n";
+        else cout << "farkli " << report.first_difference << "\n";
+        return true;
+    }
+    if (cmd == "check") return fs_check_integrity(fs, atoi(a.c_str()));
+    if (cmd == "defrag") {
+        fs_defragment(fs);
+        return true;
+    }
+    if (cmd == "flush") return fs_flush(fs);
+    if (cmd == "sync") return fs_sync(fs);
+    if (cmd == "backup") return fs_backup(fs, a, options.threads);
+    if (cmd == "backup-inc") return fs_backup_incremental(fs, a, options.threads);
+    if (cmd == "restore") {
+        vector<string> chain;
+        istringstream names(a + " " + rest);
+        for (string name; names >> name;) chain.push_back(name);
+        return fs_restore_chain(fs, chain, options.threads);
+    }
+    if (cmd == "import-tree") return !a.empty() && fs_import_tree(fs, a, b, options.threads);
+    if (cmd == "export-tree") return !b.empty() && fs_export_tree(fs, a, b, options.threads);
+    if (cmd == "snapshot") return fs_snapshot_create(fs, a);
+    if (cmd == "snapshot-delete") return fs_snapshot_delete(fs, a);
+    if (cmd == "snapshots") {
+        vector<FsSnapshotInfo> snapshots;
+        if (!fs_snapshot_list(fs, snapshots)) return false;
+        for (const FsSnapshotInfo &snapshot : snapshots) {
+            time_t created = snapshot.created;
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+            cout << snapshot.name << "  " << when << "  " << snapshot.files << " girdi\n";
+        }
+        return true;
+    }
+    if (cmd == "rollback") return fs_snapshot_rollback(fs, a);
+    if (cmd == "snapshot-read") {
+        int64_t offset = 0, size = fs_snapshot_size(fs, a, b);
+        if (more >> offset) more >> size;
+        vector<char> buffer(FS_CHUNK_SIZE);
+        while (size > 0) {
+            int64_t n = fs_snapshot_read(fs, a, b, offset, buffer.data(), min<int64_t>(size, buffer.size()));
+            if (n <= 0) break;
+            cout.write(buffer.data(), n);
+            offset += n;
+            size -= n;
+        }
+        cout << "\n";
+        return size == 0;
+    }
+    if (cmd == "snapshot-diff") {
+        vector<FsSnapshotChange> changes;
+        if (a.empty() || !fs_snapshot_diff(fs, a, b, changes)) return false;
+        for (const FsSnapshotChange &change : changes)
+            cout << (change.kind == FS_CHANGE_ADDED ? "+ " : change.kind == FS_CHANGE_REMOVED ? "- " : "~ ")
+                 << change.path << "\n";
+        return true;
+    }
+    if (cmd == "backup-snap") return !b.empty() && fs_backup_snapshot(fs, a, b);
+    if (cmd == "stats") {
+        if (a == "reset") fs_stats_reset();
+        else fs_stats_print(fs_stats());
+        return a.empty() || a == "reset";
+    }
+    if (cmd == "trace" && a == "start") {
+        fs_trace_start(strtoull(b.c_str(), nullptr, 10));
+        return true;
+    }
+    if (cmd == "trace" && a == "stop") return !b.empty() && fs_trace_stop(b);
+    cerr << "Bilinmeyen komut: " << cmd << "\n";
+    return false;
+}
+
+// Runs commands one per line on a single mounted handle. Stops at the first
+// failure unless keep_going; returns the exit status.
+static int run_batch(const BatchOptions &options, istream &in, const vector<string> &inline_commands) {
+    FsHandle *fs = fs_mount(options.disk, options.mount);
+    // A script may start by formatting a disk that is not there yet.
+    if (!fs && (!fs_format(options.disk) || !(fs = fs_mount(options.disk, options.mount)))) {
+        cerr << options.disk << " acilamadi.\n";
+        return 1;
+    }
+
+    int failures = 0, number = 0;
+    auto started = chrono::steady_clock::now();
+    auto run = [&](const string &line) {
+        number++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') return true;
+        string command = line.substr(first);
+        auto t0 = chrono::steady_clock::now();
+        bool ok = run_command(fs, options, command);
+        if (options.timing)
+            cerr << "[" << chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count() << " ms] "
+                 << command.substr(0, command.find(' ', command.find(' ') + 1)) << "\n";
+        if (!ok) {
+            cerr << "Hata: satir " << number << ": " << command << "\n";
+            failures++;
+        }
+        return ok || options.keep_going;
+    };
+
+    bool go = true;
+    for (const string &command : inline_commands)
+        if (go) go = run(command);
+    if (inline_commands.empty())
+        for (string line; go && getline(in, line);) go = run(line);
+
+    if (options.timing)
+        cerr << "Toplam: " << number << " komut, "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - started).count() << " ms\n";
+    fs_unmount(fs);
+    return failures ? 1 : 0;
+}
+
+static void usage() {
+    cerr << "Kullanim: main                      etkilesimli menu\n"
+         << "         main [secenekler] [betik]   betikteki (yoksa standart girdideki) komutlari calistirir\n"
+         << "Secenekler:\n"
+         << "  -e KOMUT        komutu calistir (birden fazla verilebilir; betik okunmaz)\n"
+         << "  --disk YOL      disk goruntusu (varsayilan " DISK_NAME ")\n"
+         << "  --time          her komutun suresini yaz\n"
+         << "  --keep-going    hatada durma\n"
+         << "  --mmap          goruntuyu bellege esle\n"
+         << "  --sync          her degisiklik dondugunde kalici olsun\n"
+         << "  --verify        okumalarda saglama toplamlarini denetle\n"
+         << "  --cache MiB     surec ici blok onbellegi (en az 4 MiB)\n"
+         << "  --direct        onbellekle birlikte goruntuyu O_DIRECT ile ac\n"
+         << "  --uring         G/C'yi io_uring ile toplu gonder (yoksa pread/pwrite)\n"
+         << "  --threads N     yedekleme, geri yukleme ve toplu aktarimda is parcacigi sayisi (varsayilan: cekirdek sayisi)\n\n"
+         << BATCH_HELP;
+}
+
+static void interactive() {
     int choice;
-    string name, name2, backup;
-    char buffer[512];
+    string name, name2, backup, data;
 
     do {
         cout << "\n========== SimpleFS Menu ==========\n"
@@ -28,7 +320,7 @@ int main() {
              << " 9. Dosyaya veri ekle\n"
              << "10. Dosya ismini degistir\n"
              << "11. Dosya icerigini goster (cat)\n"
-             << "12. Dosya icerigini kes/kucult (truncate)\n"
+             << "12. Dosya boyutunu degistir (truncate)\n"
              << "13. Dosya kopyala\n"
              << "14. Dosya tasi (rename)\n"
              << "15. Disk butunlugunu kontrol et\n"
@@ -36,7 +328,12 @@ int main() {
              << "17. Disk yedekle\n"
              << "18. Disk yedegini geri yukle\n"
              << "19. Iki dosya ayni mi? (diff)\n"
-             << "20. Cikis\n"
+             << "20. Islem istatistikleri\n"
+             << "21. Dizin olustur\n"
+             << "22. Dizin sil (bos olmali)\n"
+             << "23. Klasoru diske aktar (import)\n"
+             << "24. Dizini klasore aktar (export)\n"
+             << "25. Cikis\n"
              << "===================================\n"
              << "Seciminiz: ";
         cin >> choice;
@@ -44,9 +341,14 @@ int main() {
         cin.ignore(); // yeni satır temizliği
 
         switch (choice) {
-            case 1:
-                fs_format();
+            case 1: {
+                FsGeometry geometry;
+                geometry.volume_size = ask_number("Disk boyutu (byte)", geometry.volume_size);
+                geometry.block_size = ask_number("Blok boyutu (byte)", geometry.block_size);
+                geometry.max_files = ask_number("En fazla dosya sayisi", geometry.max_files);
+                if (!fs_format(geometry)) cout << "Formatlama basarisiz!\n";
                 break;
+            }
             case 2:
                 cout << "Dosya adi: ";
                 getline(cin, name);
@@ -56,14 +358,14 @@ int main() {
                 cout << "Dosya adi: ";
                 getline(cin, name);
                 cout << "Yazilacak veri: ";
-                cin.getline(buffer, sizeof(buffer));
-                if (!fs_write(name, buffer, strlen(buffer)))
+                getline(cin, data);
+                if (!fs_write(name, data.data(), data.size()))
                     cout << "Yazma basarisiz!\n";
                 break;
             case 4: {
                 cout << "Dosya adi: ";
                 getline(cin, name);
-                int size = fs_size(name);
+                int64_t size = fs_size(name);
                 if (size <= 0) {
                     cout << "Dosya bos veya bulunamadi.\n";
                     break;
@@ -79,7 +381,9 @@ int main() {
                 break;
             }
             case 5:
-                fs_ls();
+                cout << "Dizin (bos birakilirsa kok): ";
+                getline(cin, name);
+                fs_ls(name);
                 break;
             case 6:
                 cout << "Silinecek dosya adi: ";
@@ -100,8 +404,8 @@ int main() {
                 cout << "Dosya adi: ";
                 getline(cin, name);
                 cout << "Eklenecek veri: ";
-                cin.getline(buffer, sizeof(buffer));
-                if (!fs_append(name, buffer, strlen(buffer)))
+                getline(cin, data);
+                if (!fs_append(name, data.data(), data.size()))
                     cout << "Ekleme basarisiz!\n";
                 break;
             case 10:
@@ -119,7 +423,7 @@ int main() {
             case 12: {
                 cout << "Dosya adi: ";
                 getline(cin, name);
-                int new_size;
+                int64_t new_size;
                 cout << "Yeni boyut: ";
                 cin >> new_size;
                 if (!fs_truncate(name, new_size)) cout << "Kesme basarisiz!\n";
@@ -145,35 +449,123 @@ int main() {
             case 16:
                 fs_defragment();
                 break;
-            case 17:
+            case 17: {
                 cout << "Yedek dosya adi (örn. disk.bak): ";
                 getline(cin, backup);
-                if (!fs_backup(backup)) cout << "Yedekleme basarisiz!\n";
+                cout << "Sadece son yedekten beri degisen bloklar mi? (e/h): ";
+                getline(cin, name);
+                bool ok = name == "e" ? fs_backup_incremental(backup) : fs_backup(backup);
+                if (!ok) cout << "Yedekleme basarisiz!\n";
                 break;
-            case 18:
-                cout << "Yedegi geri yukle (örn. disk.bak): ";
+            }
+            case 18: {
+                cout << "Tam yedek ve sirayla artimli yedekler (örn. disk.bak disk.inc1): ";
                 getline(cin, backup);
-                if (!fs_restore(backup)) cout << "Geri yukleme basarisiz!\n";
+                vector<string> chain;
+                istringstream words(backup);
+                for (string word; words >> word;) chain.push_back(word);
+                if (!fs_restore_chain(chain)) cout << "Geri yukleme basarisiz!\n";
                 break;
-            case 19:
+            }
+            case 19: {
                 cout << "1. Dosya adı: ";
                 getline(cin, name);
                 cout << "2. Dosya adı: ";
                 getline(cin, name2);
-                cout << (fs_diff(name, name2) ? "Dosyalar ayni.\n" : "Dosyalar farkli.\n");
+                FsDiffReport report;
+                if (!fs_diff_report(name, name2, report)) {
+                    cout << "Karsilastirma basarisiz!\n";
+                } else if (report.first_difference < 0) {
+                    cout << "Dosyalar ayni.\n";
+                } else {
+                    cout << "Dosyalar farkli. Ilk fark: " << report.first_difference << ". bayt\n"
+                         << "Farkli bloklar:";
+                    for (const auto &r : report.ranges) {
+                        cout << " " << r.first;
+                        if (r.second > 1) cout << "-" << r.first + r.second - 1;
+                    }
+                    cout << "\n";
+                }
                 break;
+            }
             case 20:
+                fs_stats_print(fs_stats());
+                break;
+            case 21:
+                cout << "Dizin yolu (orn. belgeler/2024): ";
+                getline(cin, name);
+                if (!fs_mkdir(name)) cout << "Dizin olusturulamadi!\n";
+                break;
+            case 22:
+                cout << "Silinecek dizin: ";
+                getline(cin, name);
+                if (!fs_rmdir(name)) cout << "Dizin silinemedi!\n";
+                break;
+            case 23:
+                cout << "Diskin disindaki klasor: ";
+                getline(cin, name);
+                cout << "Hedef dizin (bos birakilirsa kok): ";
+                getline(cin, name2);
+                if (!fs_import_tree(name, name2)) cout << "Aktarma basarisiz!\n";
+                break;
+            case 24:
+                cout << "Dizin (bos birakilirsa kok): ";
+                getline(cin, name);
+                cout << "Hedef klasor: ";
+                getline(cin, name2);
+                if (!fs_export_tree(name, name2)) cout << "Aktarma basarisiz!\n";
+                break;
+            case 25:
                 cout << "Cikiliyor...\n";
                 break;
             default:
                 cout << "Gecersiz secim.\n";
         }
 
-        if (choice != 20) pause_();
+        if (choice != 25) pause_();
+
+    } while (choice != 25 && cin);
+}
 
-    } while (choice != 20);
+int main(int argc, char **argv) {
+    if (argc == 1) {
+        interactive();
+        return 0;
+    }
+
+    BatchOptions options;
+    vector<string> inline_commands;
+    string script;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-e" && i + 1 < argc) inline_commands.push_back(argv[++i]);
+        else if (arg == "--disk" && i + 1 < argc) options.disk = argv[++i];
+        else if (arg == "--time") options.timing = true;
+        else if (arg == "--keep-going") options.keep_going = true;
+        else if (arg == "--mmap") options.mount.use_mmap = true;
+        else if (arg == "--sync") options.mount.sync_each_op = true;
+        else if (arg == "--verify") options.mount.verify_reads = true;
+        else if (arg == "--cache" && i + 1 < argc) options.mount.cache_bytes = strtoull(argv[++i], nullptr, 10) << 20;
+        else if (arg == "--direct") options.mount.direct_io = true;
+        else if (arg == "--uring") options.mount.io_uring = true;
+        else if (arg == "--threads" && i + 1 < argc) options.threads = atoi(argv[++i]);
+        else if (arg[0] != '-' || arg == "-") script = arg;
+        else if (arg == "--help" || arg == "-h") {
+            usage();
+            return 0;
+        } else {
+            usage();
+            return 2;
+        }
+    }
 
-    return 0;
+    if (script.empty() || script == "-") return run_batch(options, cin, inline_commands);
+    ifstream in(script);
+    if (!in) {
+        cerr << script << " acilamadi.\n";
+        return 1;
+    }
+    return run_batch(options, in, inline_commands);
 }
 
 